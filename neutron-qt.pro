@@ -174,6 +174,7 @@ HEADERS += src/activemasternode.h \
     src/bitcoinrpc.h \
     src/chainparams.h \
     src/checkpoints.h \
+    src/checkqueue.h \
     src/clientversion.h \
     src/crypter.h \
     src/compat.h \
@@ -520,6 +521,15 @@ contains(USE_UPNP, -) {
     win32:LIBS += -liphlpapi
 }
 
+# use: qmake "USE_SECP256K1=1"
+# libsecp256k1 (built with --enable-module-recovery) must be installed for support
+contains(USE_SECP256K1, 1) {
+    message(Building with libsecp256k1 signature verification)
+    DEFINES += USE_SECP256K1
+    INCLUDEPATH += $$SECP256K1_INCLUDE_PATH
+    LIBS += $$join(SECP256K1_LIB_PATH,,-L,) -lsecp256k1
+}
+
 # use: qmake "USE_QRCODE=1"
 # libqrencode (http://fukuchi.org/works/qrencode/index.en.html) must be installed for support
 contains(USE_QRCODE, 1) {
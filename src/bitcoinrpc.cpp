@@ -420,6 +420,7 @@ static const CRPCCommand vRPCCommands[] =
     { "getminingreport",        &getminingreport,        false,      false},
 
     /* Wallet */
+    { "abortrescan",            &abortrescan,            true,       true },
     { "addmultisigaddress",     &addmultisigaddress,     false,      false },
     { "backupwallet",           &backupwallet,           true,       false },
     { "dumpprivkey",            &dumpprivkey,            false,      false },
@@ -144,9 +144,9 @@ void ProcessMessageDarksend(CNode* pfrom, std::string& strCommand, CDataStream&
         vRecv >> nDenom >> txCollateral;
 
         std::string error = "";
-        int mn = GetMasternodeByVin(activeMasternode.vin);
+        CMasternode mn;
 
-        if (mn == -1)
+        if (!mnodeman.Get(activeMasternode.vin, mn))
         {
             std::string strError = _("Not in the masternode list.");
             LogPrintf("dsa -- not in the masternode list! \n");
@@ -158,11 +158,11 @@ void ProcessMessageDarksend(CNode* pfrom, std::string& strCommand, CDataStream&
 
         if (darkSendPool.sessionUsers == 0)
         {
-            if (vecMasternodes[mn].nLastDsq != 0 && vecMasternodes[mn].nLastDsq +
+            if (mn.nLastDsq != 0 && mn.nLastDsq +
                 CountMasternodesAboveProtocol(darkSendPool.MIN_PEER_PROTO_VERSION) / 5 > darkSendPool.nDsqCount)
             {
                 if (fDebug)
-                    LogPrintf("dsa -- last dsq too recent, must wait. %s \n", vecMasternodes[mn].addr.ToString().c_str());
+                    LogPrintf("dsa -- last dsq too recent, must wait. %s \n", mn.addr.ToString().c_str());
 
                 std::string strError = _("Last Darksend was too recent.");
 
@@ -205,9 +205,9 @@ void ProcessMessageDarksend(CNode* pfrom, std::string& strCommand, CDataStream&
         if (dsq.IsExpired())
             return;
 
-        int mn = GetMasternodeByVin(dsq.vin);
+        CMasternode mn;
 
-        if (mn == -1)
+        if (!mnodeman.Get(dsq.vin, mn))
             return;
 
         // if the queue is ready, submit if we can
@@ -240,26 +240,29 @@ void ProcessMessageDarksend(CNode* pfrom, std::string& strCommand, CDataStream&
 
             if(fDebug)
             {
-                LogPrintf("dsq last %d last2 %d count %d\n", vecMasternodes[mn].nLastDsq,
-                          vecMasternodes[mn].nLastDsq + (int)vecMasternodes.size()  /5, darkSendPool.nDsqCount);
+                LogPrintf("dsq last %d last2 %d count %d\n", mn.nLastDsq,
+                          mn.nLastDsq + mnodeman.size() / 5, darkSendPool.nDsqCount);
             }
 
             // don't allow a few nodes to dominate the queuing process
-            if (vecMasternodes[mn].nLastDsq != 0 && vecMasternodes[mn].nLastDsq +
+            if (mn.nLastDsq != 0 && mn.nLastDsq +
                 CountMasternodesAboveProtocol(darkSendPool.MIN_PEER_PROTO_VERSION)/5 > darkSendPool.nDsqCount)
             {
                 if (fDebug)
                 {
                     LogPrintf("dsq -- masternode sending too many dsq messages. %s \n",
-                              vecMasternodes[mn].addr.ToString().c_str());
+                              mn.addr.ToString().c_str());
                 }
 
                 return;
             }
 
             darkSendPool.nDsqCount++;
-            vecMasternodes[mn].nLastDsq = darkSendPool.nDsqCount;
-            vecMasternodes[mn].allowFreeTx = true;
+
+            mnodeman.Update(dsq.vin, [](CMasternode& mnUpdate) {
+                mnUpdate.nLastDsq = darkSendPool.nDsqCount;
+                mnUpdate.allowFreeTx = true;
+            });
 
             if (fDebug)
                 LogPrintf("dsq - new darksend queue object - %s\n", addr.ToString().c_str());
@@ -620,9 +623,7 @@ bool CDarkSendSigner::VerifyMessage(CPubKey pubkey, vector<unsigned char>& vchSi
     ss << strMessageMagic;
     ss << strMessage;
 
-    CKey key;
-    key.SetPubKey(pubkey);
-    return key.Verify(ss.GetHash(), vchSig);
+    return pubkey.Verify(ss.GetHash(), vchSig);
 }
 
 bool CDarksendQueue::Sign()
@@ -672,22 +673,19 @@ bool CDarksendQueue::Relay()
 
 bool CDarksendQueue::CheckSignature()
 {
-    BOOST_FOREACH(CMasternode& mn, vecMasternodes)
-    {
-        if (mn.vin == vin)
-        {
-            std::string errorMessage = "";
-            std::string strMessage = vin.ToString() + boost::lexical_cast<std::string>(nDenom) +
-                                     boost::lexical_cast<std::string>(time) + boost::lexical_cast<std::string>(ready);
+    CMasternode mn;
 
-            if (!darkSendSigner.VerifyMessage(mn.pubkey2, vchSig, strMessage, errorMessage))
-                return error("CDarksendQueue::CheckSignature() - Got bad masternode address signature %s \n", vin.ToString().c_str());
+    if (!mnodeman.Get(vin, mn))
+        return false;
 
-            return true;
-        }
-    }
+    std::string errorMessage = "";
+    std::string strMessage = vin.ToString() + boost::lexical_cast<std::string>(nDenom) +
+                             boost::lexical_cast<std::string>(time) + boost::lexical_cast<std::string>(ready);
 
-    return false;
+    if (!darkSendSigner.VerifyMessage(mn.pubkey2, vchSig, strMessage, errorMessage))
+        return error("CDarksendQueue::CheckSignature() - Got bad masternode address signature %s \n", vin.ToString().c_str());
+
+    return true;
 }
 
 // TODO: Rename and move to core
@@ -717,23 +715,6 @@ void ThreadCheckDarkSend(CConnman& connman)
         {
             nTick++;
 
-            {
-                if (nTick % 60 == 0)
-                {
-                    LOCK(cs_main);
-
-                    // cs_main is required for doing CMasternode.Check because something
-                    // is modifying the coins view without a mempool lock. It causes
-                    // segfaults from this code without the cs_main lock.
-
-                    if (fDebug)
-                        LogPrintf("%s : Check timeout\n", __func__);
-
-                    mnodeman.CheckAndRemove();
-                    masternodePayments.CleanPaymentList();
-                }
-            }
-
             if (fDebug)
                 LogPrintf("%s : %d, %d\n", nTick % 5, __func__, requestedMasterNodeList);
 
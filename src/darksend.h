@@ -163,11 +163,11 @@ public:
 
     bool GetAddress(CService &addr)
     {
-        CMasternode* pmn = mnodeman.Find(vin);
+        CMasternode mn;
 
-        if (pmn != NULL)
+        if (mnodeman.Get(vin, mn))
         {
-            addr = pmn->addr;
+            addr = mn.addr;
             return true;
         }
 
@@ -176,11 +176,11 @@ public:
 
     bool GetProtocolVersion(int &protocolVersion)
     {
-        CMasternode* pmn = mnodeman.Find(vin);
+        CMasternode mn;
 
-        if (pmn != NULL)
+        if (mnodeman.Get(vin, mn))
         {
-            protocolVersion = pmn->protocolVersion;
+            protocolVersion = mn.protocolVersion;
             return true;
         }
 
@@ -19,6 +19,8 @@
 #include "utiltime.h"
 #include "ui_interface.h"
 #include "checkpoints.h"
+#include "kernel.h"
+#include "txmempool.h"
 
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
@@ -148,7 +150,9 @@ bool PrepareShutdown()
     RenameThread("neutron-shutoff");
 
     nTransactionsUpdated++;
+    DumpMasternodes();
     CTxDB().Close();
+    CloseBlockFiles();
     bitdb.Flush(false);
     LogPrintf("%s: call ConnMan::reset\n", __func__);
     g_connman.reset();
@@ -341,11 +345,19 @@ std::string HelpMessage()
         "  -wallet=<dir>          " + _("Specify wallet file (within data directory)") + "\n" +
         "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 64)") + "\n" +
         "  -dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n" +
+        "  -blockfilecache=<n>    " + strprintf(_("Keep at most <n> block files open for reading (default: %u)"), DEFAULT_BLOCKFILE_CACHE_SIZE) + "\n" +
+        "  -maxmempool=<n>        " + strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE) + "\n" +
+        "  -mempoolexpiry=<n>     " + strprintf(_("Do not keep transactions in the memory pool longer than <n> hours (default: %u)"), DEFAULT_MEMPOOL_EXPIRY) + "\n" +
+        "  -sigbackend=<name>     " + strprintf(_("Signature verification backend, secp256k1 or openssl (default: %s)"), GetSigVerifyBackendName(GetSigVerifyBackend())) + "\n" +
+        "  -maxsigcachesize=<n>   " + _("Limit size of signature cache to <n> entries (default: 50000)") + "\n" +
+        "  -par=<n>               " + strprintf(_("Set the number of script verification threads (up to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS) + "\n" +
         "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n" +
         "  -proxy=<ip:port>       " + _("Connect through socks proxy") + "\n" +
         "  -dns                   " + _("Allow DNS lookups for -addnode, -seednode and -connect") + "\n" +
         "  -port=<port>           " + _("Listen for connections on <port> (default: 32001 or testnet: 25714)") + "\n" +
         "  -maxconnections=<n>    " + _("Maintain at most <n> connections to peers (default: 125)") + "\n" +
+        "  -socketevents=<mode>   " + strprintf(_("Wait for socket events with epoll (Linux only) or select (default: %s)"), GetSocketEventsModeName(DEFAULT_SOCKETEVENTS)) + "\n" +
+        "  -msghandthreads=<n>    " + strprintf(_("Set the number of message processing threads (up to %d, 0 = one per core, default: %d)"), MAX_MSGHANDLER_THREADS, DEFAULT_MSGHANDLER_THREADS) + "\n" +
         "  -addnode=<ip>          " + _("Add a node to connect to and attempt to keep the connection open") + "\n" +
         "  -connect=<ip>          " + _("Connect only to the specified node(s)") + "\n" +
         "  -seednode=<ip>         " + _("Connect to a node to retrieve peer addresses, and disconnect") + "\n" +
@@ -356,6 +368,7 @@ std::string HelpMessage()
         "  -bind=<addr>           " + _("Bind to given address. Use [host]:port notation for IPv6") + "\n" +
         "  -dnsseed               " + _("Find peers using DNS lookup (default: 1)") + "\n" +
         "  -staking               " + _("Stake your coins to support network and gain reward (default: 1)") + "\n" +
+        "  -stakethreads=<n>      " + strprintf(_("Set the number of threads searching for stake kernels (up to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), MAX_STAKE_THREADS, DEFAULT_STAKE_THREADS) + "\n" +
         "  -synctime              " + _("Sync time with other nodes. Disable if time on your system is precise e.g. syncing with NTP (default: 1)") + "\n" +
         "  -cppolicy              " + _("Sync checkpoints policy (default: strict)") + "\n" +
         "  -banscore=<n>          " + _("Threshold for disconnecting misbehaving peers (default: 100)") + "\n" +
@@ -558,11 +571,18 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     int nBind = std::max((mapMultiArgs.count("-bind") ? mapMultiArgs.at("-bind").size() : 0) +
                          (mapMultiArgs.count("-whitebind") ? mapMultiArgs.at("-whitebind").size() : 0), size_t(1));
 
+    SocketEventsMode socketEventsMode = DEFAULT_SOCKETEVENTS;
+
+    if (mapArgs.count("-socketevents") && !ParseSocketEventsMode(mapArgs["-socketevents"], socketEventsMode))
+        return InitError(strprintf(_("Unsupported socket events mode -socketevents=%s"), mapArgs["-socketevents"].c_str()));
+
     nUserMaxConnections = GetArg("-maxconnections", DEFAULT_MAX_PEER_CONNECTIONS);
     nMaxConnections = std::max(nUserMaxConnections, 0);
 
-    // Trim requested connection counts, to fit into system limitations
-    nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS - MAX_ADDNODE_CONNECTIONS)), 0);
+    // Trim requested connection counts, to fit into system limitations; only select() is bound by FD_SETSIZE
+    if (socketEventsMode == SOCKETEVENTS_SELECT)
+        nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS - MAX_ADDNODE_CONNECTIONS)), 0);
+
     nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS + MAX_ADDNODE_CONNECTIONS);
 
     if (nFD < MIN_CORE_FILEDESCRIPTORS)
@@ -645,6 +665,40 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     nMaxTipAge = GetArg("-maxtipage", DEFAULT_MAX_TIP_AGE);
 
+    std::string strSigBackend = GetArg("-sigbackend", GetSigVerifyBackendName(GetSigVerifyBackend()));
+
+    if (strSigBackend == "openssl")
+        SetSigVerifyBackend(SIGVERIFY_OPENSSL);
+    else if (strSigBackend == "secp256k1")
+    {
+        if (!SetSigVerifyBackend(SIGVERIFY_SECP256K1))
+            return InitError(_("This build does not include the secp256k1 signature backend."));
+    }
+    else
+        return InitError(strprintf(_("Unknown signature backend -sigbackend=%s"), strSigBackend.c_str()));
+
+    // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
+    nScriptCheckThreads = GetArg("-par", DEFAULT_SCRIPTCHECK_THREADS);
+
+    if (nScriptCheckThreads <= 0)
+        nScriptCheckThreads += boost::thread::hardware_concurrency();
+
+    if (nScriptCheckThreads <= 1)
+        nScriptCheckThreads = 0;
+    else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
+        nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
+
+    // -stakethreads=0 means autodetect, the stake miner thread itself always searches
+    nStakeThreads = GetArg("-stakethreads", DEFAULT_STAKE_THREADS);
+
+    if (nStakeThreads <= 0)
+        nStakeThreads += boost::thread::hardware_concurrency();
+
+    if (nStakeThreads < 1)
+        nStakeThreads = 1;
+    else if (nStakeThreads > MAX_STAKE_THREADS)
+        nStakeThreads = MAX_STAKE_THREADS;
+
 
     // ********************************************************* Step 4: application initialization: dir lock, daemonize, pidfile, debug log
 
@@ -713,6 +767,10 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     }
 
+    // Start the lightweight task scheduler thread
+    CScheduler::Function serviceLoop = boost::bind(&CScheduler::serviceQueue, &scheduler);
+    threadGroup.create_thread(boost::bind(&TraceThread<CScheduler::Function>, "scheduler", serviceLoop));
+
     int64_t nStart;
 
     // ********************************************************* Step 5: verify database integrity
@@ -901,6 +959,17 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     // ********************************************************* Step 7: load blockchain
 
+    LogPrintf("Using %s for signature verification\n", GetSigVerifyBackendName(GetSigVerifyBackend()));
+
+    // The block-connecting thread works through the queue as well, so start one thread less
+    if (nScriptCheckThreads)
+    {
+        LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
+
+        for (int i = 0; i < nScriptCheckThreads - 1; i++)
+            threadGroup.create_thread(&ThreadScriptCheck);
+    }
+
     if (!bitdb.Open(GetDataDir()))
     {
         string msg = strprintf(_("Error initializing database environment %s!"
@@ -1058,6 +1127,16 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     LogPrintf("[AppInit2]  wallet      %15dms\n", GetTimeMillis() - nStart);
 
     RegisterWallet(pwalletMain);
+
+    // The stake miner thread searches for kernels as well, so start one thread less
+    if (GetBoolArg("-staking", true) && nStakeThreads > 1)
+    {
+        LogPrintf("Using %u threads for stake kernel search\n", nStakeThreads);
+
+        for (int i = 0; i < nStakeThreads - 1; i++)
+            threadGroup.create_thread(&ThreadStakeKernelSearch);
+    }
+
     CBlockIndex *pindexRescan = pindexBest;
 
     if (GetBoolArg("-rescan"))
@@ -1218,7 +1297,20 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     */
 
     darkSendPool.InitCollateralAddress();
+
+    // a list cached by the last run that still checks out lets staking resume without waiting on dseg
+    if (LoadMasternodes())
+    {
+        LogPrintf("Masternode list restored from mncache.dat, not waiting for mnsync\n");
+
+        masternodePayments.ProcessBlock(pindexBest->nHeight);
+        masternodePayments.ProcessBlock(pindexBest->nHeight + 1);
+        masternodePayments.ProcessBlock(pindexBest->nHeight + 2);
+        isMasternodeListSynced = true;
+    }
+
     threadGroup.create_thread(boost::bind(&ThreadCheckDarkSend, boost::ref(*g_connman)));
+    ScheduleMasternodeChecks(scheduler);
     RandAddSeedPerfmon();
 
     //// debug print
@@ -1233,6 +1325,15 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     connOptions.nMaxOutbound = std::min(MAX_OUTBOUND_CONNECTIONS, connOptions.nMaxConnections);
     connOptions.nMaxAddnode = MAX_ADDNODE_CONNECTIONS;
     connOptions.nMaxFeeler = 1;
+    connOptions.socketEventsMode = socketEventsMode;
+
+    // -msghandthreads=0 means one thread per core
+    connOptions.nMessageHandlerThreads = GetArg("-msghandthreads", DEFAULT_MSGHANDLER_THREADS);
+
+    if (connOptions.nMessageHandlerThreads <= 0)
+        connOptions.nMessageHandlerThreads = boost::thread::hardware_concurrency();
+
+    connOptions.nMessageHandlerThreads = std::max(1, std::min(connOptions.nMessageHandlerThreads, MAX_MSGHANDLER_THREADS));
 
     if (!connman.Start(scheduler, connOptions))
     {
@@ -11,8 +11,18 @@
 #include "kernel.h"
 #include "txdb.h"
 
+#include <atomic>
+#include <mutex>
+
+#include <openssl/sha.h>
+#include <boost/thread/tss.hpp>
+
+#include "checkqueue.h"
+
 //using namespace std;
 
+int nStakeThreads = DEFAULT_STAKE_THREADS;
+
 typedef std::map<int, unsigned int> MapModifierCheckpoints;
 
 // Hard checkpoints of stake modifiers to ensure they are deterministic
@@ -244,6 +254,102 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
     return true;
 }
 
+// Memoised results of GetKernelStakeModifier for the main chain blocks a v1 kernel can still come from.
+// The walk from a block always ends on the first later block generating a stake modifier with a time
+// at least a selection interval past it, so that block is all there is to remember. An entry stays
+// valid as long as that block is still in the main chain.
+static CCriticalSection cs_kernelModifierCache;
+static std::vector<const CBlockIndex*> vKernelModifierBlock;
+
+// Main chain blocks whose selection interval has not been closed yet, by the time closing it
+static std::multimap<int64_t, int> mapKernelModifierPending;
+
+void ConnectKernelStakeModifier(const CBlockIndex* pindex)
+{
+    LOCK(cs_kernelModifierCache);
+
+    // v1 kernels are not checked past the protocol switch, nothing left to cache for
+    if (GetPOSProtocolVersion(pindex->nHeight + 1) == 2)
+    {
+        if (!vKernelModifierBlock.empty())
+        {
+            std::vector<const CBlockIndex*>().swap(vKernelModifierBlock);
+            mapKernelModifierPending.clear();
+        }
+
+        return;
+    }
+
+    if (pindex->GeneratedStakeModifier())
+    {
+        std::multimap<int64_t, int>::iterator itEnd = mapKernelModifierPending.upper_bound(pindex->GetBlockTime());
+
+        for (std::multimap<int64_t, int>::iterator it = mapKernelModifierPending.begin(); it != itEnd; ++it)
+        {
+            if (it->second < (int)vKernelModifierBlock.size())
+                vKernelModifierBlock[it->second] = pindex;
+        }
+
+        mapKernelModifierPending.erase(mapKernelModifierPending.begin(), itEnd);
+    }
+
+    vKernelModifierBlock.resize(pindex->nHeight + 1, NULL);
+    vKernelModifierBlock[pindex->nHeight] = NULL;
+    mapKernelModifierPending.insert(std::make_pair(pindex->GetBlockTime() + GetStakeModifierSelectionInterval(),
+                                                   pindex->nHeight));
+}
+
+void DisconnectKernelStakeModifier(const CBlockIndex* pindex)
+{
+    LOCK(cs_kernelModifierCache);
+
+    if ((int)vKernelModifierBlock.size() <= pindex->nHeight)
+        return;
+
+    vKernelModifierBlock.resize(pindex->nHeight);
+
+    for (std::multimap<int64_t, int>::iterator it = mapKernelModifierPending.begin(); it != mapKernelModifierPending.end();)
+    {
+        if (it->second >= pindex->nHeight)
+            mapKernelModifierPending.erase(it++);
+        else
+            ++it;
+    }
+
+    // Reopen the intervals this block or a later one had closed; older blocks missed here
+    // simply fall back to walking the chain in GetKernelStakeModifier
+    int64_t nSelectionInterval = GetStakeModifierSelectionInterval();
+
+    for (const CBlockIndex* pindexFrom = pindex->pprev; pindexFrom; pindexFrom = pindexFrom->pprev)
+    {
+        if (pindexFrom->GetBlockTime() + 2 * nSelectionInterval < pindex->GetBlockTime())
+            break;
+
+        const CBlockIndex*& pindexModifier = vKernelModifierBlock[pindexFrom->nHeight];
+
+        if (pindexModifier && pindexModifier->nHeight >= pindex->nHeight)
+        {
+            pindexModifier = NULL;
+            mapKernelModifierPending.insert(std::make_pair(pindexFrom->GetBlockTime() + nSelectionInterval,
+                                                           pindexFrom->nHeight));
+        }
+    }
+}
+
+void LoadKernelStakeModifierCache()
+{
+    if (!pindexGenesisBlock || !pindexBest || GetPOSProtocolVersion(pindexBest->nHeight + 1) == 2)
+        return;
+
+    int64_t nStart = GetTimeMillis();
+
+    for (const CBlockIndex* pindex = pindexGenesisBlock; pindex; pindex = pindex->pnext)
+        ConnectKernelStakeModifier(pindex);
+
+    LogPrint("bench", "%s : %u kernel stake modifiers cached in %dms\n", __func__,
+             vKernelModifierBlock.size(), GetTimeMillis() - nStart);
+}
+
 // The stake modifier used to hash for a stake kernel is chosen as the stake
 // modifier about a selection interval later than the coin generating the kernel
 static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight,
@@ -255,6 +361,26 @@ static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifi
         return error("%s : block not indexed", __func__);
 
     const CBlockIndex* pindexFrom = mapBlockIndex[hashBlockFrom];
+    bool fCacheable = pindexFrom->IsInMainChain();
+
+    if (fCacheable)
+    {
+        LOCK(cs_kernelModifierCache);
+
+        if (pindexFrom->nHeight < (int)vKernelModifierBlock.size())
+        {
+            const CBlockIndex* pindexModifier = vKernelModifierBlock[pindexFrom->nHeight];
+
+            if (pindexModifier && pindexModifier->IsInMainChain())
+            {
+                nStakeModifier = pindexModifier->nStakeModifier;
+                nStakeModifierHeight = pindexModifier->nHeight;
+                nStakeModifierTime = pindexModifier->GetBlockTime();
+                return true;
+            }
+        }
+    }
+
     nStakeModifierHeight = pindexFrom->nHeight;
     nStakeModifierTime = pindexFrom->GetBlockTime();
     int64_t nStakeModifierSelectionInterval = GetStakeModifierSelectionInterval();
@@ -285,6 +411,15 @@ static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifi
     }
 
     nStakeModifier = pindex->nStakeModifier;
+
+    if (fCacheable)
+    {
+        LOCK(cs_kernelModifierCache);
+
+        if (pindexFrom->nHeight < (int)vKernelModifierBlock.size())
+            vKernelModifierBlock[pindexFrom->nHeight] = pindex;
+    }
+
     return true;
 }
 
@@ -308,25 +443,21 @@ static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifi
 //   block/tx hash should not be used here as they can be generated in vast
 //   quantities so as to generate blocks faster, degrading the system back into
 //   a proof-of-work situation.
-static bool CheckStakeKernelHashV1(unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset,
-                                   const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx,
-                                   uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
+static bool CheckStakeKernelHashV1(unsigned int nBits, const uint256& hashBlockFrom, unsigned int nTimeBlockFrom,
+                                   unsigned int nTxPrevOffset, unsigned int nTimeTxPrev, int64_t nValueIn,
+                                   const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake,
+                                   uint256& targetProofOfStake, bool fPrintProofOfStake)
 {
-    if (nTimeTx < txPrev.nTime)  // Transaction timestamp violation
+    if (nTimeTx < nTimeTxPrev)  // Transaction timestamp violation
         return error("%s : nTime violation", __func__);
 
-    unsigned int nTimeBlockFrom = blockFrom.GetBlockTime();
-
     if (nTimeBlockFrom + nStakeMinAge > nTimeTx) // Min age requirement
         return error("%s : min age violation", __func__);
 
     CBigNum bnTargetPerCoinDay;
     bnTargetPerCoinDay.SetCompact(nBits);
-    int64_t nValueIn = txPrev.vout[prevout.n].nValue;
-
-    uint256 hashBlockFrom = blockFrom.GetHash();
 
-    CBigNum bnCoinDayWeight = CBigNum(nValueIn) * GetWeight((int64_t) txPrev.nTime, (int64_t )nTimeTx) / COIN / (24 * 60 * 60);
+    CBigNum bnCoinDayWeight = CBigNum(nValueIn) * GetWeight((int64_t) nTimeTxPrev, (int64_t )nTimeTx) / COIN / (24 * 60 * 60);
 
     if (fTestNet)
         bnCoinDayWeight *= 1000;
@@ -344,7 +475,7 @@ static bool CheckStakeKernelHashV1(unsigned int nBits, const CBlock& blockFrom,
         return false;
 
     ss << nStakeModifier;
-    ss << nTimeBlockFrom << nTxPrevOffset << txPrev.nTime << prevout.n << nTimeTx;
+    ss << nTimeBlockFrom << nTxPrevOffset << nTimeTxPrev << prevout.n << nTimeTx;
     hashProofOfStake = Hash(ss.begin(), ss.end());
 
     if (fPrintProofOfStake)
@@ -353,11 +484,11 @@ static bool CheckStakeKernelHashV1(unsigned int nBits, const CBlock& blockFrom,
                   __func__, boost::lexical_cast<std::string>(nStakeModifier).c_str(), nStakeModifierHeight,
                   DateTimeStrFormat("%Y-%m-%d %H:%M:%S", nStakeModifierTime).c_str(),
                   mapBlockIndex[hashBlockFrom]->nHeight, DateTimeStrFormat("%Y-%m-%d %H:%M:%S",
-                  blockFrom.GetBlockTime()).c_str());
+                  nTimeBlockFrom).c_str());
 
         LogPrintf("%s : check modifier=%s nTimeBlockFrom=%u prevoutHash=%u nTimeTxPrev=%u nPrevout=%u "
                   "nTimeTx=%u hashProof=%s\n", __func__, boost::lexical_cast<std::string>(nStakeModifier).c_str(),
-                  nTimeBlockFrom, nTxPrevOffset, txPrev.nTime, prevout.n, nTimeTx,
+                  nTimeBlockFrom, nTxPrevOffset, nTimeTxPrev, prevout.n, nTimeTx,
                   hashProofOfStake.ToString().c_str());
     }
 
@@ -381,17 +512,223 @@ static bool CheckStakeKernelHashV1(unsigned int nBits, const CBlock& blockFrom,
                   __func__, boost::lexical_cast<std::string>(nStakeModifier).c_str(), nStakeModifierHeight,
                   DateTimeStrFormat("%Y-%m-%d %H:%M:%S", nStakeModifierTime).c_str(),
                   mapBlockIndex[hashBlockFrom]->nHeight, DateTimeStrFormat("%Y-%m-%d %H:%M:%S",
-                  blockFrom.GetBlockTime()).c_str());
+                  nTimeBlockFrom).c_str());
 
         LogPrintf("%s : pass modifier=%s nTimeBlockFrom=%u nTxPrevOffset=%u nTimeTxPrev=%u nPrevout=%u "
                   "nTimeTx=%u hashProof=%s\n", __func__, boost::lexical_cast<std::string>(nStakeModifier).c_str(),
-                  nTimeBlockFrom, nTxPrevOffset, txPrev.nTime, prevout.n, nTimeTx,
+                  nTimeBlockFrom, nTxPrevOffset, nTimeTxPrev, prevout.n, nTimeTx,
                   hashProofOfStake.ToString().c_str());
     }
 
     return true;
 }
 
+CStakeKernel::CStakeKernel(uint64_t nStakeModifier, unsigned int nBits, unsigned int nTimeBlockFromIn,
+                           unsigned int nTimeTxPrevIn, int64_t nValueIn, const COutPoint& prevout)
+    : nTimeBlockFrom(nTimeBlockFromIn), nTimeTxPrev(nTimeTxPrevIn)
+{
+    // Same bytes as ss << nStakeModifier << nTimeBlockFrom << txPrev.nTime << prevout.hash << prevout.n << nTimeTx,
+    // the integers being serialized in host order like WRITEDATA does
+    memcpy(&vchPreimage[0], &nStakeModifier, 8);
+    memcpy(&vchPreimage[8], &nTimeBlockFrom, 4);
+    memcpy(&vchPreimage[12], &nTimeTxPrev, 4);
+    memcpy(&vchPreimage[16], prevout.hash.begin(), 32);
+    memcpy(&vchPreimage[48], &prevout.n, 4);
+    memset(&vchPreimage[52], 0, 4);
+
+    CBigNum bnTarget;
+    bnTarget.SetCompact(nBits);
+    bnTarget *= CBigNum(nValueIn);
+
+    hashTarget = bnTarget.getuint256();
+    fTargetOverflow = bnTarget.bitSize() > 256;
+}
+
+uint256 CStakeKernel::GetHash(unsigned int nTimeTx) const
+{
+    unsigned char vch[PREIMAGE_SIZE];
+    memcpy(vch, vchPreimage, PREIMAGE_SIZE - 4);
+    memcpy(&vch[PREIMAGE_SIZE - 4], &nTimeTx, 4);
+
+    uint256 hash1;
+    SHA256(vch, PREIMAGE_SIZE, (unsigned char*)&hash1);
+    uint256 hash2;
+    SHA256((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
+    return hash2;
+}
+
+bool CStakeKernel::Check(unsigned int nTimeTx, uint256& hashProofOfStake) const
+{
+    if (nTimeTx < nTimeTxPrev || nTimeBlockFrom + nStakeMinAge > nTimeTx)
+        return false;
+
+    hashProofOfStake = GetHash(nTimeTx);
+    return MeetsTarget(hashProofOfStake);
+}
+
+// Shared state of one SearchStakeKernel call
+struct CStakeKernelSearch
+{
+    CBlockIndex* pindexPrev;
+    unsigned int nBits;
+    const std::vector<CStakeKernelInput>* pvInputs;
+    unsigned int nTimeTx;
+    unsigned int nSearchInterval;
+    bool fKernelV2;
+
+    std::atomic<bool> fFound;
+    std::mutex mutex;
+    unsigned int nInputFound;
+    unsigned int nTimeTxFound;
+
+    bool IsCancelled() const
+    {
+        return fFound || fShutdown || pindexPrev != pindexBest;
+    }
+};
+
+static std::atomic<uint64_t> vStakeThreadCoins[MAX_STAKE_THREADS];
+static std::atomic<uint64_t> vStakeThreadKernels[MAX_STAKE_THREADS];
+static std::atomic<uint64_t> vStakeThreadFound[MAX_STAKE_THREADS];
+static std::atomic<int> nStakeThreadsStarted(0);
+static boost::thread_specific_ptr<int> pStakeThreadSlot;
+
+/** Kernel search over a range of inputs, queued on the stake threads.
+ *  Returns false once a kernel was found, which makes the queue skip the remaining ranges.
+ */
+class CStakeKernelCheck
+{
+private:
+    CStakeKernelSearch* psearch;
+    unsigned int nBegin;
+    unsigned int nEnd;
+
+public:
+    CStakeKernelCheck() : psearch(NULL), nBegin(0), nEnd(0) {}
+    CStakeKernelCheck(CStakeKernelSearch* psearchIn, unsigned int nBeginIn, unsigned int nEndIn) :
+                      psearch(psearchIn), nBegin(nBeginIn), nEnd(nEndIn) {}
+
+    bool operator()()
+    {
+        int nSlot = pStakeThreadSlot.get() ? *pStakeThreadSlot : 0;
+        uint64_t nKernels = 0;
+
+        for (unsigned int i = nBegin; i < nEnd && !psearch->IsCancelled(); i++)
+        {
+            const CStakeKernelInput& input = (*psearch->pvInputs)[i];
+            CStakeKernel kernel(psearch->pindexPrev->nStakeModifier, psearch->nBits, input.nTimeBlockFrom,
+                                input.nTimeTxPrev, input.nValueIn, input.prevout);
+            vStakeThreadCoins[nSlot]++;
+
+            for (unsigned int n = 0; n < psearch->nSearchInterval && !psearch->IsCancelled(); n++)
+            {
+                uint256 hashProofOfStake = 0, targetProofOfStake = 0;
+                unsigned int nTimeTx = psearch->nTimeTx - n;
+                nKernels++;
+
+                if (psearch->fKernelV2 ? kernel.Check(nTimeTx, hashProofOfStake) :
+                    CheckStakeKernelHash(psearch->pindexPrev, psearch->nBits, input.hashBlockFrom, input.nTimeBlockFrom,
+                                         input.nTxPrevOffset, input.nTimeTxPrev, input.nValueIn, input.prevout,
+                                         nTimeTx, hashProofOfStake, targetProofOfStake))
+                {
+                    std::lock_guard<std::mutex> lock(psearch->mutex);
+                    vStakeThreadKernels[nSlot] += nKernels;
+
+                    if (!psearch->fFound)
+                    {
+                        psearch->nInputFound = i;
+                        psearch->nTimeTxFound = nTimeTx;
+                        psearch->fFound = true;
+                        vStakeThreadFound[nSlot]++;
+                    }
+
+                    return false;
+                }
+            }
+        }
+
+        vStakeThreadKernels[nSlot] += nKernels;
+        return !psearch->fFound;
+    }
+
+    void swap(CStakeKernelCheck& check)
+    {
+        std::swap(psearch, check.psearch);
+        std::swap(nBegin, check.nBegin);
+        std::swap(nEnd, check.nEnd);
+    }
+};
+
+static CCheckQueue<CStakeKernelCheck> stakekernelqueue(1);
+
+void ThreadStakeKernelSearch()
+{
+    RenameThread("neutron-stake");
+
+    int nSlot = ++nStakeThreadsStarted;
+    pStakeThreadSlot.reset(new int(std::min(nSlot, MAX_STAKE_THREADS - 1)));
+
+    stakekernelqueue.Thread();
+}
+
+bool SearchStakeKernel(CBlockIndex* pindexPrev, unsigned int nBits, const std::vector<CStakeKernelInput>& vInputs,
+                       unsigned int nTimeTx, unsigned int nSearchInterval, unsigned int& nInputRet,
+                       unsigned int& nTimeTxRet)
+{
+    CStakeKernelSearch search;
+    search.pindexPrev = pindexPrev;
+    search.nBits = nBits;
+    search.pvInputs = &vInputs;
+    search.nTimeTx = nTimeTx;
+    search.nSearchInterval = nSearchInterval;
+    search.fKernelV2 = GetPOSProtocolVersion(pindexPrev->nHeight + 1) == 2;
+    search.fFound = false;
+    int64_t nStart = GetTimeMicros();
+
+    if (nStakeThreads <= 1 || nStakeThreadsStarted == 0 || vInputs.size() < 2)
+        CStakeKernelCheck(&search, 0, vInputs.size())();
+    else
+    {
+        // A few ranges per thread, so threads finishing early can pick up more work
+        unsigned int nRange = std::max((size_t)1, std::min((size_t)64, vInputs.size() / (nStakeThreads * 4)));
+        std::vector<CStakeKernelCheck> vChecks;
+
+        for (unsigned int i = 0; i < vInputs.size(); i += nRange)
+            vChecks.push_back(CStakeKernelCheck(&search, i, std::min(i + nRange, (unsigned int)vInputs.size())));
+
+        // The queue hands out its work last in first, so reverse to search the inputs roughly in order
+        std::reverse(vChecks.begin(), vChecks.end());
+
+        CCheckQueueControl<CStakeKernelCheck> control(&stakekernelqueue);
+        control.Add(vChecks);
+        control.Wait();
+    }
+
+    LogPrint("bench", "%s : %u inputs over %u seconds in %.2fms, %s\n", __func__, vInputs.size(), nSearchInterval,
+             (GetTimeMicros() - nStart) * 0.001, search.fFound ? "found" : "not found");
+
+    if (!search.fFound)
+        return false;
+
+    nInputRet = search.nInputFound;
+    nTimeTxRet = search.nTimeTxFound;
+    return true;
+}
+
+void GetStakeThreadStats(std::vector<CStakeThreadStats>& vStats)
+{
+    vStats.clear();
+
+    for (int i = 0; i <= std::min((int)nStakeThreadsStarted, MAX_STAKE_THREADS - 1); i++)
+    {
+        CStakeThreadStats stats;
+        stats.nCoins = vStakeThreadCoins[i];
+        stats.nKernels = vStakeThreadKernels[i];
+        stats.nFound = vStakeThreadFound[i];
+        vStats.push_back(stats);
+    }
+}
+
 // Buxcoin kernel protocol
 // coinstake must meet hash target according to the protocol:
 // kernel (input 0) must meet the formula
@@ -412,35 +749,25 @@ static bool CheckStakeKernelHashV1(unsigned int nBits, const CBlock& blockFrom,
 //   block/tx hash should not be used here as they can be generated in vast
 //   quantities so as to generate blocks faster, degrading the system back into
 //   a proof-of-work situation.
-static bool CheckStakeKernelHashV2(CBlockIndex* pindexPrev, unsigned int nBits, unsigned int nTimeBlockFrom, const CTransaction& txPrev,
-                                   const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake,
+static bool CheckStakeKernelHashV2(CBlockIndex* pindexPrev, unsigned int nBits, unsigned int nTimeBlockFrom,
+                                   unsigned int nTimeTxPrev, int64_t nValueIn, const COutPoint& prevout,
+                                   unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake,
                                    bool fPrintProofOfStake)
 {
-    if (nTimeTx < txPrev.nTime)  // Transaction timestamp violation
+    if (nTimeTx < nTimeTxPrev)  // Transaction timestamp violation
         return error("%s : nTime violation", __func__);
 
     if (nTimeBlockFrom + nStakeMinAge > nTimeTx) // Min age requirement
         return error("%s : min age violation", __func__);
 
-    // Base target
-    CBigNum bnTarget;
-    bnTarget.SetCompact(nBits);
-
-    // Weighted target
-    int64_t nValueIn = txPrev.vout[prevout.n].nValue;
-    CBigNum bnWeight = CBigNum(nValueIn);
-    bnTarget *= bnWeight;
-
-    targetProofOfStake = bnTarget.getuint256();
-
     uint64_t nStakeModifier = pindexPrev->nStakeModifier;
     int nStakeModifierHeight = pindexPrev->nHeight;
     int64_t nStakeModifierTime = pindexPrev->nTime;
 
-    // Calculate hash
-    CDataStream ss(SER_GETHASH, 0);
-    ss << nStakeModifier << nTimeBlockFrom << txPrev.nTime << prevout.hash << prevout.n << nTimeTx;
-    hashProofOfStake = Hash(ss.begin(), ss.end());
+    // Weighted target and hash
+    CStakeKernel kernel(nStakeModifier, nBits, nTimeBlockFrom, nTimeTxPrev, nValueIn, prevout);
+    targetProofOfStake = kernel.GetTarget();
+    hashProofOfStake = kernel.GetHash(nTimeTx);
 
     if (fPrintProofOfStake)
     {
@@ -449,10 +776,10 @@ static bool CheckStakeKernelHashV2(CBlockIndex* pindexPrev, unsigned int nBits,
                   DateTimeStrFormat(nTimeBlockFrom));
 
         LogPrintf("%s : check modifier=0x%016x nTimeBlockFrom=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
-                  __func__, nStakeModifier, nTimeBlockFrom, txPrev.nTime, prevout.n, nTimeTx, hashProofOfStake.ToString());
+                  __func__, nStakeModifier, nTimeBlockFrom, nTimeTxPrev, prevout.n, nTimeTx, hashProofOfStake.ToString());
                                                                                                 }
         // Now check if proof-of-stake hash meets target protocol
-        if (CBigNum(hashProofOfStake) > bnTarget)
+        if (!kernel.MeetsTarget(hashProofOfStake))
             return false;
 
         if (fDebug && !fPrintProofOfStake)
@@ -462,28 +789,40 @@ static bool CheckStakeKernelHashV2(CBlockIndex* pindexPrev, unsigned int nBits,
                       DateTimeStrFormat(nTimeBlockFrom));
 
             LogPrintf("%s : pass modifier=0x%016x nTimeBlockFrom=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
-                      __func__, nStakeModifier, nTimeBlockFrom, txPrev.nTime, prevout.n, nTimeTx, hashProofOfStake.ToString());
+                      __func__, nStakeModifier, nTimeBlockFrom, nTimeTxPrev, prevout.n, nTimeTx, hashProofOfStake.ToString());
         }
 
         return true;
 }
 
-bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset,
-                          const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake,
-                          uint256& targetProofOfStake, bool fPrintProofOfStake)
+bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, const uint256& hashBlockFrom, unsigned int nTimeBlockFrom,
+                          unsigned int nTxPrevOffset, unsigned int nTimeTxPrev, int64_t nValueIn, const COutPoint& prevout,
+                          unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
 {
     if (GetPOSProtocolVersion(pindexPrev->nHeight + 1) == 2)
     {
-        return CheckStakeKernelHashV2(pindexPrev, nBits, blockFrom.GetBlockTime(), txPrev, prevout, nTimeTx, hashProofOfStake,
-                                      targetProofOfStake, fPrintProofOfStake);
+        return CheckStakeKernelHashV2(pindexPrev, nBits, nTimeBlockFrom, nTimeTxPrev, nValueIn, prevout, nTimeTx,
+                                      hashProofOfStake, targetProofOfStake, fPrintProofOfStake);
     }
     else
     {
-        return CheckStakeKernelHashV1(nBits, blockFrom, nTxPrevOffset, txPrev, prevout, nTimeTx, hashProofOfStake,
-                                      targetProofOfStake, fPrintProofOfStake);
+        return CheckStakeKernelHashV1(nBits, hashBlockFrom, nTimeBlockFrom, nTxPrevOffset, nTimeTxPrev, nValueIn, prevout,
+                                      nTimeTx, hashProofOfStake, targetProofOfStake, fPrintProofOfStake);
     }
 }
 
+bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset,
+                          const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake,
+                          uint256& targetProofOfStake, bool fPrintProofOfStake)
+{
+    if (prevout.n >= txPrev.vout.size())
+        return error("%s : invalid prevout %s", __func__, prevout.ToString());
+
+    return CheckStakeKernelHash(pindexPrev, nBits, blockFrom.GetHash(), blockFrom.GetBlockTime(), nTxPrevOffset, txPrev.nTime,
+                                txPrev.vout[prevout.n].nValue, prevout, nTimeTx, hashProofOfStake, targetProofOfStake,
+                                fPrintProofOfStake);
+}
+
 // Check kernel hash target and coinstake signature
 bool CheckProofOfStake(CBlockIndex *pindexPrev, const CTransaction& tx, unsigned int nBits, uint256& hashProofOfStake, uint256& targetProofOfStake)
 {
@@ -15,14 +15,94 @@ static const int MODIFIER_INTERVAL_RATIO = 3;
 static const int64_t POS_HASHCHECK_MAX_BLOCK_AGE = (60 * 60 * 24 * 2); // 2 days
 static const int STAKE_TIMESTAMP_MASK = 15;
 
+// Threads searching for stake kernels, including the stake miner thread itself
+static const int MAX_STAKE_THREADS = 16;
+static const int DEFAULT_STAKE_THREADS = 1;
+
+extern int nStakeThreads;
+
+/** Proof-of-stake kernel of one coin under protocol v2, for hashing many candidate timestamps.
+ *  The preimage has a fixed 56 byte layout (stake modifier, block time, tx time, prevout hash and
+ *  index, timestamp) that is filled in once, so each timestamp only rewrites its last four bytes
+ *  and hashes them from a stack buffer. The weighted target is also computed once and compared
+ *  as a plain uint256 instead of a CBigNum per candidate.
+ */
+class CStakeKernel
+{
+public:
+    static const size_t PREIMAGE_SIZE = 56;
+
+    CStakeKernel(uint64_t nStakeModifier, unsigned int nBits, unsigned int nTimeBlockFrom,
+                 unsigned int nTimeTxPrev, int64_t nValueIn, const COutPoint& prevout);
+
+    uint256 GetHash(unsigned int nTimeTx) const;
+
+    bool MeetsTarget(const uint256& hashProofOfStake) const
+    {
+        return fTargetOverflow || hashProofOfStake <= hashTarget;
+    }
+
+    // Hash the kernel for nTimeTx and check it against the target, timestamp rules included
+    bool Check(unsigned int nTimeTx, uint256& hashProofOfStake) const;
+
+    const uint256& GetTarget() const { return hashTarget; }
+
+private:
+    unsigned char vchPreimage[PREIMAGE_SIZE];
+    unsigned int nTimeBlockFrom;
+    unsigned int nTimeTxPrev;
+    uint256 hashTarget;
+    bool fTargetOverflow; // weighted target does not fit 256 bits, any hash meets it
+};
+
+/** A coin taking part in a stake kernel search */
+struct CStakeKernelInput
+{
+    COutPoint prevout;
+    uint256 hashBlockFrom;
+    unsigned int nTimeBlockFrom;
+    unsigned int nTxPrevOffset;
+    unsigned int nTimeTxPrev;
+    int64_t nValueIn;
+};
+
+/** Kernel search counters of one stake thread, slot 0 being the stake miner thread */
+struct CStakeThreadStats
+{
+    uint64_t nCoins;
+    uint64_t nKernels;
+    uint64_t nFound;
+};
+
+// Search the timestamps nTimeTx, nTimeTx - 1, ... (nSearchInterval of them) of every input for a kernel
+// meeting the target, spread over the stake threads. Stops early once any thread finds one, on shutdown
+// or when pindexBest moves away from pindexPrev.
+bool SearchStakeKernel(CBlockIndex* pindexPrev, unsigned int nBits, const std::vector<CStakeKernelInput>& vInputs,
+                       unsigned int nTimeTx, unsigned int nSearchInterval, unsigned int& nInputRet,
+                       unsigned int& nTimeTxRet);
+void ThreadStakeKernelSearch();
+void GetStakeThreadStats(std::vector<CStakeThreadStats>& vStats);
+
 bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeModifier,
 		              bool& fGeneratedStakeModifier);
 
+// Keep the memoised kernel stake modifiers in step with the main chain
+void ConnectKernelStakeModifier(const CBlockIndex* pindex);
+void DisconnectKernelStakeModifier(const CBlockIndex* pindex);
+void LoadKernelStakeModifierCache();
+
 bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, const CBlock& blockFrom,
 		          unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout,
 			  unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake,
 			  bool fPrintProofOfStake=false);
 
+// Same as above, but taking the few fields of the previous transaction and its block that enter
+// the kernel hash, so that callers caching them (the staking wallet) do not need to read them from disk
+bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, const uint256& hashBlockFrom,
+		          unsigned int nTimeBlockFrom, unsigned int nTxPrevOffset, unsigned int nTimeTxPrev,
+		          int64_t nValueIn, const COutPoint& prevout, unsigned int nTimeTx,
+		          uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake=false);
+
 bool CheckProofOfStake(CBlockIndex* pindexPrev, const CTransaction& tx, unsigned int nBits,
 		       uint256& hashProofOfStake, uint256& targetProofOfStake);
 
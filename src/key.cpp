@@ -12,6 +12,82 @@
 #include "key.h"
 #include "opensslcompat.h"
 
+#ifdef USE_SECP256K1
+#include <secp256k1.h>
+#include <secp256k1_recovery.h>
+
+static SigVerifyBackend nSigVerifyBackend = SIGVERIFY_SECP256K1;
+
+// Verification only needs the precomputed tables of a verify context, which is immutable
+// after creation and therefore safe to share between threads.
+static const secp256k1_context* GetSecp256k1Context()
+{
+    static const secp256k1_context* ctx = secp256k1_context_create(SECP256K1_CONTEXT_VERIFY);
+    return ctx;
+}
+
+static bool VerifySecp256k1(const std::vector<unsigned char>& vchPubKey, const uint256& hash,
+                            const std::vector<unsigned char>& vchSig)
+{
+    const secp256k1_context* ctx = GetSecp256k1Context();
+    secp256k1_pubkey pubkey;
+    secp256k1_ecdsa_signature sig;
+
+    if (!secp256k1_ec_pubkey_parse(ctx, &pubkey, &vchPubKey[0], vchPubKey.size()))
+        return false;
+
+    // Both backends only accept strict DER; OpenSSL re-encodes the signature and compares
+    if (vchSig.empty() || !secp256k1_ecdsa_signature_parse_der(ctx, &sig, &vchSig[0], vchSig.size()))
+        return false;
+
+    // OpenSSL accepts high-S signatures, libsecp256k1 only verifies their lower-S form
+    secp256k1_ecdsa_signature_normalize(ctx, &sig, &sig);
+
+    return secp256k1_ecdsa_verify(ctx, &sig, hash.begin(), &pubkey) == 1;
+}
+#else
+static SigVerifyBackend nSigVerifyBackend = SIGVERIFY_OPENSSL;
+#endif
+
+bool SetSigVerifyBackend(SigVerifyBackend backend)
+{
+#ifndef USE_SECP256K1
+    if (backend == SIGVERIFY_SECP256K1)
+        return false;
+#endif
+
+    nSigVerifyBackend = backend;
+    return true;
+}
+
+SigVerifyBackend GetSigVerifyBackend()
+{
+    return nSigVerifyBackend;
+}
+
+const char* GetSigVerifyBackendName(SigVerifyBackend backend)
+{
+    return backend == SIGVERIFY_SECP256K1 ? "secp256k1" : "openssl";
+}
+
+bool CPubKey::Verify(const uint256& hash, const std::vector<unsigned char>& vchSig) const
+{
+    if (!IsValid())
+        return false;
+
+#ifdef USE_SECP256K1
+    if (nSigVerifyBackend == SIGVERIFY_SECP256K1)
+        return VerifySecp256k1(vchPubKey, hash, vchSig);
+#endif
+
+    CKey key;
+
+    if (!key.SetPubKey(*this))
+        return false;
+
+    return key.VerifyOpenSSL(hash, vchSig);
+}
+
 // Generate a private key from just the secret parameter
 int EC_KEY_regenerate_key(EC_KEY *eckey, BIGNUM *priv_key)
 {
@@ -506,6 +582,30 @@ bool CKey::SetCompactSignature(uint256 hash, const std::vector<unsigned char>& v
     if (nV<27 || nV>=35)
         return false;
 
+#ifdef USE_SECP256K1
+    if (nSigVerifyBackend == SIGVERIFY_SECP256K1)
+    {
+        const secp256k1_context* ctx = GetSecp256k1Context();
+        secp256k1_ecdsa_recoverable_signature sig;
+        secp256k1_pubkey pubkey;
+        bool fCompressed = nV >= 31;
+
+        if (!secp256k1_ecdsa_recoverable_signature_parse_compact(ctx, &sig, &vchSig[1], (nV - 27) & 3))
+            return false;
+
+        if (!secp256k1_ecdsa_recover(ctx, &pubkey, &sig, hash.begin()))
+            return false;
+
+        std::vector<unsigned char> vchPubKey(65);
+        size_t nPubKeySize = vchPubKey.size();
+        secp256k1_ec_pubkey_serialize(ctx, &vchPubKey[0], &nPubKeySize, &pubkey,
+                                      fCompressed ? SECP256K1_EC_COMPRESSED : SECP256K1_EC_UNCOMPRESSED);
+        vchPubKey.resize(nPubKeySize);
+
+        return SetPubKey(CPubKey(vchPubKey));
+    }
+#endif
+
     ECDSA_SIG *sig = ECDSA_SIG_new();
     BN_bin2bn(&vchSig[1],32, ECDSA_SIG_getr(sig));
     BN_bin2bn(&vchSig[33],32, ECDSA_SIG_gets(sig));
@@ -531,8 +631,11 @@ bool CKey::SetCompactSignature(uint256 hash, const std::vector<unsigned char>& v
     return false;
 }
 
-bool CKey::Verify(uint256 hash, const std::vector<unsigned char>& vchSig)
+bool CKey::VerifyOpenSSL(const uint256& hash, const std::vector<unsigned char>& vchSig)
 {
+    if (vchSig.empty())
+        return false;
+
     // -1 = error, 0 = bad sig, 1 = good
     if (ECDSA_verify(0, (unsigned char*)&hash, sizeof(hash), &vchSig[0], vchSig.size(), pkey) != 1)
         return false;
@@ -540,6 +643,16 @@ bool CKey::Verify(uint256 hash, const std::vector<unsigned char>& vchSig)
     return true;
 }
 
+bool CKey::Verify(uint256 hash, const std::vector<unsigned char>& vchSig)
+{
+#ifdef USE_SECP256K1
+    if (nSigVerifyBackend == SIGVERIFY_SECP256K1)
+        return fSet && GetPubKey().Verify(hash, vchSig);
+#endif
+
+    return VerifyOpenSSL(hash, vchSig);
+}
+
 bool CKey::IsValid()
 {
     if (!fSet)
@@ -45,6 +45,19 @@ public:
     explicit key_error(const std::string& str) : std::runtime_error(str) {}
 };
 
+/** Implementations available for ECDSA signature verification and public key recovery */
+enum SigVerifyBackend
+{
+    SIGVERIFY_OPENSSL,
+    SIGVERIFY_SECP256K1,
+};
+
+/** Select the backend used by CPubKey::Verify, CKey::Verify and CKey::SetCompactSignature.
+ *  Returns false if the requested backend was not compiled in. */
+bool SetSigVerifyBackend(SigVerifyBackend backend);
+SigVerifyBackend GetSigVerifyBackend();
+const char* GetSigVerifyBackendName(SigVerifyBackend backend);
+
 /** A reference to a CKey: the Hash160 of its serialized public key */
 class CKeyID : public uint160
 {
@@ -100,6 +113,10 @@ public:
         return vchPubKey;
     }
 
+    // Verify a DER signature of hash against this key, without building an OpenSSL EC_KEY
+    // unless the OpenSSL backend is selected
+    bool Verify(const uint256& hash, const std::vector<unsigned char>& vchSig) const;
+
 
 };
 
@@ -113,12 +130,15 @@ typedef std::vector<unsigned char, secure_allocator<unsigned char> > CSecret;
 /** An encapsulated OpenSSL Elliptic Curve key (public and/or private) */
 class CKey
 {
+    friend class CPubKey;
+
 protected:
     EC_KEY* pkey;
     bool fSet;
     bool fCompressedPubKey;
 
     void SetCompressedPubKey();
+    bool VerifyOpenSSL(const uint256& hash, const std::vector<unsigned char>& vchSig);
 
 public:
 
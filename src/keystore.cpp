@@ -63,6 +63,20 @@ bool CBasicKeyStore::GetCScript(const CScriptID &hash, CScript& redeemScriptOut)
     return false;
 }
 
+void CBasicKeyStore::GetCScripts(std::set<CScriptID> &setScriptID) const
+{
+    setScriptID.clear();
+    {
+        LOCK(cs_KeyStore);
+        ScriptMap::const_iterator mi = mapScripts.begin();
+        while (mi != mapScripts.end())
+        {
+            setScriptID.insert((*mi).first);
+            mi++;
+        }
+    }
+}
+
 bool CCryptoKeyStore::SetCrypted()
 {
     {
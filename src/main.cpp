@@ -8,6 +8,7 @@
 #include "alert.h"
 #include "backtrace.h"
 #include "checkpoints.h"
+#include "checkqueue.h"
 #include "db.h"
 #include "txdb.h"
 #include "net.h"
@@ -57,7 +58,9 @@ uint256 nBestChainTrust = 0;
 uint256 nBestInvalidTrust = 0;
 uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
+CChain chainActive;
 int64_t nTimeBestReceived = 0;
+int nScriptCheckThreads = 0;
 
 #define ENFORCE_MN_PAYMENT_HEIGHT  1100000
 #define ENFORCE_DEV_PAYMENT_HEIGHT 1200000
@@ -71,6 +74,42 @@ set<pair<COutPoint, unsigned int> > setStakeSeenOrphan;
 map<uint256, CTransaction> mapOrphanTransactions;
 map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
 
+// Headers-first synchronisation state, protected by cs_main
+
+/** A validated header whose block we do not have yet */
+struct CHeaderIndex
+{
+    uint256 hash;
+    uint256 hashPrev;
+    int nHeight;
+    unsigned int nTime;
+    unsigned int nBits;
+    bool fProofOfStake;
+    uint256 nChainTrust;
+};
+
+/** A block requested from a peer while following the best header chain */
+struct CBlockInFlight
+{
+    NodeId nodeId;
+    int nHeight;
+    int64_t nTime;
+};
+
+// Headers ahead of the block index, dropped again once their block is stored
+static robin_hood::unordered_node_map<uint256, CHeaderIndex> mapHeaderIndex;
+static CHeaderIndex* pindexBestHeader = NULL;
+// The best header chain by height, its first entry builds on a block in mapBlockIndex
+static std::vector<CHeaderIndex*> vBestHeaderChain;
+static robin_hood::unordered_flat_map<uint256, CBlockInFlight> mapBlocksInFlight;
+static std::map<NodeId, int> mapPeerBlocksInFlight;
+// Every block below this height on the best header chain is stored, orphaned or in flight
+static int nBlockDownloadCursor = 0;
+static NodeId nHeadersSyncPeer = -1;
+static int64_t nHeadersSyncTime = 0;
+// When pindexBestHeader last moved forward
+static int64_t nTimeBestHeaderReceived = 0;
+
 // Constant stuff for coinbase transactions we create:
 CScript COINBASE_FLAGS;
 
@@ -83,6 +122,8 @@ int64_t nMinimumInputValue = 0;
 
 extern enum Checkpoints::CPMode CheckpointsMode;
 
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
 void RegisterWallet(CWallet* pwalletIn)
 {
     {
@@ -113,6 +154,10 @@ void SyncWithWallets(const CTransaction& tx, const CBlock* pblock, bool fUpdate,
 {
     if (!fConnect)
     {
+        // outputs of a disconnected transaction can no longer be staked from their old block
+        BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
+            pwallet->EraseStakeCandidates(tx);
+
         // ppcoin: wallets need to refund inputs when disconnecting coinstake
         if (tx.IsCoinStake())
         {
@@ -250,6 +295,20 @@ unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
     return nEvicted;
 }
 
+// Whether every transaction tx spends from is in the pool or the chain now
+static bool HavePrevTxs(CTxDB& txdb, const CTransaction& tx)
+{
+    LOCK(mempool.cs);
+
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        if (!mempool.exists(txin.prevout.hash) && !txdb.ContainsTx(txin.prevout.hash))
+            return false;
+    }
+
+    return true;
+}
+
 bool CTransaction::ReadFromDisk(CTxDB& txdb, COutPoint prevout, CTxIndex& txindexRet)
 {
     SetNull();
@@ -755,7 +814,8 @@ int GetInputAge(CTxIn& vin)
 bool CWalletTx::AcceptWalletTransaction(CTxDB& txdb, bool fCheckInputs)
 {
     {
-        LOCK(mempool.cs);
+        // cs_main first, CTxMemPool::accept takes them in that order
+        LOCK2(cs_main, mempool.cs);
 
         // Add previous supporting transactions first
         BOOST_FOREACH(CMerkleTx& tx, vtxPrev)
@@ -814,7 +874,7 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
 
             if (mempool.exists(hash))
             {
-                tx = mempool.lookup(hash);
+                tx = *mempool.get(hash);
                 return true;
             }
         }
@@ -836,22 +896,34 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
     return false;
 }
 
-CBlockIndex* FindBlockByHeight(int nHeight)
+void CChain::SetTip(CBlockIndex* pindex)
 {
-    CBlockIndex *pblockindex;
+    LOCK(cs);
 
-    if (nHeight < nBestHeight / 2)
-        pblockindex = pindexGenesisBlock;
-    else
-        pblockindex = pindexBest;
+    if (pindex == NULL)
+    {
+        vChain.clear();
+        return;
+    }
 
-    while (pblockindex->pprev && pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
+    // Only the blocks above the fork with the old chain change
+    vChain.resize(pindex->nHeight + 1);
+
+    while (pindex && vChain[pindex->nHeight] != pindex)
+    {
+        vChain[pindex->nHeight] = pindex;
+        pindex = pindex->pprev;
+    }
+}
+
+CBlockIndex* CChain::FindFork(CBlockIndex* pindex) const
+{
+    LOCK(cs);
 
-    while (pblockindex->pnext && pblockindex->nHeight < nHeight)
-        pblockindex = pblockindex->pnext;
+    while (pindex && (pindex->nHeight >= (int)vChain.size() || vChain[pindex->nHeight] != pindex))
+        pindex = pindex->pprev;
 
-    return pblockindex;
+    return pindex;
 }
 
 bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
@@ -1129,7 +1201,7 @@ bool CTransaction::DisconnectInputs(CTxDB& txdb)
 }
 
 bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTestPool,
-                               bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid)
+                               bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid) const
 {
     // FetchInputs can return false either because we just haven't seen some inputs
     // (in which case the transaction should be stored as an orphan)
@@ -1185,7 +1257,7 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
                                  prevout.hash.ToString().substr(0,10).c_str());
                 }
 
-                txPrev = mempool.lookup(prevout.hash);
+                txPrev = *mempool.get(prevout.hash);
             }
 
             if (!fFound)
@@ -1274,7 +1346,8 @@ unsigned int CTransaction::GetP2SHSigOpCount(const MapPrevTx& inputs) const
 }
 
 bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                                 const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool *txAlreadyUsed)
+                                 const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool *txAlreadyUsed,
+                                 std::vector<CScriptCheck> *pvChecks) const
 {
     // Take over previous transactions' spent pointers
     // fBlock is true when this is called from AcceptBlock when a new best-block is added to the blockchain
@@ -1355,8 +1428,15 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
             // still computed and checked, and any change will be caught at the next checkpoint.
             if (!(fBlock && (nBestHeight < Checkpoints::GetTotalBlocksEstimate())))
             {
-                // Verify signature
-                if (!VerifySignature(txPrev, *this, i, 0))
+                // Verify signature, or defer it to the script check queue
+                CScriptCheck check(txPrev, *this, i, 0);
+
+                if (pvChecks)
+                {
+                    pvChecks->push_back(CScriptCheck());
+                    check.swap(pvChecks->back());
+                }
+                else if (!check())
                     return DoS(100,error("%s : %s VerifySignature failed", __func__, GetHash().ToString().substr(0,10).c_str()));
             }
 
@@ -1400,6 +1480,22 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
 }
 
 
+bool CScriptCheck::operator()() const
+{
+    const CScript& scriptSig = ptxTo->vin[nIn].scriptSig;
+
+    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nHashType))
+        return error("%s : %s:%u VerifySignature failed", __func__, ptxTo->GetHash().ToString().substr(0,10).c_str(), nIn);
+
+    return true;
+}
+
+void ThreadScriptCheck()
+{
+    RenameThread("neutron-scriptch");
+    scriptcheckqueue.Thread();
+}
+
 bool CTransaction::ClientConnectInputs()
 {
     if (IsCoinBase())
@@ -1413,9 +1509,10 @@ bool CTransaction::ClientConnectInputs()
         {
             // Get prev tx from single transactions in memory
             COutPoint prevout = vin[i].prevout;
-            if (!mempool.exists(prevout.hash))
+            CTransactionRef ptxPrev = mempool.get(prevout.hash);
+            if (!ptxPrev)
                 return false;
-            CTransaction& txPrev = mempool.lookup(prevout.hash);
+            const CTransaction& txPrev = *ptxPrev;
 
             if (prevout.n >= txPrev.vout.size())
                 return false;
@@ -1467,12 +1564,15 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     BOOST_FOREACH(CTransaction& tx, vtx)
         SyncWithWallets(tx, this, false, false);
 
+    mnodeman.BlockDisconnected(*this);
+
     return true;
 }
 
 bool CBlock::CalculateBlockAmounts(CTxDB& txdb, CBlockIndex *pindex, std::map<uint256, CTxIndex>& mapQueuedChanges,
                                    int64_t& nFees, int64_t& nValueIn, int64_t& nValueOut, int64_t& nStakeReward,
-                                   bool fJustCheck, bool skipTxCheck, bool connectInputs)
+                                   bool fJustCheck, bool skipTxCheck, bool connectInputs,
+                               CCheckQueueControl<CScriptCheck> *pControl)
 {
     unsigned int nSigOps = 0;
     unsigned int nTxPos;
@@ -1559,8 +1659,10 @@ bool CBlock::CalculateBlockAmounts(CTxDB& txdb, CBlockIndex *pindex, std::map<ui
                 nStakeReward = nTxValueOut - nTxValueIn;
 
             bool txAlreadyUsed = false;
+            std::vector<CScriptCheck> vChecks;
 
-            if (connectInputs && !tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, &txAlreadyUsed))
+            if (connectInputs && !tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false,
+                                                   &txAlreadyUsed, pControl ? &vChecks : nullptr))
             {
                 if (skipTxCheck && txAlreadyUsed)
                 {
@@ -1573,6 +1675,8 @@ bool CBlock::CalculateBlockAmounts(CTxDB& txdb, CBlockIndex *pindex, std::map<ui
                     return false;
                 }
             }
+            else if (pControl)
+                pControl->Add(vChecks);
         }
 
         mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
@@ -1595,14 +1699,43 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex *pindex, bool fJustCheck, boo
     int64_t nValueIn = 0;
     int64_t nValueOut = 0;
     int64_t nStakeReward = 0;
+    int64_t nTimeStart = GetTimeMicros();
+
+    // Signature checks are handed to the script check threads while the rest of the block is validated;
+    // the control object makes sure they have all finished before we return
+    CCheckQueueControl<CScriptCheck> control(nScriptCheckThreads ? &scriptcheckqueue : NULL);
 
     if (!CalculateBlockAmounts(txdb, pindex, mapQueuedChanges, nFees, nValueIn, nValueOut, nStakeReward,
-                               fJustCheck, reorganize, true))
+                               fJustCheck, reorganize, true, nScriptCheckThreads ? &control : nullptr))
     {
         LogPrintf("%s : Block transaction scan and amount calculations failed\n", __func__);
         return false;
     }
 
+    int64_t nTimeConnect = GetTimeMicros();
+
+    // Wait for the signatures before anything below touches the money
+    // supply or the masternode payment state
+    if (!control.Wait())
+        return DoS(100, error("%s : script verification failed", __func__));
+
+    int64_t nTimeVerify = GetTimeMicros();
+
+    if (LogAcceptCategory("bench"))
+    {
+        // every input of every transaction but the coinbase had its signature checked
+        unsigned int nInputs = 0;
+        BOOST_FOREACH(const CTransaction& tx, vtx)
+            if (!tx.IsCoinBase())
+                nInputs += tx.vin.size();
+
+        LogPrint("bench", "%s : %u txs, connect %.2fms, verify wait %.2fms (%d script threads), "
+                 "%u inputs at %.0f verifications/s\n", __func__,
+                 vtx.size(), (nTimeConnect - nTimeStart) * 0.001, (nTimeVerify - nTimeConnect) * 0.001,
+                 nScriptCheckThreads, nInputs,
+                 nTimeVerify > nTimeStart ? nInputs * 1000000.0 / (nTimeVerify - nTimeStart) : 0.0);
+    }
+
     // ppcoin: track money supply and mint amount info
     pindex->nMint = nValueOut - nValueIn + nFees;
     pindex->nMoneySupply = pindex->pprev ? pindex->pprev->nMoneySupply : 0;
@@ -1848,30 +1981,21 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex *pindex, bool fJustCheck, boo
     BOOST_FOREACH(CTransaction& tx, vtx)
         SyncWithWallets(tx, this, true);
 
+    // and for spent masternode collateral
+    mnodeman.BlockConnected(*this);
+
     return true;
 }
 
 bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew, int postponedBlocks)
 {
     LogPrintf("[%s]\n", __func__);
+    int64_t nTimeStart = GetTimeMicros();
 
-    CBlockIndex* pfork = pindexBest;
-    CBlockIndex* plonger = pindexNew;
-
-    while (pfork != plonger)
-    {
-        while (plonger->nHeight > pfork->nHeight)
-        {
-            if (!(plonger = plonger->pprev))
-                return error("%s : plonger->pprev is null", __func__);
-        }
-
-        if (pfork == plonger)
-            break;
+    CBlockIndex* pfork = chainActive.FindFork(pindexNew);
 
-        if (!(pfork = pfork->pprev))
-            return error("%s : pfork->pprev is null", __func__);
-    }
+    if (!pfork)
+        return error("%s : no fork with the active chain", __func__);
 
     // List of what to disconnect
     vector<CBlockIndex*> vDisconnect;
@@ -1944,15 +2068,23 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew, int postponedBlocks)
     if (!txdb.WriteHashBestChain(pindexNew->GetBlockHash()))
         return error("%s : WriteHashBestChain failed", __func__);
 
+    int64_t nTimeConnected = GetTimeMicros();
+
     // Make sure it's successfully written to disk before changing memory structure
     if (!txdb.TxnCommit())
         return error("%s : TxnCommit failed", __func__);
 
+    LogPrint("bench", "%s : depth %u/%u, connect %.2fms, commit %.2fms\n", __func__,
+             vDisconnect.size(), vConnect.size(), (nTimeConnected - nTimeStart) * 0.001,
+             (GetTimeMicros() - nTimeConnected) * 0.001);
+
     // Disconnect shorter branch
     BOOST_FOREACH(CBlockIndex* pindex, vDisconnect)
     {
         if (pindex->pprev)
             pindex->pprev->pnext = NULL;
+
+        DisconnectKernelStakeModifier(pindex);
     }
 
     // Connect longer branch
@@ -1960,8 +2092,12 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew, int postponedBlocks)
     {
         if (pindex->pprev)
             pindex->pprev->pnext = pindex;
+
+        ConnectKernelStakeModifier(pindex);
     }
 
+    chainActive.SetTip(pindexNew);
+
     // Resurrect memory transactions that were in the disconnected branch
     BOOST_FOREACH(CTransaction& tx, vResurrect)
         tx.AcceptToMemoryPool(txdb, false);
@@ -1999,6 +2135,10 @@ bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew, bool reorgan
     if (pindexNew->pprev != NULL)
         pindexNew->pprev->pnext = pindexNew;
 
+    chainActive.SetTip(pindexNew);
+
+    ConnectKernelStakeModifier(pindexNew);
+
     // Delete redundant memory transactions
     BOOST_FOREACH(CTransaction& tx, vtx)
         mempool.remove(tx);
@@ -2098,6 +2238,7 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     hashBestChain = hash;
     pindexBest = pindexNew;
     pindexBest->pnext = nullptr; /* Should already be null or with pnext being invalid - effectively disconnectng the rest */
+    chainActive.SetTip(pindexBest);
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexNew->nChainTrust;
     nTimeBestReceived = GetTime();
@@ -2665,8 +2806,9 @@ bool ProcessNewBlock(CNode* pfrom, CBlock* pblock)
         mapOrphanBlocks.emplace(hash, pblock2);
         mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrevBlock, pblock2));
 
-        // Ask this guy to fill in what we're missing
-        if (pfrom)
+        // Ask this guy to fill in what we're missing, unless the block came in ahead of its parent
+        // while downloading along the header chain
+        if (pfrom && !mapHeaderIndex.count(hash))
         {
             if (fDebug)
             {
@@ -2859,12 +3001,9 @@ bool CBlock::CheckBlockSignature() const
     if (whichType == TX_PUBKEY)
     {
         valtype& vchPubKey = vSolutions[0];
-        CKey key;
-        if (!key.SetPubKey(vchPubKey))
-            return false;
         if (vchBlockSig.empty())
             return false;
-        return key.Verify(GetHash(), vchBlockSig);
+        return CPubKey(vchPubKey).Verify(GetHash(), vchBlockSig);
     }
 
     return false;
@@ -3267,6 +3406,27 @@ bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
     return true;
 }
 
+// Sends a block as stored on disk. Disk and network serialization of blocks are
+// identical, so the bytes are copied into the send buffer without building a CBlock.
+static bool PushRawBlock(CNode* pfrom, const CBlockIndex* pindex)
+{
+    static const size_t HEADER_SIZE = 80;
+
+    pfrom->BeginMessage(NetMsgType::BLOCK);
+    size_t nOffset = pfrom->ssSend.size();
+
+    if (!ReadBlockFileRaw(pindex->nFile, pindex->nBlockPos, pfrom->ssSend) ||
+        pfrom->ssSend.size() - nOffset < HEADER_SIZE ||
+        Hash(pfrom->ssSend.begin() + nOffset, pfrom->ssSend.begin() + nOffset + HEADER_SIZE) != pindex->GetBlockHash())
+    {
+        pfrom->AbortMessage();
+        return false;
+    }
+
+    pfrom->EndMessage();
+    return true;
+}
+
 void static ProcessGetData(CNode* pfrom)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
@@ -3292,9 +3452,12 @@ void static ProcessGetData(CNode* pfrom)
 
                 if (mi != mapBlockIndex.end())
                 {
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
-                    pfrom->PushMessage(NetMsgType::BLOCK, block);
+                    if (!PushRawBlock(pfrom, (*mi).second))
+                    {
+                        CBlock block;
+                        block.ReadFromDisk((*mi).second);
+                        pfrom->PushMessage(NetMsgType::BLOCK, block);
+                    }
 
                     // Trigger them to send a getblocks request for the next batch of inventory
                     if (inv.hash == pfrom->hashContinue)
@@ -3334,11 +3497,11 @@ void static ProcessGetData(CNode* pfrom)
                         pfrom->PushMessage(NetMsgType::DSTX, ss);
                         pushed = true;
                     } else {
-                        CTransaction tx;
-                        if (mempool.lookup(inv.hash, tx)) {
+                        CTransactionRef ptx = mempool.get(inv.hash);
+                        if (ptx) {
                             CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                             ss.reserve(1000);
-                            ss << tx;
+                            ss << *ptx;
                             pfrom->PushMessage(NetMsgType::TX, ss);
                             pushed = true;
                         }
@@ -3392,6 +3555,586 @@ void static ProcessGetData(CNode* pfrom)
 // a large 4-byte int at any alignment.
 unsigned char pchMessageStart[4] = { 0xb2, 0xd1, 0xf4, 0xa3 };
 
+//
+// Headers-first synchronisation
+//
+
+int GetBestHeaderHeight()
+{
+    LOCK(cs_main);
+    return pindexBestHeader ? pindexBestHeader->nHeight : nBestHeight;
+}
+
+static bool IsOnBestHeaderChain(const CHeaderIndex* pindex)
+{
+    if (vBestHeaderChain.empty())
+        return false;
+
+    int nPos = pindex->nHeight - vBestHeaderChain[0]->nHeight;
+    return nPos >= 0 && nPos < (int)vBestHeaderChain.size() && vBestHeaderChain[nPos] == pindex;
+}
+
+// Ancestor of a header at the given height. Returns NULL and sets pindexBlockRet
+// once the walk leaves the header index and continues in the block index
+static const CHeaderIndex* GetHeaderAncestor(const CHeaderIndex* pindex, int nHeight, CBlockIndex*& pindexBlockRet)
+{
+    while (pindex->nHeight > nHeight)
+    {
+        // Jump along the best header chain instead of walking it
+        if (IsOnBestHeaderChain(pindex))
+        {
+            if (nHeight >= vBestHeaderChain[0]->nHeight)
+                return vBestHeaderChain[nHeight - vBestHeaderChain[0]->nHeight];
+
+            if (pindex != vBestHeaderChain[0])
+            {
+                pindex = vBestHeaderChain[0];
+                continue;
+            }
+        }
+
+        auto mi = mapHeaderIndex.find(pindex->hashPrev);
+
+        if (mi == mapHeaderIndex.end())
+        {
+            auto miBlock = mapBlockIndex.find(pindex->hashPrev);
+            CBlockIndex* pindexBlock = (miBlock != mapBlockIndex.end()) ? (*miBlock).second : NULL;
+
+            if (chainActive.Contains(pindexBlock))
+                pindexBlock = chainActive[nHeight];
+
+            while (pindexBlock && pindexBlock->nHeight > nHeight)
+                pindexBlock = pindexBlock->pprev;
+
+            pindexBlockRet = pindexBlock;
+            return NULL;
+        }
+
+        pindex = &(*mi).second;
+    }
+
+    return pindex;
+}
+
+// Same layout as CBlockLocator::Set, but starting from a header we may not have the block for
+static CBlockLocator GetHeaderLocator(const CHeaderIndex* pindex)
+{
+    if (pindex == NULL)
+        return CBlockLocator(pindexBest);
+
+    std::vector<uint256> vHave;
+    CBlockIndex* pindexBlock = NULL;
+    int nStep = 1;
+
+    while (pindex)
+    {
+        vHave.push_back(pindex->hash);
+        pindex = GetHeaderAncestor(pindex, std::max(0, pindex->nHeight - nStep), pindexBlock);
+
+        if (vHave.size() > 10)
+            nStep *= 2;
+    }
+
+    while (pindexBlock)
+    {
+        vHave.push_back(pindexBlock->GetBlockHash());
+
+        if (chainActive.Contains(pindexBlock))
+            pindexBlock = chainActive[pindexBlock->nHeight - nStep];
+        else
+        {
+            for (int i = 0; pindexBlock && i < nStep; i++)
+                pindexBlock = pindexBlock->pprev;
+        }
+
+        if (vHave.size() > 10)
+            nStep *= 2;
+    }
+
+    vHave.push_back((!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet));
+    return CBlockLocator(vHave);
+}
+
+static void PushGetHeaders(CNode* pnode, const CHeaderIndex* pindexFrom, uint256 hashStop = uint256(0))
+{
+    if (fDebug)
+    {
+        LogPrintf("%s : asking peer %d for headers after height %d\n", __func__, pnode->GetId(),
+                  pindexFrom ? pindexFrom->nHeight : nBestHeight);
+    }
+
+    pnode->PushMessage(NetMsgType::GETHEADERS, GetHeaderLocator(pindexFrom), hashStop);
+}
+
+static int64_t GetHeaderMedianTimePast(const uint256& hash)
+{
+    std::vector<int64_t> vTimes;
+    uint256 hashWalk = hash;
+
+    while (vTimes.size() < CBlockIndex::nMedianTimeSpan)
+    {
+        auto mi = mapHeaderIndex.find(hashWalk);
+
+        if (mi == mapHeaderIndex.end())
+        {
+            // The rest of the branch is in the block index
+            auto miBlock = mapBlockIndex.find(hashWalk);
+            CBlockIndex* pindex = (miBlock != mapBlockIndex.end()) ? (*miBlock).second : NULL;
+
+            for (; pindex && vTimes.size() < CBlockIndex::nMedianTimeSpan; pindex = pindex->pprev)
+                vTimes.push_back(pindex->GetBlockTime());
+
+            break;
+        }
+
+        vTimes.push_back((*mi).second.nTime);
+        hashWalk = (*mi).second.hashPrev;
+    }
+
+    if (vTimes.empty())
+        return 0;
+
+    std::sort(vTimes.begin(), vTimes.end());
+    return vTimes[vTimes.size() / 2];
+}
+
+// Make pindexNew the tip of vBestHeaderChain, reusing the part of the chain it shares
+static void SetBestHeader(CHeaderIndex* pindexNew)
+{
+    std::vector<CHeaderIndex*> vPath;
+    std::vector<CHeaderIndex*>::size_type nKeep = 0;
+    CHeaderIndex* pindexWalk = pindexNew;
+
+    while (!IsOnBestHeaderChain(pindexWalk))
+    {
+        vPath.push_back(pindexWalk);
+        auto mi = mapHeaderIndex.find(pindexWalk->hashPrev);
+
+        if (mi == mapHeaderIndex.end())
+        {
+            // A branch that does not lead back to a stored block (its parent turned out invalid)
+            if (!mapBlockIndex.count(pindexWalk->hashPrev))
+                return;
+
+            pindexWalk = NULL;
+            break;
+        }
+
+        pindexWalk = &(*mi).second;
+    }
+
+    if (pindexWalk)
+        nKeep = pindexWalk->nHeight - vBestHeaderChain[0]->nHeight + 1;
+
+    vBestHeaderChain.resize(nKeep);
+    vBestHeaderChain.insert(vBestHeaderChain.end(), vPath.rbegin(), vPath.rend());
+    pindexBestHeader = pindexNew;
+    nTimeBestHeaderReceived = GetTime();
+
+    if (!vPath.empty())
+        nBlockDownloadCursor = std::min(nBlockDownloadCursor, vPath.back()->nHeight);
+}
+
+// GetNextTargetRequired for a block on top of hashPrev, which may only be known as a header
+static unsigned int GetNextHeaderTargetRequired(const uint256& hashPrev, int nHeightPrev, bool fProofOfStake)
+{
+    CBigNum bnTargetLimit = fProofOfStake ? GetPOSLimit(nHeightPrev) : bnProofOfWorkLimit;
+
+    // The last two blocks of the same kind, as GetLastBlockIndex finds them
+    int nFound = 0;
+    unsigned int nBitsPrev = 0;
+    int64_t nTimePrev = 0, nTimePrevPrev = 0;
+    uint256 hashWalk = hashPrev;
+
+    while (nFound < 2)
+    {
+        auto mi = mapHeaderIndex.find(hashWalk);
+
+        if (mi == mapHeaderIndex.end())
+            break;
+
+        const CHeaderIndex& index = (*mi).second;
+
+        if (index.fProofOfStake == fProofOfStake)
+        {
+            if (nFound++ == 0)
+            {
+                nBitsPrev = index.nBits;
+                nTimePrev = index.nTime;
+            }
+            else
+                nTimePrevPrev = index.nTime;
+        }
+
+        hashWalk = index.hashPrev;
+    }
+
+    if (nFound < 2)
+    {
+        // The rest of the branch is in the block index
+        auto miBlock = mapBlockIndex.find(hashWalk);
+
+        if (miBlock == mapBlockIndex.end())
+            return bnTargetLimit.GetCompact();
+
+        const CBlockIndex* pindex = GetLastBlockIndex((*miBlock).second, fProofOfStake);
+
+        if (nFound == 0)
+        {
+            if (pindex->pprev == NULL)
+                return bnTargetLimit.GetCompact(); // First block
+
+            nBitsPrev = pindex->nBits;
+            nTimePrev = pindex->GetBlockTime();
+            pindex = GetLastBlockIndex(pindex->pprev, fProofOfStake);
+        }
+
+        if (pindex->pprev == NULL)
+            return bnTargetLimit.GetCompact(); // Second block
+
+        nTimePrevPrev = pindex->GetBlockTime();
+    }
+
+    int64_t nActualSpacing = nTimePrev - nTimePrevPrev;
+
+    if (nActualSpacing < 0)
+        nActualSpacing = nTargetSpacing;
+
+    CBigNum bnNew;
+    bnNew.SetCompact(nBitsPrev);
+    int64_t nInterval = nTargetTimespan / nTargetSpacing;
+
+    bnNew *= ((nInterval - 1) * nTargetSpacing + nActualSpacing + nActualSpacing);
+    bnNew /= ((nInterval + 1) * nTargetSpacing);
+
+    if (bnNew <= 0 || bnNew > bnTargetLimit)
+        bnNew = bnTargetLimit;
+
+    return bnNew.GetCompact();
+}
+
+// Header-only part of CheckBlock and AcceptBlock. Proof-of-stake kernels need the coinstake,
+// so they are checked when the block itself arrives
+static bool AcceptBlockHeader(const CBlock& header, CHeaderIndex** ppindexRet)
+{
+    uint256 hash = header.GetHash();
+    *ppindexRet = NULL;
+
+    if (mapBlockIndex.count(hash))
+        return true;
+
+    auto mi = mapHeaderIndex.find(hash);
+
+    if (mi != mapHeaderIndex.end())
+    {
+        *ppindexRet = &(*mi).second;
+        return true;
+    }
+
+    int nHeight;
+    int64_t nTimePrev;
+    uint256 nChainTrustPrev;
+    auto miPrev = mapHeaderIndex.find(header.hashPrevBlock);
+
+    if (miPrev != mapHeaderIndex.end())
+    {
+        nHeight = (*miPrev).second.nHeight + 1;
+        nTimePrev = (*miPrev).second.nTime;
+        nChainTrustPrev = (*miPrev).second.nChainTrust;
+    }
+    else
+    {
+        auto miBlock = mapBlockIndex.find(header.hashPrevBlock);
+
+        if (miBlock == mapBlockIndex.end())
+            return error("%s : prev header %s not found", __func__, header.hashPrevBlock.ToString().c_str());
+
+        nHeight = (*miBlock).second->nHeight + 1;
+        nTimePrev = (*miBlock).second->GetBlockTime();
+        nChainTrustPrev = (*miBlock).second->nChainTrust;
+    }
+
+    // Check that the header chain matches the known block chain up to a checkpoint
+    if (!Checkpoints::CheckHardened(nHeight, hash))
+        return header.DoS(100, error("%s : rejected by hardened checkpoint lock-in at %d", __func__, nHeight));
+
+    // The target can not be looser than the limit GetNextTargetRequired clamps to
+    CBigNum bnTarget;
+    bnTarget.SetCompact(header.nBits);
+    CBigNum bnLimit = GetPOSLimit(nHeight - 1);
+
+    if (nHeight <= LAST_POW_BLOCK && bnProofOfWorkLimit > bnLimit)
+        bnLimit = bnProofOfWorkLimit;
+
+    if (bnTarget <= 0 || bnTarget > bnLimit)
+        return header.DoS(100, error("%s : nBits below minimum work at %d", __func__, nHeight));
+
+    // Either kind of block can come before the last proof-of-work block and the header does not say
+    // which. One that carries the proof-of-work target and meets it is proof-of-work, anything else
+    // has to carry the proof-of-stake target
+    bool fProofOfStake = true;
+
+    if (nHeight <= LAST_POW_BLOCK)
+    {
+        fProofOfStake = header.nBits != GetNextHeaderTargetRequired(header.hashPrevBlock, nHeight - 1, false) ||
+                        hash > bnTarget.getuint256();
+    }
+
+    // Chain trust is worked out from nBits, so it has to be the target the parent requires
+    if (header.nBits != GetNextHeaderTargetRequired(header.hashPrevBlock, nHeight - 1, fProofOfStake))
+        return header.DoS(100, error("%s : incorrect %s at %d", __func__, fProofOfStake ? "proof-of-stake" : "proof-of-work", nHeight));
+
+    // Check timestamp
+    if (header.GetBlockTime() > FutureDrift(GetAdjustedTime()))
+        return error("%s : block timestamp too far in the future", __func__);
+
+    if (header.GetBlockTime() <= GetHeaderMedianTimePast(header.hashPrevBlock) ||
+        FutureDrift(header.GetBlockTime()) < nTimePrev)
+    {
+        return error("%s : block's timestamp is too early", __func__);
+    }
+
+    // Past the last proof-of-work block every block is proof-of-stake, its time is the coinstake time
+    if (nHeight > LAST_POW_BLOCK && GetPOSProtocolVersion(nHeight) == 2 &&
+        (header.GetBlockTime() & STAKE_TIMESTAMP_MASK) != 0)
+    {
+        return header.DoS(50, error("%s : coinstake timestamp violation at %d", __func__, nHeight));
+    }
+
+    CHeaderIndex& indexNew = mapHeaderIndex[hash];
+    indexNew.hash = hash;
+    indexNew.hashPrev = header.hashPrevBlock;
+    indexNew.nHeight = nHeight;
+    indexNew.nTime = header.nTime;
+    indexNew.nBits = header.nBits;
+    indexNew.fProofOfStake = fProofOfStake;
+    indexNew.nChainTrust = nChainTrustPrev + ((CBigNum(1) << 256) / (bnTarget + 1)).getuint256();
+
+    if (indexNew.nChainTrust > nBestChainTrust &&
+        (pindexBestHeader == NULL || indexNew.nChainTrust > pindexBestHeader->nChainTrust))
+    {
+        SetBestHeader(&indexNew);
+    }
+
+    *ppindexRet = &indexNew;
+    return true;
+}
+
+// Drop headers whose blocks have been stored and side branches that lost out
+static void PruneHeaderIndex()
+{
+    std::vector<CHeaderIndex*>::size_type nStored = 0;
+
+    while (nStored < vBestHeaderChain.size() && mapBlockIndex.count(vBestHeaderChain[nStored]->hash))
+        nStored++;
+
+    if (nStored > 0)
+    {
+        for (std::vector<CHeaderIndex*>::size_type i = 0; i < nStored; i++)
+        {
+            if (vBestHeaderChain[i] == pindexBestHeader)
+                pindexBestHeader = NULL;
+
+            mapHeaderIndex.erase(vBestHeaderChain[i]->hash);
+        }
+
+        vBestHeaderChain.erase(vBestHeaderChain.begin(), vBestHeaderChain.begin() + nStored);
+    }
+
+    if (mapHeaderIndex.size() > vBestHeaderChain.size() + MAX_HEADERS_RESULTS)
+    {
+        std::vector<uint256> vErase;
+
+        for (auto it = mapHeaderIndex.begin(); it != mapHeaderIndex.end(); ++it)
+        {
+            if (!IsOnBestHeaderChain(&(*it).second))
+                vErase.push_back((*it).first);
+        }
+
+        BOOST_FOREACH(const uint256& hash, vErase)
+            mapHeaderIndex.erase(hash);
+    }
+}
+
+// Release the download slot of a block, lowering the cursor again if we did not end up with it
+static void MarkBlockReceived(const uint256& hash)
+{
+    auto it = mapBlocksInFlight.find(hash);
+
+    if (it == mapBlocksInFlight.end())
+        return;
+
+    auto itPeer = mapPeerBlocksInFlight.find((*it).second.nodeId);
+
+    if (itPeer != mapPeerBlocksInFlight.end() && --(*itPeer).second <= 0)
+        mapPeerBlocksInFlight.erase(itPeer);
+
+    if (!mapBlockIndex.count(hash) && !mapOrphanBlocks.count(hash))
+        nBlockDownloadCursor = std::min(nBlockDownloadCursor, (*it).second.nHeight);
+
+    mapBlocksInFlight.erase(it);
+}
+
+// A block on the best header chain failed validation, cut the chain before it
+static void InvalidateHeader(const uint256& hash)
+{
+    auto mi = mapHeaderIndex.find(hash);
+
+    if (mi == mapHeaderIndex.end())
+        return;
+
+    if (IsOnBestHeaderChain(&(*mi).second))
+    {
+        vBestHeaderChain.resize((*mi).second.nHeight - vBestHeaderChain[0]->nHeight);
+        pindexBestHeader = vBestHeaderChain.empty() ? NULL : vBestHeaderChain.back();
+    }
+
+    mapHeaderIndex.erase(mi);
+}
+
+// Neither headers nor blocks have come in for a while, so getblocks and inv are used as before
+static bool IsHeadersSyncStalled()
+{
+    int64_t nNow = GetTime();
+    return nNow - nTimeBestHeaderReceived > HEADERS_SYNC_TIMEOUT && nNow - nTimeBestReceived > MAX_TIME_SINCE_BEST_BLOCK;
+}
+
+void FinalizeNode(NodeId nodeid)
+{
+    LOCK(cs_main);
+
+    // Let another peer lead the header sync straight away
+    if (nodeid == nHeadersSyncPeer)
+        nHeadersSyncPeer = -1;
+
+    std::vector<uint256> vInFlight;
+
+    for (auto it = mapBlocksInFlight.begin(); it != mapBlocksInFlight.end(); ++it)
+    {
+        if ((*it).second.nodeId == nodeid)
+            vInFlight.push_back((*it).first);
+    }
+
+    BOOST_FOREACH(const uint256& hash, vInFlight)
+        MarkBlockReceived(hash);
+}
+
+// Ask for headers, then fill the peer's download slots from the window ahead of the active tip
+static void SendHeadersSyncMessages(CNode* pto)
+{
+    int64_t nNow = GetTime();
+
+    // The leading peer stopped answering, drop it so that another one takes over
+    if (pto->GetId() == nHeadersSyncPeer && nNow - nHeadersSyncTime > HEADERS_SYNC_TIMEOUT)
+    {
+        LogPrintf("%s : headers sync timed out on peer=%d, disconnecting\n", __func__, pto->GetId());
+
+        nHeadersSyncPeer = -1;
+        pto->fDisconnect = true;
+        return;
+    }
+
+    // Fall back to getblocks, one peer at a time
+    static int64_t nLastGetBlocksFallback = 0;
+
+    if (IsHeadersSyncStalled() && pto->nStartingHeight > nBestHeight && !pto->fClient && !pto->fOneShot &&
+        nNow - nLastGetBlocksFallback > MAX_TIME_SINCE_BEST_BLOCK)
+    {
+        LogPrintf("%s : header sync stalled, sending getblocks to peer=%d\n", __func__, pto->GetId());
+
+        nLastGetBlocksFallback = nNow;
+        pto->PushGetBlocks(pindexBest, uint256(0));
+    }
+
+    if (!pto->fHeadersSyncStarted)
+    {
+        int64_t nBestHeaderTime = pindexBestHeader ? pindexBestHeader->nTime : pindexBest->GetBlockTime();
+        bool fHeadersNearlyDone = nBestHeaderTime > GetAdjustedTime() - 24 * 60 * 60;
+
+        // While far behind a single peer leads, everyone is asked once we are close to the tip
+        if (pto->nStartingHeight > GetBestHeaderHeight() &&
+            (fHeadersNearlyDone || nHeadersSyncPeer == -1 || nNow - nHeadersSyncTime > HEADERS_SYNC_TIMEOUT))
+        {
+            pto->fHeadersSyncStarted = true;
+
+            if (!fHeadersNearlyDone)
+            {
+                nHeadersSyncPeer = pto->GetId();
+                nHeadersSyncTime = nNow;
+            }
+
+            // Give the new request a chance before calling the sync stalled
+            nTimeBestHeaderReceived = std::max(nTimeBestHeaderReceived, nNow);
+
+            PushGetHeaders(pto, pindexBestHeader);
+        }
+    }
+
+    // Hand out stalled requests again
+    static int64_t nLastTimeoutCheck = 0;
+
+    if (nNow - nLastTimeoutCheck > 0)
+    {
+        nLastTimeoutCheck = nNow;
+        std::vector<uint256> vTimedOut;
+
+        for (auto it = mapBlocksInFlight.begin(); it != mapBlocksInFlight.end(); ++it)
+        {
+            if (nNow - (*it).second.nTime > BLOCK_DOWNLOAD_TIMEOUT)
+                vTimedOut.push_back((*it).first);
+        }
+
+        BOOST_FOREACH(const uint256& hash, vTimedOut)
+        {
+            LogPrint("net", "%s : block %s timed out from peer=%d\n", __func__, hash.ToString(),
+                     mapBlocksInFlight[hash].nodeId);
+
+            MarkBlockReceived(hash);
+        }
+    }
+
+    if (vBestHeaderChain.empty())
+        return;
+
+    auto itPeer = mapPeerBlocksInFlight.find(pto->GetId());
+    int nFree = MAX_BLOCKS_IN_TRANSIT_PER_PEER - (itPeer != mapPeerBlocksInFlight.end() ? (*itPeer).second : 0);
+
+    if (nFree <= 0)
+        return;
+
+    int nChainStart = vBestHeaderChain[0]->nHeight;
+    int nWindowEnd = std::min(nBestHeight + BLOCK_DOWNLOAD_WINDOW, nChainStart + (int)vBestHeaderChain.size() - 1);
+    nWindowEnd = std::min(nWindowEnd, std::max(pto->nStartingHeight, pto->nBestHeaderHeight));
+
+    int nHeight = std::max(nBlockDownloadCursor, std::max(nBestHeight + 1, nChainStart));
+    vector<CInv> vGetData;
+
+    for (; nHeight <= nWindowEnd && (int)vGetData.size() < nFree; nHeight++)
+    {
+        const uint256& hash = vBestHeaderChain[nHeight - nChainStart]->hash;
+
+        if (mapBlocksInFlight.count(hash) || mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash))
+            continue;
+
+        CBlockInFlight& inflight = mapBlocksInFlight[hash];
+        inflight.nodeId = pto->GetId();
+        inflight.nHeight = nHeight;
+        inflight.nTime = nNow;
+        mapPeerBlocksInFlight[pto->GetId()]++;
+        vGetData.push_back(CInv(MSG_BLOCK, hash));
+    }
+
+    nBlockDownloadCursor = nHeight;
+
+    if (!vGetData.empty())
+    {
+        LogPrint("net", "%s : requesting %u blocks up to height %d from peer=%d\n", __func__,
+                 vGetData.size(), nHeight - 1, pto->GetId());
+
+        pto->PushMessage(NetMsgType::GETDATA, vGetData);
+    }
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     static int counter = 0;
@@ -3528,21 +4271,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             }
         }
 
-        // Ask the first connected node for block updates
-        static int nAskedForBlocks = 0;
-
-        if (!pfrom->fClient && !pfrom->fOneShot && (pfrom->nStartingHeight > (nBestHeight - 144)) &&
-            (pfrom->nVersion < NOBLKS_VERSION_START || pfrom->nVersion >= NOBLKS_VERSION_END) &&
-            (nAskedForBlocks < 1 || vNodes.size() <= 1))
-        {
-            if (fDebug)
-                LogPrintf("%s : asking peer %d for block update from height %d\n",
-                          __func__, pfrom->GetId(), pindexBest->nHeight);
-
-            nAskedForBlocks++;
-            pfrom->PushGetBlocks(pindexBest, uint256(0));
-        }
-
         // Relay alerts
         {
             LOCK(cs_mapAlerts);
@@ -3569,16 +4297,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         if (!IsInitialBlockDownload())
             Checkpoints::AskForPendingSyncCheckpoint(pfrom);
-
-        // Be more aggressive with blockchain download. Send new getblocks() message after connection
-        // to new node if waited longer than MAX_TIME_SINCE_BEST_BLOCK.
-        int64_t timeSinceBestBlock = GetTime() - nTimeBestReceived;
-
-        if (timeSinceBestBlock > MAX_TIME_SINCE_BEST_BLOCK)
-        {
-            LogPrintf("%s : Waiting %ld sec which is too long. Sending GetBlocks(0)\n", __func__, timeSinceBestBlock);
-            pfrom->PushGetBlocks(pindexBest, uint256(0));
-        }
     }
     else if (pfrom->nVersion == 0)
     {
@@ -3730,9 +4448,18 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                           fAlreadyHave ? "have" : "new", pfrom->GetId());
             }
 
-            if (!fAlreadyHave)
+            if (inv.type == MSG_BLOCK && !fAlreadyHave && mapHeaderIndex.count(inv.hash))
+            {
+                // Already on its way through the download window
+            }
+            else if (inv.type == MSG_BLOCK && !fAlreadyHave && IsInitialBlockDownload() && !IsHeadersSyncStalled())
+            {
+                // Fetch the headers leading up to it rather than the block itself
+                PushGetHeaders(pfrom, pindexBestHeader, inv.hash);
+            }
+            else if (!fAlreadyHave)
                 pfrom->AskFor(inv);
-            else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash))
+            else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash) && !mapHeaderIndex.count(inv.hash))
                 pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(mapOrphanBlocks[inv.hash]));
             else if (nInv == nLastBlock)
             {
@@ -3885,6 +4612,58 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         pfrom->PushMessage(NetMsgType::HEADERS, vHeaders);
     }
+    else if (strCommand == NetMsgType::HEADERS)
+    {
+        vector<CBlock> vHeaders;
+        vRecv >> vHeaders;
+
+        if (vHeaders.size() > MAX_HEADERS_RESULTS)
+        {
+            std::stringstream msg;
+            msg << boost::format("%s : message headers size() = %u") % __func__ % vHeaders.size();
+
+            pfrom->Misbehaving(msg.str(), 20);
+            return error(msg.str().c_str());
+        }
+
+        if (pfrom->GetId() == nHeadersSyncPeer)
+            nHeadersSyncTime = GetTime();
+
+        CHeaderIndex* pindexLast = NULL;
+
+        BOOST_FOREACH(const CBlock& header, vHeaders)
+        {
+            if (!AcceptBlockHeader(header, &pindexLast))
+            {
+                if (header.nDoS)
+                    pfrom->Misbehaving(std::string("headers misbehavior"), header.nDoS);
+
+                return error("%s : invalid header received from peer=%d", __func__, pfrom->GetId());
+            }
+
+            int nHeight = pindexLast ? pindexLast->nHeight : mapBlockIndex[header.GetHash()]->nHeight;
+            pfrom->nBestHeaderHeight = std::max(pfrom->nBestHeaderHeight, nHeight);
+        }
+
+        // Keep side branches from piling up between blocks
+        PruneHeaderIndex();
+
+        LogPrint("net", "%s : received %u headers from peer=%d, best header height %d\n", __func__,
+                 vHeaders.size(), pfrom->GetId(), GetBestHeaderHeight());
+
+        // A short message means the leading peer has nothing more, it no longer leads
+        if (vHeaders.size() < MAX_HEADERS_RESULTS && pfrom->GetId() == nHeadersSyncPeer)
+            nHeadersSyncPeer = -1;
+
+        // A full message means the peer has more, continue from the last one it sent
+        if (vHeaders.size() == MAX_HEADERS_RESULTS)
+        {
+            if (pindexLast)
+                PushGetHeaders(pfrom, pindexLast);
+            else
+                pfrom->PushMessage(NetMsgType::GETHEADERS, CBlockLocator(vHeaders.back().GetHash()), uint256(0));
+        }
+    }
     else if (strCommand == NetMsgType::TX || strCommand == NetMsgType::DSTX)
     {
         vector<uint256> vWorkQueue;
@@ -3904,35 +4683,35 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             //these allow masternodes to publish a limited amount of free transactions
             vRecv >> tx >> vin >> vchSig >> sigTime;
 
-            BOOST_FOREACH(CMasternode& mn, vecMasternodes) {
-                if(mn.vin == vin) {
-                    if(!mn.allowFreeTx){
-                        //multiple peers can send us a valid masternode transaction
-                        if(fDebug) LogPrintf("dstx: Masternode sending too many transactions %s\n", tx.GetHash().ToString().c_str());
-                        return true;
-                    }
+            CMasternode mn;
 
-                    std::string strMessage = tx.GetHash().ToString() + boost::lexical_cast<std::string>(sigTime);
+            if(mnodeman.Get(vin, mn)) {
+                if(!mn.allowFreeTx){
+                    //multiple peers can send us a valid masternode transaction
+                    if(fDebug) LogPrintf("dstx: Masternode sending too many transactions %s\n", tx.GetHash().ToString().c_str());
+                    return true;
+                }
 
-                    std::string errorMessage = "";
-                    if(!darkSendSigner.VerifyMessage(mn.pubkey2, vchSig, strMessage, errorMessage)){
-                        LogPrintf("dstx: Got bad masternode address signature %s \n", vin.ToString().c_str());
-                        //pfrom->Misbehaving(20);
-                        return false;
-                    }
+                std::string strMessage = tx.GetHash().ToString() + boost::lexical_cast<std::string>(sigTime);
 
-                    LogPrintf("dstx: Got Masternode transaction %s\n", tx.GetHash().ToString().c_str());
-                    mn.allowFreeTx = false;
+                std::string errorMessage = "";
+                if(!darkSendSigner.VerifyMessage(mn.pubkey2, vchSig, strMessage, errorMessage)){
+                    LogPrintf("dstx: Got bad masternode address signature %s \n", vin.ToString().c_str());
+                    //pfrom->Misbehaving(20);
+                    return false;
+                }
 
-                    if(!mapDarksendBroadcastTxes.count(tx.GetHash())){
-                        CDarksendBroadcastTx dstx;
-                        dstx.tx = tx;
-                        dstx.vin = vin;
-                        dstx.vchSig = vchSig;
-                        dstx.sigTime = sigTime;
+                LogPrintf("dstx: Got Masternode transaction %s\n", tx.GetHash().ToString().c_str());
+                mnodeman.Update(vin, [](CMasternode& mnUpdate) { mnUpdate.allowFreeTx = false; });
 
-                        mapDarksendBroadcastTxes.insert(make_pair(tx.GetHash(), dstx));
-                    }
+                if(!mapDarksendBroadcastTxes.count(tx.GetHash())){
+                    CDarksendBroadcastTx dstx;
+                    dstx.tx = tx;
+                    dstx.vin = vin;
+                    dstx.vchSig = vchSig;
+                    dstx.sigTime = sigTime;
+
+                    mapDarksendBroadcastTxes.insert(make_pair(tx.GetHash(), dstx));
                 }
             }
         }
@@ -3940,8 +4719,23 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
         bool fMissingInputs = false;
+        bool fAccepted = tx.AcceptToMemoryPool(txdb, true, &fMissingInputs);
+
+        // Plain TX arrives here without cs_main, the orphan pool, wallets and relay need it
+        LOCK(cs_main);
+
+        // A parent accepted on another thread after our inputs were fetched
+        // has run its orphan pass without finding this one. Parents accepted
+        // from here on will, as it goes into the orphan pool before cs_main is
+        // released, so only the ones already there need another try.
+        if (!fAccepted && fMissingInputs && HavePrevTxs(txdb, tx))
+        {
+            LogPrint("mempool", "%s : inputs of %s arrived meanwhile, trying again\n", __func__,
+                     inv.hash.ToString().substr(0,10).c_str());
+            fAccepted = tx.AcceptToMemoryPool(txdb, true, &fMissingInputs);
+        }
 
-        if (tx.AcceptToMemoryPool(txdb, true, &fMissingInputs))
+        if (fAccepted)
         {
             SyncWithWallets(tx, NULL, true);
             RelayTransaction(tx, inv.hash);
@@ -4010,7 +4804,15 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         CInv inv(MSG_BLOCK, block.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        if (ProcessNewBlock(pfrom, &block))
+        bool fAccepted = ProcessNewBlock(pfrom, &block);
+
+        if (block.nDoS)
+            InvalidateHeader(inv.hash);
+
+        MarkBlockReceived(inv.hash);
+        PruneHeaderIndex();
+
+        if (fAccepted)
             mapAlreadyAskedFor.erase(inv);
         else
         {
@@ -4032,7 +4834,12 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     {
         // Don't return addresses older than nCutOff timestamp
         int64_t nCutOff = GetTime() - (nNodeLifespan * 24 * 60 * 60);
-        pfrom->vAddrToSend.clear();
+
+        {
+            LOCK(pfrom->cs_vAddrToSend);
+            pfrom->vAddrToSend.clear();
+        }
+
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             if(addr.nTime > nCutOff)
@@ -4184,6 +4991,20 @@ int ActiveProtocol()
   }
 }
 
+// Messages that only touch per-peer or separately locked state, these are handled without cs_main
+// so the message handler threads are not serialised behind block and transaction processing
+static bool IsLockFreeMessage(const std::string& strCommand)
+{
+    return strCommand == NetMsgType::PING || strCommand == NetMsgType::ADDR || strCommand == NetMsgType::DSEEP;
+}
+
+// Messages whose handlers take cs_main themselves, around the parts that need it. Loose
+// transactions are checked and their signatures verified in parallel, see CTxMemPool::accept
+static bool IsSelfLockingMessage(const std::string& strCommand)
+{
+    return strCommand == NetMsgType::TX;
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool ProcessMessages(CNode* pfrom)
 {
@@ -4267,7 +5088,14 @@ bool ProcessMessages(CNode* pfrom)
 
         try
         {
-            fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+            if (IsLockFreeMessage(strCommand) || IsSelfLockingMessage(strCommand))
+                fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+            else
+            {
+                LOCK(cs_main);
+                fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+            }
+
             boost::this_thread::interruption_point();
         }
         catch (const std::ios_base::failure& e)
@@ -4365,7 +5193,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             {
                 // Periodically clear setAddrKnown to allow refresh broadcasts
                 if (nLastRebroadcast)
+                {
+                    LOCK(pnode->cs_vAddrToSend);
                     pnode->setAddrKnown.clear();
+                }
 
                 // Rebroadcast our address
                 if (fListen)
@@ -4387,28 +5218,27 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
     if (fSendTrickle)
     {
         vector<CAddress> vAddr;
-        vAddr.reserve(pto->vAddrToSend.size());
 
-        BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
         {
-            // Returns true if wasn't already contained in the set
-            if (pto->setAddrKnown.insert(addr).second)
-            {
-                vAddr.push_back(addr);
+            LOCK(pto->cs_vAddrToSend);
+            vAddr.reserve(pto->vAddrToSend.size());
 
-                // Receiver rejects addr messages larger than 1000
-                if (vAddr.size() >= 1000)
-                {
-                    pto->PushMessage(NetMsgType::ADDR, vAddr);
-                    vAddr.clear();
-                }
+            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
+            {
+                // Returns true if wasn't already contained in the set
+                if (pto->setAddrKnown.insert(addr).second)
+                    vAddr.push_back(addr);
             }
-        }
 
-        pto->vAddrToSend.clear();
+            pto->vAddrToSend.clear();
+        }
 
-        if (!vAddr.empty())
-            pto->PushMessage(NetMsgType::ADDR, vAddr);
+        // Receiver rejects addr messages larger than 1000
+        for (unsigned int i = 0; i < vAddr.size(); i += 1000)
+        {
+            vector<CAddress> vAddrBatch(vAddr.begin() + i, vAddr.begin() + std::min(vAddr.size(), (size_t)i + 1000));
+            pto->PushMessage(NetMsgType::ADDR, vAddrBatch);
+        }
     }
 
     // Message: inventory
@@ -4477,6 +5307,13 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
     if (!vInv.empty())
         pto->PushMessage(NetMsgType::INV, vInv);
 
+    // Message: getheaders, getdata for blocks along the best header chain
+    if (!pto->fClient && !pto->fOneShot && !pto->fDisconnect &&
+        (pto->nVersion < NOBLKS_VERSION_START || pto->nVersion >= NOBLKS_VERSION_END))
+    {
+        SendHeadersSyncMessages(pto);
+    }
+
     // Message: getdata
     vector<CInv> vGetData;
     int64_t nNow = GetTime() * 1000000;
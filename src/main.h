@@ -24,6 +24,7 @@
 
 #include <iostream>
 #include <list>
+#include <memory>
 
 using namespace std;
 
@@ -41,6 +42,8 @@ class CNode;
 
 class CTxIn;
 class CTxMemPool;
+class CScriptCheck;
+template <typename T> class CCheckQueueControl;
 
 #define START_MASTERNODE_PAYMENTS_TESTNET 2000
 #define START_MASTERNODE_PAYMENTS 1432123200
@@ -81,6 +84,22 @@ static const int64_t DEVELOPER_PAYMENT_V1 = 3 * CENT; // 3% of block reward
 
 static const int64_t MAX_TIME_SINCE_BEST_BLOCK = 120; // how many seconds to wait before sending next PushGetBlocks()
 
+/** Maximum number of headers in one headers message */
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** Number of blocks that can be requested from a single peer at the same time */
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Blocks further than this ahead of the active tip are not requested, which bounds the orphan pool */
+static const int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Seconds before an unanswered block request is handed to another peer */
+static const int64_t BLOCK_DOWNLOAD_TIMEOUT = 60;
+/** Seconds without headers from the sync peer before another peer takes over */
+static const int64_t HEADERS_SYNC_TIMEOUT = 120;
+
+/** Maximum number of script-checking threads allowed */
+static const int MAX_SCRIPTCHECK_THREADS = 16;
+/** -par default (number of script-checking threads, 0 = auto) */
+static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+
 static const string BOOST_VERSION_NUM = strprintf("Boost %d.%d.%d", (BOOST_VERSION/100000), BOOST_VERSION/100%1000, BOOST_VERSION%100);
 #ifdef USE_UPNP
 static const int fHaveUPnP = true;
@@ -129,6 +148,7 @@ extern bool fUseFastIndex;
 extern unsigned int nDerivationMethodIndex;
 
 extern bool fEnforceCanonical;
+extern int nScriptCheckThreads;
 
 // Minimum disk space required - used in CheckDiskSpace()
 static const uint64_t nMinDiskSpace = 52428800;
@@ -146,10 +166,13 @@ bool LoadExternalBlockFile(FILE* fileIn);
 bool LoadBlockIndex(bool fAllowNew=true);
 void PrintBlockTree();
 void PrintBlockInfo();
-CBlockIndex* FindBlockByHeight(int nHeight);
 int ActiveProtocol();
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
+/** Height of the best validated header, this is ahead of nBestHeight while blocks are downloaded */
+int GetBestHeaderHeight();
+/** Run an instance of the script checking thread */
+void ThreadScriptCheck();
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits);
 unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfStake);
@@ -231,11 +254,11 @@ public:
 class CInPoint
 {
 public:
-    CTransaction* ptx;
+    const CTransaction* ptx;
     unsigned int n;
 
     CInPoint() { SetNull(); }
-    CInPoint(CTransaction* ptxIn, unsigned int nIn) { ptx = ptxIn; n = nIn; }
+    CInPoint(const CTransaction* ptxIn, unsigned int nIn) { ptx = ptxIn; n = nIn; }
     void SetNull() { ptx = NULL; n = (unsigned int) -1; }
     bool IsNull() const { return (ptx == NULL && n == (unsigned int) -1); }
 };
@@ -627,6 +650,10 @@ public:
 
     bool ReadFromDisk(CDiskTxPos pos, FILE** pfileRet=NULL)
     {
+        // Positioned read through the block file cache, unless the caller wants the file
+        if (!pfileRet)
+            return ReadTransactionFromBlockFile(pos, *this);
+
         CAutoFile filein = CAutoFile(OpenBlockFile(pos.nFile, 0, pfileRet ? "rb+" : "rb"), SER_DISK, CLIENT_VERSION);
         if (!filein)
             return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
@@ -713,7 +740,7 @@ public:
      @return    Returns true if all inputs are in txdb or mapTestPool
      */
     bool FetchInputs(CTxDB& txdb, const std::map<uint256, CTxIndex>& mapTestPool,
-                     bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid);
+                     bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid) const;
 
     /** Sanity check previous transactions, then, if all checks succeed,
         mark them as spent by this transaction.
@@ -724,11 +751,13 @@ public:
         @param[in] pindexBlock
         @param[in] fBlock   true if called from ConnectBlock
         @param[in] fMiner   true if called from CreateNewBlock
+        @param[out] pvChecks    If non-null, signature checks are appended here instead of being run
         @return Returns true if all checks succeed
      */
     bool ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
                        std::map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool *txAlreadyUsed=nullptr);
+                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool *txAlreadyUsed=nullptr,
+                       std::vector<CScriptCheck> *pvChecks=nullptr) const;
     bool ClientConnectInputs();
     bool CheckTransaction() const;
     bool AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs=true, bool* pfMissingInputs=NULL);
@@ -738,6 +767,38 @@ protected:
     const CTxOut& GetOutputFor(const CTxIn& input, const MapPrevTx& inputs) const;
 };
 
+/** A transaction that is shared, not copied, once nothing may change it any more */
+typedef std::shared_ptr<const CTransaction> CTransactionRef;
+
+/** Closure representing one script verification.
+ *  Note that this stores a pointer to the spending transaction, which must
+ *  outlive the check (it is always a member of the block being connected).
+ */
+class CScriptCheck
+{
+private:
+    CScript scriptPubKey;
+    const CTransaction *ptxTo;
+    unsigned int nIn;
+    int nHashType;
+
+public:
+    CScriptCheck() : ptxTo(0), nIn(0), nHashType(0) {}
+    CScriptCheck(const CTransaction& txFromIn, const CTransaction& txToIn, unsigned int nInIn, int nHashTypeIn) :
+        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
+        ptxTo(&txToIn), nIn(nInIn), nHashType(nHashTypeIn) {}
+
+    bool operator()() const;
+
+    void swap(CScriptCheck &check)
+    {
+        scriptPubKey.swap(check.scriptPubKey);
+        std::swap(ptxTo, check.ptxTo);
+        std::swap(nIn, check.nIn);
+        std::swap(nHashType, check.nHashType);
+    }
+};
+
 /**  A txdb record that contains the disk location of a transaction and the
  * locations of transactions that spend its outputs.  vSpent is really only
  * used as a flag, but having the location is very helpful for debugging.
@@ -994,25 +1055,14 @@ public:
 
     bool WriteToDisk(unsigned int& nFileRet, unsigned int& nBlockPosRet)
     {
-        CAutoFile fileout = CAutoFile(AppendBlockFile(nFileRet), SER_DISK, CLIENT_VERSION);
-
-        if (!fileout)
-            return error("CBlock::WriteToDisk() : AppendBlockFile failed");
-
-        unsigned int nSize = fileout.GetSerializeSize(*this);
-        fileout << FLATDATA(pchMessageStart) << nSize;
-
-        long fileOutPos = ftell(fileout);
+        CDataStream ssBlock(SER_DISK, CLIENT_VERSION);
+        ssBlock.reserve(::GetSerializeSize(*this, SER_DISK, CLIENT_VERSION));
+        ssBlock << *this;
 
-        if (fileOutPos < 0)
-            return error("CBlock::WriteToDisk() : ftell failed");
+        bool fCommit = !IsInitialBlockDownload() || (nBestHeight+1) % 500 == 0;
 
-        nBlockPosRet = fileOutPos;
-        fileout << *this;
-        fflush(fileout);
-
-        if (!IsInitialBlockDownload() || (nBestHeight+1) % 500 == 0)
-            FileCommit(fileout);
+        if (!AppendBlockFile(ssBlock, nFileRet, nBlockPosRet, fCommit))
+            return error("CBlock::WriteToDisk() : AppendBlockFile failed");
 
         return true;
     }
@@ -1020,17 +1070,17 @@ public:
     bool ReadFromDisk(unsigned int nFile, unsigned int nBlockPos, bool fReadTransactions=true)
     {
         SetNull();
-        CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos, "rb"), SER_DISK, CLIENT_VERSION);
+        CDataStream ssBlock(SER_DISK, CLIENT_VERSION);
 
-        if (!filein)
-            return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
+        if (!ReadBlockFileRaw(nFile, nBlockPos, ssBlock))
+            return error("CBlock::ReadFromDisk() : ReadBlockFileRaw failed");
 
         if (!fReadTransactions)
-            filein.nType |= SER_BLOCKHEADERONLY;
+            ssBlock.nType |= SER_BLOCKHEADERONLY;
 
         try
         {
-            filein >> *this;
+            ssBlock >> *this;
         }
         catch (std::exception &e)
         {
@@ -1074,7 +1124,8 @@ public:
     bool DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex);
     bool CalculateBlockAmounts(CTxDB& txdb, CBlockIndex *pindex, std::map<uint256, CTxIndex>& mapQueuedChanges,
                                int64_t& nFees,  int64_t& nValueIn, int64_t& nValueOut, int64_t& nStakeReward,
-                               bool fJustCheck, bool skipTxCheck, bool connectInputs);
+                               bool fJustCheck, bool skipTxCheck, bool connectInputs,
+                               CCheckQueueControl<CScriptCheck> *pControl=nullptr);
     bool ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck=false, bool reorganize=false, int postponedBlocks=-1);
     bool ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions=true);
     bool SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew);
@@ -1412,6 +1463,61 @@ public:
     }
 };
 
+/** The active block chain, indexed by height. Kept in step with pindexBest and the pnext links,
+  * so that finding a block by height or whether a block is on the chain takes constant time. */
+class CChain
+{
+private:
+    mutable CCriticalSection cs;
+    std::vector<CBlockIndex*> vChain;
+
+public:
+    CBlockIndex* Genesis() const
+    {
+        LOCK(cs);
+        return vChain.empty() ? NULL : vChain[0];
+    }
+
+    CBlockIndex* Tip() const
+    {
+        LOCK(cs);
+        return vChain.empty() ? NULL : vChain.back();
+    }
+
+    // The block at nHeight, or NULL if the chain is not that high
+    CBlockIndex* operator[](int nHeight) const
+    {
+        LOCK(cs);
+
+        if (nHeight < 0 || nHeight >= (int)vChain.size())
+            return NULL;
+
+        return vChain[nHeight];
+    }
+
+    bool Contains(const CBlockIndex* pindex) const
+    {
+        return pindex && (*this)[pindex->nHeight] == pindex;
+    }
+
+    CBlockIndex* Next(const CBlockIndex* pindex) const
+    {
+        return Contains(pindex) ? (*this)[pindex->nHeight + 1] : NULL;
+    }
+
+    int Height() const
+    {
+        LOCK(cs);
+        return (int)vChain.size() - 1;
+    }
+
+    void SetTip(CBlockIndex* pindex);
+
+    // The last block of the chain that pindex descends from
+    CBlockIndex* FindFork(CBlockIndex* pindex) const;
+};
+
+extern CChain chainActive;
 extern CTxMemPool mempool;
 extern bool isMasternodeListSynced;
 
@@ -11,7 +11,12 @@
 #include "script/standard.h"
 #include "util.h"
 #include "addrman.h"
+#include "clientversion.h"
+#include "random.h"
+#include "scheduler.h"
+#include "txdb.h"
 
+#include <boost/filesystem.hpp>
 #include <boost/format.hpp>
 #include <boost/lexical_cast.hpp>
 #include <sstream>
@@ -19,13 +24,13 @@
 CCriticalSection cs_masternodes;
 
 CMasternodeMan mnodeman;
-std::vector<CMasternode> vecMasternodes;
 CMasternodePayments masternodePayments;
 map<uint256, CMasternodePaymentWinner> mapSeenMasternodeVotes;
 map<uint256, int> mapSeenMasternodeScanningErrors;
 std::map<CNetAddr, int64_t> mAskedUsForMasternodeList;
 std::map<COutPoint, int64_t> mWeAskedForMasternodeListEntry;
 std::map<int64_t, uint256> mapCacheBlockHashes;
+std::atomic<unsigned int> nMasternodeListVersion(0);
 
 // manage the masternode connections
 void ProcessMasternodeConnections()
@@ -149,14 +154,15 @@ void ProcessMessageMasternode(CNode* pfrom, std::string& strCommand, CDataStream
         }
 
         // search existing masternode list, this is where we update existing masternodes with new dsee broadcasts
-        CMasternode* pmn = mnodeman.Find(vin);
-        if (pmn != NULL)
+        CMasternode mnExisting;
+
+        if (mnodeman.Get(vin, mnExisting))
         {
             if (fDebug)
             {
                 LogPrintf("%s : dsee - found existing masternode %s - %s - %s\n", __func__,
-                          pmn->addr.ToString().c_str(), vin.ToString().c_str(),
-                          pmn->UpdatedWithin(MASTERNODE_MIN_DSEE_SECONDS));
+                          mnExisting.addr.ToString().c_str(), vin.ToString().c_str(),
+                          mnExisting.UpdatedWithin(MASTERNODE_MIN_DSEE_SECONDS));
             }
 
             // count == -1 when it's a new entry
@@ -164,21 +170,28 @@ void ProcessMessageMasternode(CNode* pfrom, std::string& strCommand, CDataStream
             // mn.pubkey = pubkey, IsVinAssociatedWithPubkey is validated once below,
             //   after that they just need to match
 
-            if (count == -1 && pmn->pubkey == pubkey && !pmn->UpdatedWithin(MASTERNODE_MIN_DSEE_SECONDS))
+            if (count == -1 && mnExisting.pubkey == pubkey && !mnExisting.UpdatedWithin(MASTERNODE_MIN_DSEE_SECONDS))
             {
                 LogPrintf("%s : dsee - update masternode last seen for %s\n", __func__, addr.ToString().c_str());
-                pmn->UpdateLastSeen();
+                bool fUpdated = false;
 
-                if (pmn->now < sigTime)
-                {
-                    LogPrintf("%s : dsee - Got updated entry for %s\n", __func__, addr.ToString().c_str());
+                mnodeman.Update(vin, [&](CMasternode& mn) {
+                    mn.UpdateLastSeen();
 
-                    pmn->pubkey2 = pubkey2;
-                    pmn->now = sigTime;
-                    pmn->sig = vchSig;
-                    pmn->protocolVersion = protocolVersion;
-                    pmn->addr = addr;
+                    if (mn.now < sigTime)
+                    {
+                        mn.pubkey2 = pubkey2;
+                        mn.now = sigTime;
+                        mn.sig = vchSig;
+                        mn.protocolVersion = protocolVersion;
+                        mn.addr = addr;
+                        fUpdated = true;
+                    }
+                });
 
+                if (fUpdated)
+                {
+                    LogPrintf("%s : dsee - Got updated entry for %s\n", __func__, addr.ToString().c_str());
                     RelayDarkSendElectionEntry(vin, addr, vchSig, sigTime, pubkey, pubkey2, count, current, lastUpdated, protocolVersion);
                 }
             }
@@ -202,7 +215,7 @@ void ProcessMessageMasternode(CNode* pfrom, std::string& strCommand, CDataStream
             LogPrintf("%s : dsee - got new masternode entry %s\n", __func__, addr.ToString().c_str());
 
         // make sure it's still unspent
-        //  - this is checked later by .check() in many places and by ThreadCheckDarkSend()
+        //  - after that a spend is picked up from the blocks by CMasternodeMan::BlockConnected()
 
         CTransaction tx = CTransaction();
         CTxOut vout = CTxOut(24999*COIN, darkSendPool.collateralPubKey);
@@ -232,7 +245,10 @@ void ProcessMessageMasternode(CNode* pfrom, std::string& strCommand, CDataStream
             // add our masternode
             CMasternode mn(addr, vin, pubkey, vchSig, sigTime, pubkey2, protocolVersion);
             mn.UpdateLastSeen(lastUpdated);
-            vecMasternodes.push_back(mn);
+
+            // another peer got the same entry to us first
+            if (mnodeman.Add(mn) == -1)
+                return;
 
             // if it matches our masternodeprivkey, then we've been remotely activated
             if (pubkey2 == activeMasternode.pubKeyMasternode && protocolVersion == PROTOCOL_VERSION)
@@ -292,32 +308,32 @@ void ProcessMessageMasternode(CNode* pfrom, std::string& strCommand, CDataStream
             return;
         }
 
-        // see if we have this masternode
-        CMasternode* pmn = mnodeman.Find(vin);
+        // see if we have this masternode, dseep is handled without cs_main so work on a copy
+        CMasternode mnExisting;
 
-        if (pmn != NULL)
+        if (mnodeman.Get(vin, mnExisting))
         {
             if (fDebug)
             {
                 LogPrintf("%s : dseep - found corresponding mn for vin=%s addr=%s\n", __func__,
-                          vin.ToString().c_str(), pmn->addr.ToString());
+                          vin.ToString().c_str(), mnExisting.addr.ToString());
             }
 
             // take this only if it's newer
-            if (sigTime - pmn->lastDseep > MASTERNODE_MIN_DSEEP_SECONDS)
+            if (sigTime - mnExisting.lastDseep > MASTERNODE_MIN_DSEEP_SECONDS)
             {
-                std::string strMessage = pmn->addr.ToString() + boost::lexical_cast<std::string>(sigTime) +
+                std::string strMessage = mnExisting.addr.ToString() + boost::lexical_cast<std::string>(sigTime) +
                                          boost::lexical_cast<std::string>(stop);
 
                 if (fDebug)
                 {
                     LogPrintf("%s : dseep - got newer sigTime, sigTime=%d lastDseep=%d\n",
-                              __func__, sigTime, pmn->lastDseep);
+                              __func__, sigTime, mnExisting.lastDseep);
                 }
 
                 std::string errorMessage = "";
 
-                if (!darkSendSigner.VerifyMessage(pmn->pubkey2, vchSig, strMessage, errorMessage))
+                if (!darkSendSigner.VerifyMessage(mnExisting.pubkey2, vchSig, strMessage, errorMessage))
                 {
                     std::stringstream msg;
                     msg << boost::format("%s : dseep - got bad masternode address signature %s") %
@@ -328,22 +344,21 @@ void ProcessMessageMasternode(CNode* pfrom, std::string& strCommand, CDataStream
                     return;
                 }
 
-                pmn->lastDseep = sigTime;
-                pmn->Check();
+                mnodeman.Update(vin, [&](CMasternode& mn) { mn.lastDseep = sigTime; });
 
-                if (pmn->IsEnabled())
+                if (mnodeman.Check(vin))
                 {
                     if (fDebug)
-                        LogPrintf("%s : dseep - masternode is enabled addr=%s\n", __func__, pmn->addr.ToString());
+                        LogPrintf("%s : dseep - masternode is enabled addr=%s\n", __func__, mnExisting.addr.ToString());
 
                     if (stop)
-                        pmn->Disable();
+                        mnodeman.Update(vin, [](CMasternode& mn) { mn.Disable(); });
                     else
                     {
                         if (fDebug)
-                            LogPrintf("%s : dseep - updatingLastSeen addr=%s\n", __func__, pmn->addr.ToString());
+                            LogPrintf("%s : dseep - updatingLastSeen addr=%s\n", __func__, mnExisting.addr.ToString());
 
-                        pmn->UpdateLastSeen();
+                        mnodeman.Update(vin, [](CMasternode& mn) { mn.UpdateLastSeen(); });
                     }
 
                     TRY_LOCK(cs_vNodes, lockNodes);
@@ -353,7 +368,7 @@ void ProcessMessageMasternode(CNode* pfrom, std::string& strCommand, CDataStream
 
                     if  (fDebug)
                     {
-                        LogPrintf("%s : dseep - relaying %s - %s\n", __func__, pmn->addr.ToString(),
+                        LogPrintf("%s : dseep - relaying %s - %s\n", __func__, mnExisting.addr.ToString(),
                                   vin.prevout.hash.ToString());
                     }
 
@@ -400,11 +415,11 @@ void ProcessMessageMasternode(CNode* pfrom, std::string& strCommand, CDataStream
             mAskedUsForMasternodeList[pfrom->addr] = askAgain;
         } // else, asking for a specific node which is ok
 
-        LOCK(cs_masternodes);
-        int count = vecMasternodes.size();
+        std::vector<CMasternode> vMasternodes = mnodeman.GetFullMasternodeVector();
+        int count = vMasternodes.size();
         int i = 0;
 
-        BOOST_FOREACH(CMasternode mn, vecMasternodes)
+        BOOST_FOREACH(CMasternode& mn, vMasternodes)
         {
             if (mn.addr.IsRFC1918())
                 continue; // local network
@@ -578,183 +593,177 @@ void ProcessMessageMasternode(CNode* pfrom, std::string& strCommand, CDataStream
     }
 }
 
-struct CompareValueOnly
+//Get the last hash that matches the modulus given. Processed in reverse order
+bool GetBlockHash(uint256& hash, int nBlockHeight)
 {
-    bool operator()(const pair<int64_t, CTxIn>& t1,
-                    const pair<int64_t, CTxIn>& t2) const
+    if (pindexBest == NULL || nBlockHeight < 0 || nBlockHeight > nBestHeight)
     {
-        return t1.first < t2.first;
+        LogPrintf("%s : failed to get block %d\n", __func__, nBlockHeight);
+        return false;
     }
+
+    if (nBlockHeight == 0)
+        nBlockHeight = pindexBest->nHeight;
+
+    CBlockIndex* pindex = chainActive[nBlockHeight];
+
+    if (pindex == NULL)
+        return false;
+
+    hash = pindex->GetBlockHash();
+    return true;
+}
+
+/** The enabled masternodes at a height, ordered by score with the best first */
+struct CMasternodeRanking
+{
+    unsigned int nListVersion;
+    uint256 hashBlock;
+    std::vector<std::pair<unsigned int, int> > vScores; // score, registry handle
+    robin_hood::unordered_flat_map<COutPoint, int, COutPointHasher> mapRank;
+
+    CMasternodeRanking() : nListVersion(0), hashBlock(0) {}
 };
 
-struct CompareValueOnly2
+// rankings by (height, minimum protocol), only a few heights are asked for at any time
+static std::map<std::pair<int64_t, int>, CMasternodeRanking> mapMasternodeRankings;
+static const unsigned int MAX_MASTERNODE_RANKINGS = 16;
+
+struct CompareMasternodeScore
 {
-    bool operator()(const pair<int64_t, int>& t1,
-                    const pair<int64_t, int>& t2) const
+    bool operator()(const std::pair<unsigned int, int>& t1,
+                    const std::pair<unsigned int, int>& t2) const
     {
-        return t1.first < t2.first;
+        // best score first, ties go to the older entry
+        return t1.first != t2.first ? t1.first > t2.first : t1.second < t2.second;
     }
 };
 
-int CountMasternodesAboveProtocol(int protocolVersion)
+// the first bytes of |Hash(hash || aux) - Hash(hash)|, with hashDigest = Hash(hash)
+static unsigned int GetMasternodeScore(const uint256& hash, const uint256& hashDigest, const CTxIn& vin)
 {
-    int i = 0;
-    LOCK(cs_masternodes);
-
-    BOOST_FOREACH(CMasternode& mn, vecMasternodes)
-    {
-        if (mn.protocolVersion < protocolVersion)
-            continue;
-
-        i++;
-    }
+    uint256 aux = vin.prevout.hash + vin.prevout.n;
+    uint256 hash3 = Hash(BEGIN(hash), END(hash), BEGIN(aux), END(aux));
+    uint256 r = (hash3 > hashDigest ? hash3 - hashDigest : hashDigest - hash3);
 
-    return i;
+    unsigned int n = 0;
+    memcpy(&n, &r, sizeof(n));
+    return n;
 }
 
-int GetMasternodeByVin(CTxIn& vin)
+// Scores every masternode once per block and list change; requires cs_masternodes
+static const CMasternodeRanking& GetMasternodeRanking(int64_t nBlockHeight, int minProtocol)
 {
-    int i = 0;
-    LOCK(cs_masternodes);
+    uint256 hashBlock = 0;
+    bool fHaveBlock = pindexBest != NULL && GetBlockHash(hashBlock, nBlockHeight - MASTERNODE_BLOCK_OFFSET);
+
+    // a reorganization below the height changes the block hash
+    std::pair<int64_t, int> key = std::make_pair(nBlockHeight, minProtocol);
+    std::map<std::pair<int64_t, int>, CMasternodeRanking>::iterator it = mapMasternodeRankings.find(key);
 
-    BOOST_FOREACH(CMasternode& mn, vecMasternodes)
+    if (it != mapMasternodeRankings.end())
     {
-        if (mn.vin == vin)
-            return i;
+        if (it->second.nListVersion == nMasternodeListVersion && it->second.hashBlock == hashBlock)
+            return it->second;
+    }
+    else
+    {
+        if (mapMasternodeRankings.size() >= MAX_MASTERNODE_RANKINGS)
+            mapMasternodeRankings.erase(mapMasternodeRankings.begin());
 
-        i++;
+        it = mapMasternodeRankings.insert(std::make_pair(key, CMasternodeRanking())).first;
     }
 
-    return -1;
-}
+    // read the version before the entries, a change in between only costs a rebuild
+    CMasternodeRanking& ranking = it->second;
+    ranking.nListVersion = nMasternodeListVersion;
+    ranking.hashBlock = hashBlock;
+    ranking.vScores.clear();
+    ranking.mapRank.clear();
 
-int GetCurrentMasterNode(int mod, int64_t nBlockHeight, int minProtocol)
-{
-    int i = 0;
-    unsigned int score = 0;
-    int winner = -1;
-    LOCK(cs_masternodes);
+    // in order of handle, so sorting on the position breaks ties the same way
+    std::vector<std::pair<int, CMasternode> > vEntries = mnodeman.GetEntries();
+    std::vector<std::pair<unsigned int, int> > vScores;
+    uint256 hashDigest = Hash(BEGIN(hashBlock), END(hashBlock));
 
-    // scan for winner
-    BOOST_FOREACH(CMasternode mn, vecMasternodes)
+    for (unsigned int i = 0; i < vEntries.size(); i++)
     {
-        mn.Check();
+        const CMasternode& mn = vEntries[i].second;
 
-        if (mn.protocolVersion < minProtocol || !mn.IsEnabled())
-        {
-            i++;
+        if (mn.protocolVersion < minProtocol || mn.nActiveState != CMasternode::MASTERNODE_ENABLED)
             continue;
-        }
 
-        // calculate the score for each masternode
-        uint256 n = mn.CalculateScore(nBlockHeight);
-        unsigned int n2 = 0;
-        memcpy(&n2, &n, sizeof(n2));
+        unsigned int nScore = fHaveBlock ? GetMasternodeScore(hashBlock, hashDigest, mn.vin) : 0;
+        vScores.push_back(std::make_pair(nScore, (int)i));
+    }
 
-        // determine the winner
-        if (n2 > score)
-        {
-            score = n2;
-            winner = i;
-        }
+    std::sort(vScores.begin(), vScores.end(), CompareMasternodeScore());
+    ranking.vScores.reserve(vScores.size());
 
-        i++;
+    for (unsigned int i = 0; i < vScores.size(); i++)
+    {
+        const std::pair<int, CMasternode>& entry = vEntries[vScores[i].second];
+        ranking.vScores.push_back(std::make_pair(vScores[i].first, entry.first));
+        ranking.mapRank[entry.second.vin.prevout] = i + 1;
     }
 
-    return winner;
+    return ranking;
 }
 
-int GetMasternodeByRank(int findRank, int64_t nBlockHeight, int minProtocol)
+int CountMasternodesAboveProtocol(int protocolVersion)
 {
-    LOCK(cs_masternodes);
     int i = 0;
-    std::vector<pair<unsigned int, int> > vecMasternodeScores;
 
-    BOOST_FOREACH(CMasternode mn, vecMasternodes)
+    BOOST_FOREACH(const CMasternode& mn, mnodeman.GetFullMasternodeVector())
     {
-        mn.Check();
-
-        if (mn.protocolVersion < minProtocol)
-            continue;
-
-        if (!mn.IsEnabled())
-        {
-            i++;
+        if (mn.protocolVersion < protocolVersion)
             continue;
-        }
-
-        uint256 n = mn.CalculateScore(nBlockHeight);
-        unsigned int n2 = 0;
-        memcpy(&n2, &n, sizeof(n2));
 
-        vecMasternodeScores.push_back(make_pair(n2, i));
         i++;
     }
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareValueOnly2());
-    int rank = 0;
-
-    BOOST_FOREACH (PAIRTYPE(unsigned int, int)& s, vecMasternodeScores)
-    {
-        rank++;
-
-        if (rank == findRank)
-            return s.second;
-    }
+    return i;
+}
 
-    return -1;
+int GetMasternodeByVin(CTxIn& vin)
+{
+    return mnodeman.GetHandle(vin);
 }
 
-int GetMasternodeRank(CTxIn& vin, int64_t nBlockHeight, int minProtocol)
+int GetCurrentMasterNode(int mod, int64_t nBlockHeight, int minProtocol)
 {
     LOCK(cs_masternodes);
-    std::vector<pair<unsigned int, CTxIn> > vecMasternodeScores;
-
-    BOOST_FOREACH(CMasternode& mn, vecMasternodes)
-    {
-        mn.Check();
-
-        if (mn.protocolVersion < minProtocol)
-            continue;
-
-        if (!mn.IsEnabled())
-            continue;
+    const CMasternodeRanking& ranking = GetMasternodeRanking(nBlockHeight, minProtocol);
 
-        uint256 n = mn.CalculateScore(nBlockHeight);
-        unsigned int n2 = 0;
-        memcpy(&n2, &n, sizeof(n2));
+    // without a block to score against every masternode scores zero and nobody wins
+    if (ranking.vScores.empty() || ranking.vScores[0].first == 0)
+        return -1;
 
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
-    }
-
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareValueOnly());
-    unsigned int rank = 0;
+    return ranking.vScores[0].second;
+}
 
-    BOOST_FOREACH (PAIRTYPE(unsigned int, CTxIn)& s, vecMasternodeScores)
-    {
-        rank++;
+int GetMasternodeByRank(int findRank, int64_t nBlockHeight, int minProtocol)
+{
+    LOCK(cs_masternodes);
+    const CMasternodeRanking& ranking = GetMasternodeRanking(nBlockHeight, minProtocol);
 
-        if (s.second == vin)
-            return rank;
-    }
+    if (findRank < 1 || findRank > (int)ranking.vScores.size())
+        return -1;
 
-    return -1;
+    return ranking.vScores[findRank - 1].second;
 }
 
-//Get the last hash that matches the modulus given. Processed in reverse order
-bool GetBlockHash(uint256& hash, int nBlockHeight)
+int GetMasternodeRank(CTxIn& vin, int64_t nBlockHeight, int minProtocol)
 {
-    if (pindexBest == NULL || nBlockHeight < 0 || nBlockHeight > nBestHeight)
-    {
-        LogPrintf("%s : failed to get block %d\n", __func__, nBlockHeight);
-        return false;
-    }
+    LOCK(cs_masternodes);
+    const CMasternodeRanking& ranking = GetMasternodeRanking(nBlockHeight, minProtocol);
 
-    if (nBlockHeight == 0)
-        nBlockHeight = pindexBest->nHeight;
+    robin_hood::unordered_flat_map<COutPoint, int, COutPointHasher>::const_iterator it = ranking.mapRank.find(vin.prevout);
 
-    hash = FindBlockByHeight(nBlockHeight)->GetBlockHash();
-    return true;
+    if (it == ranking.mapRank.end())
+        return -1;
+
+    return it->second;
 }
 
 // Deterministically calculate a given "score" for a masternode depending on how close it's hash is to
@@ -777,12 +786,9 @@ uint256 CMasternode::CalculateScore(unsigned int nBlockHeight)
         LogPrintf("%s : failed to get blockhash\n", __func__);
         return 0;
     }
-    CDataStream ss(SER_GETHASH, 0);
-    ss << hash;
-    uint256 hash2 = Hash(ss.begin(), ss.end());
 
-    ss << aux;
-    uint256 hash3 = Hash(ss.begin(), ss.end());
+    uint256 hash2 = Hash(BEGIN(hash), END(hash));
+    uint256 hash3 = Hash(BEGIN(hash), END(hash), BEGIN(aux), END(aux));
 
     uint256 r = (hash3 > hash2 ? hash3 - hash2 : hash2 - hash3);
     return r;
@@ -818,23 +824,7 @@ void CMasternode::Check()
         return;
     }
 
-    if (!unitTest)
-    {
-        CTransaction tx = CTransaction();
-        CTxOut vout = CTxOut(24999 * COIN, darkSendPool.collateralPubKey);
-        tx.vin.push_back(vin);
-        tx.vout.push_back(vout);
-
-        // if(!AcceptableInputs(mempool, state, tx)){
-        bool pfMissingInputs = false;
-
-        if (!AcceptableInputs(mempool, tx, false, &pfMissingInputs))
-        {
-            nActiveState = MASTERNODE_VIN_SPENT;
-            return;
-        }
-    }
-
+    // a spent collateral is picked up from the blocks, see CMasternodeMan::BlockConnected
     nActiveState = MASTERNODE_ENABLED; // OK
 }
 
@@ -1017,7 +1007,7 @@ void CMasternodePayments::CleanPaymentList()
     if (pindexBest == nullptr)
         return;
 
-    int nLimit = std::max(((int) vecMasternodes.size()) * 2, 1000);
+    int nLimit = std::max(mnodeman.size() * 2, 1000);
 
     for (int i = 0; i < (int) vWinning.size() - nLimit; i++)
     {
@@ -1026,54 +1016,72 @@ void CMasternodePayments::CleanPaymentList()
        if (vWinning.erase(height) > 0 && fDebug)
            LogPrintf("%s : Removing old masternode payment block %d\n", __func__, height);
     }
-}
 
-bool CMasternodePayments::ProcessBlock(int nBlockHeight, bool reorganize)
-{
-    CMasternodePaymentWinner winner;
+    // seen votes are only worth keeping, and saving, for the blocks still in the list
+    int nSeenRemoved = 0;
+    map<uint256, CMasternodePaymentWinner>::iterator it = mapSeenMasternodeVotes.begin();
 
+    while (it != mapSeenMasternodeVotes.end())
     {
-        LOCK(cs_masternodes);
+        if (vWinning.count(it->second.nBlockHeight))
+        {
+            ++it;
+            continue;
+        }
 
-        // scan for winner
-        unsigned int score = 0;
+        mapSeenMasternodeVotes.erase(it++);
+        nSeenRemoved++;
+    }
 
-        for (CMasternode mn : vecMasternodes)
-        {
-            mn.Check();
+    if (nSeenRemoved > 0 && fDebug)
+        LogPrintf("%s : Removed %d seen masternode payment votes\n", __func__, nSeenRemoved);
+}
 
-            if (!mn.IsEnabled())
-                continue;
+std::map<int, CMasternodePaymentWinner> CMasternodePayments::GetWinners()
+{
+    LOCK(cs_masternodes);
+    return vWinning;
+}
 
-            // calculate the score for each masternode
-            uint256 nScore_256 = mn.CalculateScore(nBlockHeight);
-            unsigned int n2 = static_cast<unsigned int>(nScore_256.Get64());
+void CMasternodePayments::LoadWinners(const std::map<int, CMasternodePaymentWinner>& mapWinners)
+{
+    LOCK(cs_masternodes);
 
-            // determine the winner
-            if (n2 > score)
-            {
-                score = n2;
-                winner.score = n2;
-                winner.nBlockHeight = nBlockHeight;
-                winner.vin = mn.vin;
-                winner.payee = GetScriptForDestination(mn.pubkey.GetID());
-            }
-        }
+    // anything learned since startup takes precedence
+    vWinning.insert(mapWinners.begin(), mapWinners.end());
+}
+
+bool CMasternodePayments::ProcessBlock(int nBlockHeight, bool reorganize)
+{
+    CMasternodePaymentWinner winner;
+
+    // the best scoring masternode, scored the same way as the ranking
+    CMasternode mnWinner;
+    int nHandle = GetCurrentMasterNode(1, nBlockHeight);
+
+    if (nHandle != -1 && mnodeman.Get(nHandle, mnWinner))
+    {
+        winner.score = static_cast<unsigned int>(mnWinner.CalculateScore(nBlockHeight).Get64());
+        winner.nBlockHeight = nBlockHeight;
+        winner.vin = mnWinner.vin;
+        winner.payee = GetScriptForDestination(mnWinner.pubkey.GetID());
     }
 
+    std::vector<CMasternode> vMasternodes = mnodeman.GetFullMasternodeVector();
+
     // if we can't find someone to get paid, pick randomly
-    if (winner.nBlockHeight == 0 && vecMasternodes.size() > 0)
+    if (winner.nBlockHeight == 0 && vMasternodes.size() > 0)
     {
         LogPrintf("%s : using random mn as winner\n", __func__);
         winner.score = 0;
         winner.nBlockHeight = nBlockHeight;
         unsigned int nHeightOffset = nBlockHeight;
 
-        if (nHeightOffset > vecMasternodes.size() - 1)
-            nHeightOffset = (vecMasternodes.size() - 1) % nHeightOffset;
+        if (nHeightOffset > vMasternodes.size() - 1)
+            nHeightOffset = (vMasternodes.size() - 1) % nHeightOffset;
 
-        winner.vin = vecMasternodes[nHeightOffset].vin;
-        winner.payee = GetScriptForDestination(vecMasternodes[nHeightOffset].pubkey.GetID());
+        winner.vin = vMasternodes[nHeightOffset].vin;
+        winner.payee = GetScriptForDestination(vMasternodes[nHeightOffset].pubkey.GetID());
     }
 
     CTxDestination address1;
@@ -1104,7 +1112,7 @@ bool CMasternodePayments::ProcessBlock(int nBlockHeight, bool reorganize)
 
 bool CMasternodePayments::ProcessManyBlocks(int nBlockHeight)
 {
-    if (vecMasternodes.empty())
+    if (mnodeman.size() == 0)
         return false;
 
     for (int i = nBlockHeight + 1; i < nBlockHeight + 10; i++)
@@ -1159,8 +1167,45 @@ bool CMasternodePayments::SetPrivKey(std::string strPrivKey)
         return false;
 }
 
+void CMasternodeMan::Index(int nHandle, const CMasternode& mn)
+{
+    mapByOutpoint[mn.vin.prevout] = nHandle;
+}
+
+void CMasternodeMan::Unindex(int nHandle, const CMasternode& mn)
+{
+    mapByOutpoint.erase(mn.vin.prevout);
+}
+
+std::map<int, CMasternode>::iterator CMasternodeMan::FindEntry(const COutPoint& outpoint)
+{
+    robin_hood::unordered_flat_map<COutPoint, int, COutPointHasher>::const_iterator it = mapByOutpoint.find(outpoint);
+
+    if (it == mapByOutpoint.end())
+        return mapMasternodes.end();
+
+    return mapMasternodes.find(it->second);
+}
+
+int CMasternodeMan::Add(const CMasternode& mn)
+{
+    boost::unique_lock<boost::shared_mutex> lock(csMasternodes);
+
+    if (mapByOutpoint.count(mn.vin.prevout))
+        return -1;
+
+    int nHandle = nNextHandle++;
+    mapMasternodes.insert(std::make_pair(nHandle, mn));
+    Index(nHandle, mn);
+    nMasternodeListVersion++;
+
+    return nHandle;
+}
+
 void CMasternodeMan::AskForMN(CNode* pnode, CTxIn& vin)
 {
+    LOCK(cs);
+
     std::map<COutPoint, int64_t>::iterator i = mWeAskedForMasternodeListEntry.find(vin.prevout);
 
     if (i != mWeAskedForMasternodeListEntry.end())
@@ -1181,36 +1226,112 @@ void CMasternodeMan::AskForMN(CNode* pnode, CTxIn& vin)
     mWeAskedForMasternodeListEntry[vin.prevout] = askAgain;
 }
 
+// CMasternode::Check only looks at the entry and the clock, so it runs on
+// the entries themselves under the exclusive lock
 void CMasternodeMan::Check()
 {
-    LOCK(cs_masternodes);
+    boost::unique_lock<boost::shared_mutex> lock(csMasternodes);
+
+    for (std::map<int, CMasternode>::iterator it = mapMasternodes.begin(); it != mapMasternodes.end(); ++it)
+    {
+        int nPrevState = it->second.nActiveState;
+        it->second.Check();
+
+        if (it->second.nActiveState != nPrevState)
+            nMasternodeListVersion++;
+    }
+}
 
-    BOOST_FOREACH (CMasternode& mn, vecMasternodes)
-        mn.Check();
+bool CMasternodeMan::Check(const CTxIn& vin)
+{
+    bool fEnabled = false;
+    Update(vin, [&](CMasternode& mn) { mn.Check(); fEnabled = mn.IsEnabled(); });
+
+    return fEnabled;
+}
+
+void CMasternodeMan::BlockConnected(const CBlock& block)
+{
+    boost::unique_lock<boost::shared_mutex> lock(csMasternodes);
+
+    if (mapByOutpoint.empty())
+        return;
+
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    {
+        if (tx.IsCoinBase())
+            continue;
+
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            std::map<int, CMasternode>::iterator it = FindEntry(txin.prevout);
+
+            if (it == mapMasternodes.end() || it->second.nActiveState == CMasternode::MASTERNODE_VIN_SPENT)
+                continue;
+
+            LogPrintf("%s : collateral of masternode %s spent by %s\n", __func__,
+                      it->second.addr.ToString(), tx.GetHash().ToString());
+
+            it->second.nActiveState = CMasternode::MASTERNODE_VIN_SPENT;
+            nMasternodeListVersion++;
+        }
+    }
+}
+
+void CMasternodeMan::BlockDisconnected(const CBlock& block)
+{
+    boost::unique_lock<boost::shared_mutex> lock(csMasternodes);
+
+    if (mapByOutpoint.empty())
+        return;
+
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    {
+        if (tx.IsCoinBase())
+            continue;
+
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            std::map<int, CMasternode>::iterator it = FindEntry(txin.prevout);
+
+            if (it == mapMasternodes.end() || it->second.nActiveState != CMasternode::MASTERNODE_VIN_SPENT)
+                continue;
+
+            // unspent again, let the expiry check work out whether it is still alive
+            it->second.nActiveState = CMasternode::MASTERNODE_ENABLED;
+            it->second.lastTimeChecked = 0;
+            it->second.Check();
+            nMasternodeListVersion++;
+        }
+    }
 }
 
 void CMasternodeMan::CheckAndRemove()
 {
     LogPrintf("%s : started\n", __func__);
 
+    Check();
+
     {
-        LOCK(cs_masternodes);
+        boost::unique_lock<boost::shared_mutex> lock(csMasternodes);
 
-        Check();
         LogPrintf("%s : remove masternodes\n", __func__);
 
         // remove inactive and outdated
-        vector<CMasternode>::iterator it = vecMasternodes.begin();
+        std::map<int, CMasternode>::iterator it = mapMasternodes.begin();
 
-        while (it != vecMasternodes.end())
+        while (it != mapMasternodes.end())
         {
-            if ((*it).nActiveState == CMasternode::MASTERNODE_REMOVE ||
-                (*it).nActiveState == CMasternode::MASTERNODE_VIN_SPENT)
+            if ((*it).second.nActiveState == CMasternode::MASTERNODE_REMOVE ||
+                (*it).second.nActiveState == CMasternode::MASTERNODE_VIN_SPENT)
             {
                 LogPrintf("%s : removing inactive masternode %s - %s, reason: %d\n", __func__,
-                          (*it).addr.ToString().c_str(), (*it).vin.prevout.hash.ToString(), (*it).nActiveState);
+                          (*it).second.addr.ToString().c_str(), (*it).second.vin.prevout.hash.ToString(),
+                          (*it).second.nActiveState);
 
-                it = vecMasternodes.erase(it);
+                Unindex(it->first, it->second);
+                mapMasternodes.erase(it++);
+                nMasternodeListVersion++;
             }
             else
                 ++it;
@@ -1242,8 +1363,11 @@ void CMasternodeMan::CheckAndRemove()
 
 void CMasternodeMan::Clear()
 {
-    LOCK(cs_masternodes);
-    vecMasternodes.clear();
+    boost::unique_lock<boost::shared_mutex> lock(csMasternodes);
+
+    mapMasternodes.clear();
+    mapByOutpoint.clear();
+    nMasternodeListVersion++;
 }
 
 int CMasternodeMan::CountEnabled(int protocolVersion)
@@ -1251,11 +1375,9 @@ int CMasternodeMan::CountEnabled(int protocolVersion)
     int i = 0;
     protocolVersion = protocolVersion == -1 ? ActiveProtocol() : protocolVersion;
 
-    BOOST_FOREACH (CMasternode& mn, vecMasternodes)
+    BOOST_FOREACH(const CMasternode& mn, GetFullMasternodeVector())
     {
-        mn.Check();
-
-        if (mn.protocolVersion < protocolVersion || !mn.IsEnabled())
+        if (mn.protocolVersion < protocolVersion || mn.nActiveState != CMasternode::MASTERNODE_ENABLED)
             continue;
 
         i++;
@@ -1264,15 +1386,307 @@ int CMasternodeMan::CountEnabled(int protocolVersion)
     return i;
 }
 
-CMasternode* CMasternodeMan::Find(const CTxIn& vin)
+int CMasternodeMan::GetHandle(const CTxIn& vin) const
 {
-    LOCK(cs_masternodes);
+    boost::shared_lock<boost::shared_mutex> lock(csMasternodes);
+    robin_hood::unordered_flat_map<COutPoint, int, COutPointHasher>::const_iterator it = mapByOutpoint.find(vin.prevout);
+
+    return it == mapByOutpoint.end() ? -1 : it->second;
+}
+
+bool CMasternodeMan::Get(int nHandle, CMasternode& mnRet) const
+{
+    boost::shared_lock<boost::shared_mutex> lock(csMasternodes);
+    std::map<int, CMasternode>::const_iterator it = mapMasternodes.find(nHandle);
+
+    if (it == mapMasternodes.end())
+        return false;
+
+    mnRet = it->second;
+    return true;
+}
+
+bool CMasternodeMan::Get(const CTxIn& vin, CMasternode& mnRet) const
+{
+    boost::shared_lock<boost::shared_mutex> lock(csMasternodes);
+    robin_hood::unordered_flat_map<COutPoint, int, COutPointHasher>::const_iterator it = mapByOutpoint.find(vin.prevout);
+
+    if (it == mapByOutpoint.end())
+        return false;
+
+    mnRet = mapMasternodes.find(it->second)->second;
+    return true;
+}
+
+std::vector<std::pair<int, CMasternode> > CMasternodeMan::GetEntries() const
+{
+    boost::shared_lock<boost::shared_mutex> lock(csMasternodes);
+
+    return std::vector<std::pair<int, CMasternode> >(mapMasternodes.begin(), mapMasternodes.end());
+}
+
+std::vector<CMasternode> CMasternodeMan::GetFullMasternodeVector() const
+{
+    boost::shared_lock<boost::shared_mutex> lock(csMasternodes);
+    std::vector<CMasternode> vMasternodes;
+    vMasternodes.reserve(mapMasternodes.size());
+
+    for (std::map<int, CMasternode>::const_iterator it = mapMasternodes.begin(); it != mapMasternodes.end(); ++it)
+        vMasternodes.push_back(it->second);
+
+    return vMasternodes;
+}
+
+int CMasternodeMan::size() const
+{
+    boost::shared_lock<boost::shared_mutex> lock(csMasternodes);
+    return mapMasternodes.size();
+}
+
+static void CheckMasternodes()
+{
+    if (!IsInitialBlockDownload())
+        mnodeman.Check();
+}
+
+static void RemoveMasternodes()
+{
+    if (IsInitialBlockDownload())
+        return;
+
+    mnodeman.CheckAndRemove();
+
+    LOCK(cs_main);
+    masternodePayments.CleanPaymentList();
+}
+
+void ScheduleMasternodeChecks(CScheduler& scheduler)
+{
+    scheduler.scheduleEvery(&CheckMasternodes, MASTERNODE_CHECK_SECONDS);
+    scheduler.scheduleEvery(&RemoveMasternodes, MASTERNODE_REMOVE_CHECK_SECONDS);
+    scheduler.scheduleEvery(&DumpMasternodes, MASTERNODE_CACHE_DUMP_SECONDS);
+}
+
+void DumpMasternodes()
+{
+    int64_t nStart = GetTimeMillis();
+
+    // nothing learned yet, keep what the last run left behind
+    if (mnodeman.size() == 0)
+        return;
+
+    CMasternodeCache cache;
+    cache.nTime = GetTime();
 
-    BOOST_FOREACH (CMasternode& mn, vecMasternodes)
     {
-        if (mn.vin.prevout == vin.prevout)
-            return &mn;
+        LOCK(cs_main);
+
+        if (pindexBest == NULL)
+            return;
+
+        cache.hashBestChain = pindexBest->GetBlockHash();
+    }
+
+    cache.vMasternodes = mnodeman.GetFullMasternodeVector();
+    cache.mapWinners = masternodePayments.GetWinners();
+
+    {
+        LOCK(cs_masternodes);
+
+        // CleanPaymentList does not run during initial download, leave out
+        // the votes for blocks the winners list has already let go of
+        for (map<uint256, CMasternodePaymentWinner>::const_iterator it = mapSeenMasternodeVotes.begin();
+             it != mapSeenMasternodeVotes.end(); ++it)
+        {
+            if (cache.mapWinners.count(it->second.nBlockHeight))
+                cache.mapSeenVotes.insert(*it);
+        }
+    }
+
+    if (!CMasternodeDB().Write(cache))
+        return;
+
+    LogPrintf("%s : flushed %d masternodes and %d payment votes to mncache.dat  %dms\n", __func__,
+              cache.vMasternodes.size(), cache.mapSeenVotes.size(), GetTimeMillis() - nStart);
+}
+
+// Whether the collateral is still unspent on the active chain
+static bool IsCollateralUnspent(CTxDB& txdb, const COutPoint& prevout)
+{
+    CTxIndex txindex;
+
+    if (!txdb.ReadTxIndex(prevout.hash, txindex))
+        return false;
+
+    return prevout.n < txindex.vSpent.size() && txindex.vSpent[prevout.n].IsNull();
+}
+
+bool LoadMasternodes()
+{
+    int64_t nStart = GetTimeMillis();
+    CMasternodeCache cache;
+
+    if (!CMasternodeDB().Read(cache))
+        return false;
+
+    // only take the list as synced if it is recent and was saved on the chain we are on
+    bool fOnChain = false;
+
+    {
+        LOCK(cs_main);
+        robin_hood::unordered_node_map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(cache.hashBestChain);
+        fOnChain = mi != mapBlockIndex.end() && chainActive.Contains(mi->second);
+    }
+
+    bool fRecent = GetTime() - cache.nTime < MASTERNODE_EXPIRATION_SECONDS;
+    int nDropped = 0;
+
+    {
+        CTxDB txdb("r");
+
+        BOOST_FOREACH(const CMasternode& mn, cache.vMasternodes)
+        {
+            if (mn.protocolVersion < ActiveProtocol() || mn.nActiveState == CMasternode::MASTERNODE_VIN_SPENT ||
+                !IsCollateralUnspent(txdb, mn.vin.prevout))
+            {
+                nDropped++;
+                continue;
+            }
+
+            mnodeman.Add(mn);
+        }
+    }
+
+    // states move on with the clock while we were down
+    mnodeman.Check();
+
+    masternodePayments.LoadWinners(cache.mapWinners);
+
+    {
+        LOCK(cs_masternodes);
+        mapSeenMasternodeVotes.insert(cache.mapSeenVotes.begin(), cache.mapSeenVotes.end());
     }
 
-    return nullptr;
+    int nEnabled = mnodeman.CountEnabled();
+
+    LogPrintf("%s : loaded %d masternodes (%d dropped, %d enabled) and %d payment votes from mncache.dat, "
+              "saved %ds ago%s  %dms\n", __func__, cache.vMasternodes.size() - nDropped, nDropped, nEnabled,
+              cache.mapSeenVotes.size(), GetTime() - cache.nTime, fOnChain ? "" : " on another chain",
+              GetTimeMillis() - nStart);
+
+    // the same bar the dseg sync has to clear
+    return fOnChain && fRecent && nEnabled > 3;
+}
+
+CMasternodeDB::CMasternodeDB()
+{
+    pathMN = GetDataDir() / "mncache.dat";
+}
+
+bool CMasternodeDB::Write(const CMasternodeCache& cache)
+{
+    // Generate random temporary filename
+    unsigned short randv = 0;
+    GetRandBytes((unsigned char*)&randv, sizeof(randv));
+    std::string tmpfn = strprintf("mncache.dat.%04x", randv);
+
+    // Serialize the cache, checksum data up to that point, then append csum
+    CDataStream ssCache(SER_DISK, CLIENT_VERSION);
+    ssCache << FLATDATA(pchMessageStart);
+    ssCache << cache;
+    uint256 hash = Hash(ssCache.begin(), ssCache.end());
+    ssCache << hash;
+
+    // Open temp output file, and associate with CAutoFile
+    boost::filesystem::path pathTmp = GetDataDir() / tmpfn;
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+
+    if (fileout.IsNull())
+        return error("%s : failed to open file %s", __func__, pathTmp.string());
+
+    // Write and commit header, data
+    try
+    {
+        fileout << ssCache;
+    }
+    catch (const std::exception& e)
+    {
+        return error("%s : serialize or I/O error - %s", __func__, e.what());
+    }
+
+    FileCommit(fileout.Get());
+    fileout.fclose();
+
+    // Replace existing mncache.dat, if any, with new mncache.dat.XXXX
+    if (!RenameOver(pathTmp, pathMN))
+        return error("%s : rename-into-place failed", __func__);
+
+    return true;
+}
+
+bool CMasternodeDB::Read(CMasternodeCache& cache)
+{
+    // a first start has nothing to read
+    if (!boost::filesystem::exists(pathMN))
+        return false;
+
+    // Open input file, and associate with CAutoFile
+    FILE *file = fopen(pathMN.string().c_str(), "rb");
+    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
+
+    if (filein.IsNull())
+        return error("%s : failed to open file %s", __func__, pathMN.string());
+
+    // Use file size to size memory buffer
+    uint64_t fileSize = boost::filesystem::file_size(pathMN);
+    uint64_t dataSize = 0;
+
+    // Don't try to resize to a negative number if file is small
+    if (fileSize >= sizeof(uint256))
+        dataSize = fileSize - sizeof(uint256);
+
+    std::vector<unsigned char> vchData;
+    vchData.resize(dataSize);
+    uint256 hashIn;
+
+    try
+    {
+        filein.read((char *)&vchData[0], dataSize);
+        filein >> hashIn;
+    }
+    catch (const std::exception& e)
+    {
+        return error("%s : deserialize or I/O error - %s", __func__, e.what());
+    }
+
+    filein.fclose();
+    CDataStream ssCache(vchData, SER_DISK, CLIENT_VERSION);
+
+    // Verify stored checksum matches input data
+    uint256 hashTmp = Hash(ssCache.begin(), ssCache.end());
+
+    if (hashIn != hashTmp)
+        return error("%s : checksum mismatch, data corrupted", __func__);
+
+    unsigned char pchMsgTmp[4];
+
+    try
+    {
+        // De-serialize file header (network specific magic number) and ..
+        ssCache >> FLATDATA(pchMsgTmp);
+
+        // ...verify the network matches ours
+        if (memcmp(pchMsgTmp, pchMessageStart, sizeof(pchMsgTmp)))
+            return error("%s : invalid network magic number", __func__);
+
+        // De-serialize the cache, an unknown version throws
+        ssCache >> cache;
+    }
+    catch (const std::exception& e)
+    {
+        return error("%s : deserialize or I/O error - %s", __func__, e.what());
+    }
+
+    return true;
 }
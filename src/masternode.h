@@ -21,8 +21,12 @@
 #include "timedata.h"
 #include "script.h"
 #include "spork.h"
+#include "txmempool.h"
 
+#include <boost/filesystem/path.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <atomic>
 #include <map>
 #include <vector>
 
@@ -48,6 +52,9 @@ class uint256;
 #define MASTERNODE_EXPIRATION_SECONDS          (120*60)
 #define MASTERNODE_REMOVAL_SECONDS             (130*60)
 #define MASTERNODE_CHECK_SECONDS               5
+#define MASTERNODE_REMOVE_CHECK_SECONDS        60
+#define MASTERNODE_CACHE_DUMP_SECONDS          (15*60)
+#define MASTERNODE_CACHE_VERSION               1
 #define MASTERNODE_DSEG_SECONDS                (5*60) // 5 minutes
 
 #define MASTERNODE_BLOCK_OFFSET                50
@@ -55,17 +62,26 @@ class uint256;
 using namespace std;
 
 class CMasternodePaymentWinner;
+class CScheduler;
 
+// protects the masternode payments and the cached rankings, taken before the registry lock
 extern CCriticalSection cs_masternodes;
-extern std::vector<CMasternode> vecMasternodes;
 extern CMasternodePayments masternodePayments;
 extern CMasternodeMan mnodeman;
 extern std::vector<CTxIn> vecMasternodeAskedFor;
 extern map<uint256, CMasternodePaymentWinner> mapSeenMasternodeVotes;
 extern map<int64_t, uint256> mapCacheBlockHashes;
+/** Bumped whenever a masternode is added, removed or changes state or protocol; invalidates the cached rankings */
+extern std::atomic<unsigned int> nMasternodeListVersion;
 
 // manage the masternode connections
 void ProcessMasternodeConnections();
+// run the expiry checks, clean up and cache dumps on the scheduler thread
+void ScheduleMasternodeChecks(CScheduler& scheduler);
+// write the masternode list and payment votes to mncache.dat
+void DumpMasternodes();
+// read mncache.dat back, returns whether the list is good enough to count as synced
+bool LoadMasternodes();
 int CountMasternodesAboveProtocol(int protocolVersion);
 
 
@@ -80,6 +96,8 @@ class CMasternode
 private:
     int64_t lastTimeChecked;
 
+    friend class CMasternodeMan;
+
 public:
     enum state {
         MASTERNODE_ENABLED = 1,
@@ -106,6 +124,21 @@ public:
 
     int64_t nLastDsq; //the dsq count from the last dsq broadcast of this node
 
+    CMasternode()
+    {
+        nActiveState = MASTERNODE_ENABLED;
+        lastTimeSeen = 0;
+        now = 0;
+        unitTest = false;
+        cacheInputAge = 0;
+        cacheInputAgeBlock = 0;
+        nLastDsq = 0;
+        lastDseep = 0;
+        allowFreeTx = true;
+        protocolVersion = 0;
+        lastTimeChecked = 0;
+    }
+
     CMasternode(CService newAddr, CTxIn newVin, CPubKey newPubkey, std::vector<unsigned char> newSig, int64_t newNow, CPubKey newPubkey2, int protocolVersionIn)
     {
         addr = newAddr;
@@ -128,6 +161,25 @@ public:
 
     uint256 CalculateScore(unsigned int nBlockHeight);
 
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        unsigned int nSerSize = 0;
+        READWRITE(vin);
+        READWRITE(addr);
+        READWRITE(pubkey);
+        READWRITE(pubkey2);
+        READWRITE(sig);
+        READWRITE(now);
+        READWRITE(lastTimeSeen);
+        READWRITE(lastDseep);
+        READWRITE(nActiveState);
+        READWRITE(protocolVersion);
+        READWRITE(nLastDsq);
+    }
+
     void UpdateLastSeen(int64_t override=0)
     {
         if(override == 0){
@@ -285,37 +337,147 @@ public:
     void CleanPaymentList();
     int LastPayment(CMasternode& mn);
 
+    // for the masternode cache
+    std::map<int, CMasternodePaymentWinner> GetWinners();
+    void LoadWinners(const std::map<int, CMasternodePaymentWinner>& mapWinners);
+
     //slow
     bool GetBlockPayee(int nBlockHeight, CScript& payee);
 };
 
 
+/** The masternode list, indexed by collateral outpoint.
+ *  Entries are named by handles that stay valid for the life of the entry and are never reused.
+ *  Lookups hand out copies under a shared lock so readers never wait on each other, and changes
+ *  hold the lock exclusively without calling out of the registry.
+ */
 class CMasternodeMan
 {
 private:
     // critical section to protect the inner data structures
     mutable CCriticalSection cs;
 
+    // guards the entries and their indexes
+    mutable boost::shared_mutex csMasternodes;
+
+    // by handle, handles only grow so this is the order the entries arrived in
+    std::map<int, CMasternode> mapMasternodes;
+    robin_hood::unordered_flat_map<COutPoint, int, COutPointHasher> mapByOutpoint;
+    int nNextHandle;
+
+    // require csMasternodes held exclusively
+    void Index(int nHandle, const CMasternode& mn);
+    void Unindex(int nHandle, const CMasternode& mn);
+    std::map<int, CMasternode>::iterator FindEntry(const COutPoint& outpoint);
+
 public:
+    CMasternodeMan() : nNextHandle(0) {}
+
+    /// Add an entry, returns its handle or -1 if the collateral is already listed
+    int Add(const CMasternode& mn);
+
     /// Ask (source) node for mnb
     void AskForMN(CNode* pnode, CTxIn& vin);
 
-    /// Check all Masternodes
+    /// Check all Masternodes, in place under the exclusive lock
     void Check();
 
+    /// Check a single Masternode
+    bool Check(const CTxIn& vin);
+
     /// Check all Masternodes and remove inactive
     void CheckAndRemove();
 
+    /// Mark the masternodes whose collateral a block spends, or unspends when it is disconnected
+    void BlockConnected(const CBlock& block);
+    void BlockDisconnected(const CBlock& block);
+
     /// Clear Masternode vector
     void Clear();
 
     int CountEnabled(int protocolVersion = -1);
 
-    /// Find an entry
-    CMasternode* Find(const CTxIn& vin);
+    /// Handle of an entry, -1 if there is none
+    int GetHandle(const CTxIn& vin) const;
+
+    /// Copy of an entry
+    bool Get(int nHandle, CMasternode& mnRet) const;
+    bool Get(const CTxIn& vin, CMasternode& mnRet) const;
+
+    /// Copy of the whole list with the handles, in order of arrival
+    std::vector<std::pair<int, CMasternode> > GetEntries() const;
+    std::vector<CMasternode> GetFullMasternodeVector() const;
+
+    /// Change an entry in place, func must not hold on to it or call back into the registry
+    template <typename Callable>
+    bool Update(const CTxIn& vin, Callable func)
+    {
+        boost::unique_lock<boost::shared_mutex> lock(csMasternodes);
+        std::map<int, CMasternode>::iterator it = FindEntry(vin.prevout);
+
+        if (it == mapMasternodes.end())
+            return false;
+
+        CMasternode& mn = it->second;
+        int nPrevState = mn.nActiveState;
+        int nPrevProtocol = mn.protocolVersion;
+
+        Unindex(it->first, mn);
+        func(mn);
+        Index(it->first, mn);
+
+        if (mn.nActiveState != nPrevState || mn.protocolVersion != nPrevProtocol)
+            nMasternodeListVersion++;
+
+        return true;
+    }
 
     /// Return the number of (unique) Masternodes
-    int size() { return vecMasternodes.size(); }
+    int size() const;
+};
+
+/** What mncache.dat holds: the masternode list and payment votes as of a chain tip */
+class CMasternodeCache
+{
+public:
+    int nCacheVersion;
+    int64_t nTime;
+    uint256 hashBestChain;
+    std::vector<CMasternode> vMasternodes;
+    std::map<int, CMasternodePaymentWinner> mapWinners;
+    std::map<uint256, CMasternodePaymentWinner> mapSeenVotes;
+
+    CMasternodeCache() : nCacheVersion(MASTERNODE_CACHE_VERSION), nTime(0), hashBestChain(0) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        unsigned int nSerSize = 0;
+        READWRITE(nCacheVersion);
+
+        // a newer layout is not ours to read
+        if (nCacheVersion != MASTERNODE_CACHE_VERSION)
+            throw std::ios_base::failure("unknown masternode cache version");
+
+        READWRITE(nTime);
+        READWRITE(hashBestChain);
+        READWRITE(vMasternodes);
+        READWRITE(mapWinners);
+        READWRITE(mapSeenVotes);
+    }
+};
+
+/** Access to the masternode cache (mncache.dat) */
+class CMasternodeDB
+{
+private:
+    boost::filesystem::path pathMN;
+public:
+    CMasternodeDB();
+    bool Write(const CMasternodeCache& cache);
+    bool Read(CMasternodeCache& cache);
 };
 
 #endif
@@ -61,12 +61,12 @@ void SHA256Transform(void* pstate, void* pinput, const void* pinit)
 class COrphan
 {
 public:
-    CTransaction* ptx;
+    const CTransaction* ptx;
     set<uint256> setDependsOn;
     double dPriority;
     double dFeePerKb;
 
-    COrphan(CTransaction* ptxIn)
+    COrphan(const CTransaction* ptxIn)
     {
         ptx = ptxIn;
         dPriority = dFeePerKb = 0;
@@ -88,7 +88,7 @@ uint64_t nLastBlockSize = 0;
 int64_t nLastCoinStakeSearchInterval = 0;
 
 // We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, CTransaction*> TxPriority;
+typedef boost::tuple<double, double, const CTransaction*> TxPriority;
 class TxPriorityCompare
 {
     bool byFee;
@@ -115,6 +115,293 @@ public:
     }
 };
 
+// Transactions collected for the last block template. The next template on
+// the same parent only has to look at transactions that reached the memory
+// pool since, as long as none left it. Protected by cs_main.
+class CBlockTemplateCache
+{
+public:
+    CBlockIndex* pindexPrev;
+    uint64_t nPoolSequence;
+    unsigned int nPoolRemovalsUpdated;
+    int64_t nTimeCreated;
+
+    unsigned int nBlockMaxSize;
+    unsigned int nBlockPrioritySize;
+    unsigned int nBlockMinSize;
+    int64_t nMinTxFee;
+
+    std::vector<CTransaction> vtx;
+    std::set<uint256> setIncluded;
+    map<uint256, CTxIndex> mapTestPool;
+    uint64_t nBlockSize;
+    uint64_t nBlockTx;
+    int nBlockSigOps;
+    int64_t nFees;
+    int64_t nMaxTxTime;
+    bool fSortedByFee;
+
+    CBlockTemplateCache()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        pindexPrev = NULL;
+        nPoolSequence = 0;
+        nPoolRemovalsUpdated = 0;
+        nTimeCreated = 0;
+        nBlockMaxSize = nBlockPrioritySize = nBlockMinSize = 0;
+        nMinTxFee = 0;
+        vtx.clear();
+        setIncluded.clear();
+        mapTestPool.clear();
+        nBlockSize = 1000;
+        nBlockTx = 0;
+        nBlockSigOps = 100;
+        nFees = 0;
+        nMaxTxTime = 0;
+        fSortedByFee = false;
+    }
+};
+
+// One for proof-of-work and one for proof-of-stake templates
+static CBlockTemplateCache blocktemplatecache[2];
+
+// Templates are assembled from scratch at least this often, so that
+// transactions skipped for their time or finality get another chance
+static const int64_t BLOCK_TEMPLATE_REUSE_TIME = 60;
+
+// Try to add one transaction to the template
+static bool AddToBlockTemplate(CTxDB& txdb, CBlockTemplateCache& tmpl, CBlockIndex* pindexPrev,
+                               const CTransaction& txCoinBase, bool fProofOfStake,
+                               double dPriority, double dFeePerKb, const CTransaction& tx, unsigned int nTxSize)
+{
+    // Size limits
+    if (tmpl.nBlockSize + nTxSize >= tmpl.nBlockMaxSize)
+        return false;
+
+    // Legacy limits on sigOps:
+    unsigned int nTxSigOps = tx.GetLegacySigOpCount();
+    if (tmpl.nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+        return false;
+
+    // Timestamp limit
+    if (tx.nTime > GetAdjustedTime() || (fProofOfStake && tx.nTime > txCoinBase.nTime))
+        return false;
+
+    // Transaction fee
+    int64_t nMinFee = tx.GetMinFee(tmpl.nBlockSize, GMF_BLOCK);
+
+    // Skip free transactions if we're past the minimum block size:
+    if (tmpl.fSortedByFee && (dFeePerKb < tmpl.nMinTxFee) && (tmpl.nBlockSize + nTxSize >= tmpl.nBlockMinSize))
+        return false;
+
+    // Prioritize by fee once past the priority size or we run out of high-priority
+    // transactions:
+    if (!tmpl.fSortedByFee &&
+        ((tmpl.nBlockSize + nTxSize >= tmpl.nBlockPrioritySize) || (dPriority < COIN * 144 / 250)))
+    {
+        tmpl.fSortedByFee = true;
+    }
+
+    // Connecting shouldn't fail due to dependency on other memory pool transactions
+    // because we're already processing them in order of dependency
+    map<uint256, CTxIndex> mapTestPoolTmp(tmpl.mapTestPool);
+    MapPrevTx mapInputs;
+    bool fInvalid;
+
+    if (!tx.FetchInputs(txdb, mapTestPoolTmp, false, true, mapInputs, fInvalid))
+        return false;
+
+    int64_t nTxFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
+
+    if (nTxFees < nMinFee)
+        return false;
+
+    nTxSigOps += tx.GetP2SHSigOpCount(mapInputs);
+
+    if (tmpl.nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+        return false;
+
+    if (!tx.ConnectInputs(txdb, mapInputs, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, false, true))
+        return false;
+
+    uint256 hash = tx.GetHash();
+    mapTestPoolTmp[hash] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
+    swap(tmpl.mapTestPool, mapTestPoolTmp);
+
+    // Added
+    tmpl.vtx.push_back(tx);
+    tmpl.setIncluded.insert(hash);
+    tmpl.nBlockSize += nTxSize;
+    ++tmpl.nBlockTx;
+    tmpl.nBlockSigOps += nTxSigOps;
+    tmpl.nFees += nTxFees;
+    tmpl.nMaxTxTime = max(tmpl.nMaxTxTime, (int64_t)tx.nTime);
+
+    if (fDebug && GetBoolArg("-printpriority"))
+    {
+        LogPrintf("%s : priority %.1f feeperkb %.1f txid %s\n", __func__,
+               dPriority, dFeePerKb, hash.ToString().c_str());
+    }
+
+    return true;
+}
+
+// Add the memory pool transactions numbered above nSequenceFrom to the
+// template: by priority until the priority area is full, then by fee rate.
+// Their input values, priorities and fee rates were cached by the pool, so
+// only the transactions that go into the block have their inputs read.
+static void AddPoolTransactions(CTxDB& txdb, CBlockTemplateCache& tmpl, CBlockIndex* pindexPrev,
+                                const CTransaction& txCoinBase, bool fProofOfStake, uint64_t nSequenceFrom)
+{
+    list<COrphan> vOrphan; // list memory doesn't move
+    map<uint256, vector<COrphan*> > mapDependers;
+    map<const CTransaction*, COrphan*> mapOrphans;
+
+    // Candidates in the order of the pool's fee rate index, and those ready
+    // to go, which will be sorted into a priority queue
+    vector<TxPriority> vecFeeRate;
+    vector<TxPriority> vecPriority;
+
+    BOOST_FOREACH(const CTxFeeRateKey& key, mempool.setByFeeRate)
+    {
+        const CTxMemPoolEntry* pentry = mempool.GetEntry(key.second);
+
+        if (!pentry || pentry->nSequence <= nSequenceFrom)
+            continue;
+
+        const CTransaction& tx = *pentry->tx;
+
+        if (tx.IsCoinBase() || tx.IsCoinStake() || !tx.IsFinal())
+            continue;
+
+        TxPriority item(pentry->GetPriority(pindexPrev->nHeight), pentry->dFeePerKb, &tx);
+        COrphan* porphan = NULL;
+
+        // Has to wait for dependencies still in the pool and not in the block yet
+        BOOST_FOREACH(const uint256& hashParent, pentry->setDependsOn)
+        {
+            if (!mempool.mapTx.count(hashParent) || tmpl.setIncluded.count(hashParent))
+                continue;
+
+            if (!porphan)
+            {
+                vOrphan.push_back(COrphan(&tx));
+                porphan = &vOrphan.back();
+                porphan->dPriority = item.get<0>();
+                porphan->dFeePerKb = item.get<1>();
+                mapOrphans[&tx] = porphan;
+            }
+
+            mapDependers[hashParent].push_back(porphan);
+            porphan->setDependsOn.insert(hashParent);
+        }
+
+        vecFeeRate.push_back(item);
+
+        if (!porphan)
+            vecPriority.push_back(item);
+    }
+
+    set<const CTransaction*> setDone;
+    vector<TxPriority> vecReleased;
+    TxPriorityCompare comparer(true);
+
+    // Priority area first, unless an earlier pass already filled it
+    if (!tmpl.fSortedByFee && tmpl.nBlockPrioritySize > 0)
+    {
+        TxPriorityCompare comparerPriority(false);
+        std::make_heap(vecPriority.begin(), vecPriority.end(), comparerPriority);
+
+        while (!vecPriority.empty() && !tmpl.fSortedByFee)
+        {
+            // Take highest priority transaction off the priority queue:
+            TxPriority item = vecPriority.front();
+            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparerPriority);
+            vecPriority.pop_back();
+
+            const CTransaction& tx = *item.get<2>();
+            setDone.insert(&tx);
+
+            if (!AddToBlockTemplate(txdb, tmpl, pindexPrev, txCoinBase, fProofOfStake, item.get<0>(), item.get<1>(),
+                                    tx, mempool.GetEntry(tx.GetHash())->nTxSize))
+                continue;
+
+            // Add transactions that depend on this one to the priority queue
+            map<uint256, vector<COrphan*> >::iterator mi = mapDependers.find(tx.GetHash());
+
+            if (mi == mapDependers.end())
+                continue;
+
+            BOOST_FOREACH(COrphan* porphan, mi->second)
+            {
+                porphan->setDependsOn.erase(mi->first);
+
+                if (porphan->setDependsOn.empty() && !tmpl.fSortedByFee)
+                {
+                    vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
+                    std::push_heap(vecPriority.begin(), vecPriority.end(), comparerPriority);
+                }
+            }
+        }
+    }
+
+    tmpl.fSortedByFee = true;
+
+    // Then walk the fee rate index. Transactions whose last dependency goes
+    // into the block are queued, as they may pay more than those still ahead.
+    vector<TxPriority>::const_iterator it = vecFeeRate.begin();
+
+    while (it != vecFeeRate.end() || !vecReleased.empty())
+    {
+        TxPriority item;
+
+        if (!vecReleased.empty() && (it == vecFeeRate.end() || !comparer(vecReleased.front(), *it)))
+        {
+            item = vecReleased.front();
+            std::pop_heap(vecReleased.begin(), vecReleased.end(), comparer);
+            vecReleased.pop_back();
+        }
+        else
+            item = *it++;
+
+        const CTransaction& tx = *item.get<2>();
+
+        if (setDone.count(&tx))
+            continue;
+
+        map<const CTransaction*, COrphan*>::const_iterator mo = mapOrphans.find(&tx);
+
+        if (mo != mapOrphans.end() && !mo->second->setDependsOn.empty())
+            continue;
+
+        setDone.insert(&tx);
+
+        if (!AddToBlockTemplate(txdb, tmpl, pindexPrev, txCoinBase, fProofOfStake, item.get<0>(), item.get<1>(),
+                                tx, mempool.GetEntry(tx.GetHash())->nTxSize))
+            continue;
+
+        map<uint256, vector<COrphan*> >::iterator mi = mapDependers.find(tx.GetHash());
+
+        if (mi == mapDependers.end())
+            continue;
+
+        BOOST_FOREACH(COrphan* porphan, mi->second)
+        {
+            porphan->setDependsOn.erase(mi->first);
+
+            if (porphan->setDependsOn.empty())
+            {
+                vecReleased.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
+                std::push_heap(vecReleased.begin(), vecReleased.end(), comparer);
+            }
+        }
+    }
+}
+
 // create new block (without proof-of-work/proof-of-stake)
 CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake, int64_t* pFees)
 {
@@ -147,6 +434,11 @@ CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake, int64_t* pFees)
         txNew.vin[0].scriptSig = (CScript() << pindexPrev->nHeight + 1) + COINBASE_FLAGS;
         assert(txNew.vin[0].scriptSig.size() <= 100);
         txNew.vout[0].SetEmpty();
+
+        // The block will take the coinstake's time, which SignBlock masks
+        // the same way, so check the transactions against that
+        if (GetPOSProtocolVersion(pindexPrev->nHeight + 1) == 2)
+            txNew.nTime &= ~STAKE_TIMESTAMP_MASK;
     }
 
     // Add our coinbase tx as first transaction
@@ -187,209 +479,47 @@ CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake, int64_t* pFees)
         LOCK2(cs_main, mempool.cs);
         CTxDB txdb("r");
 
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
+        CBlockTemplateCache& tmpl = blocktemplatecache[fProofOfStake ? 1 : 0];
+        uint64_t nSequenceFrom = tmpl.nPoolSequence;
 
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
+        // Start over unless transactions were only added to the pool since
+        // the last template on this block, and all of those already in it
+        // are still within the time limit of this one
+        int64_t nTimeLimit = fProofOfStake ? (int64_t)pblock->vtx[0].nTime : GetAdjustedTime();
+        bool fNew = (tmpl.pindexPrev != pindexPrev || tmpl.nPoolRemovalsUpdated != mempool.nRemovalsUpdated ||
+            GetAdjustedTime() - tmpl.nTimeCreated > BLOCK_TEMPLATE_REUSE_TIME || tmpl.nMaxTxTime > nTimeLimit ||
+            tmpl.nBlockMaxSize != nBlockMaxSize || tmpl.nBlockPrioritySize != nBlockPrioritySize ||
+            tmpl.nBlockMinSize != nBlockMinSize || tmpl.nMinTxFee != nMinTxFee);
 
-        for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+        if (fNew)
         {
-            CTransaction& tx = (*mi).second;
-
-            if (tx.IsCoinBase() || tx.IsCoinStake() || !tx.IsFinal())
-                continue;
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            int64_t nTotalIn = 0;
-            bool fMissingInputs = false;
-
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-                // Read prev transaction
-                CTransaction txPrev;
-                CTxIndex txindex;
-
-                if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        LogPrintf("%s : [ERROR] mempool transaction missing input\n", __func__);
-
-                        if (fDebug)
-                            assert("mempool transaction missing input" == 0);
-
-                        fMissingInputs = true;
-
-                        if (porphan)
-                            vOrphan.pop_back();
-
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
-                    continue;
-                }
-
-                int64_t nValueIn = txPrev.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = txindex.GetDepthInMainChain();
-                dPriority += (double)nValueIn * nConf;
-            }
-
-            if (fMissingInputs)
-                continue;
-
-            // Priority is sum(valuein * age) / txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority /= nTxSize;
-
-            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-            // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize) / 1000.0);
-
-            if (porphan)
-            {
-                porphan->dPriority = dPriority;
-                porphan->dFeePerKb = dFeePerKb;
-            }
-            else
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi).second));
+            tmpl.SetNull();
+            tmpl.pindexPrev = pindexPrev;
+            tmpl.nPoolRemovalsUpdated = mempool.nRemovalsUpdated;
+            tmpl.nTimeCreated = GetAdjustedTime();
+            tmpl.nBlockMaxSize = nBlockMaxSize;
+            tmpl.nBlockPrioritySize = nBlockPrioritySize;
+            tmpl.nBlockMinSize = nBlockMinSize;
+            tmpl.nMinTxFee = nMinTxFee;
+            nSequenceFrom = 0;
         }
 
-        // Collect transactions into block
-        map<uint256, CTxIndex> mapTestPool;
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty())
+        if (fNew || tmpl.nPoolSequence != mempool.nSequence)
         {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            double dFeePerKb = vecPriority.front().get<1>();
-            CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = tx.GetLegacySigOpCount();
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Timestamp limit
-            if (tx.nTime > GetAdjustedTime() || (fProofOfStake && tx.nTime > pblock->vtx[0].nTime))
-                continue;
-
-            // Transaction fee
-            int64_t nMinFee = tx.GetMinFee(nBlockSize, GMF_BLOCK);
-
-            // Skip free transactions if we're past the minimum block size:
-            if (fSortedByFee && (dFeePerKb < nMinTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
-
-            // Prioritize by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || (dPriority < COIN * 144 / 250)))
-            {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
-
-            // Connecting shouldn't fail due to dependency on other memory pool transactions
-            // because we're already processing them in order of dependency
-            map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
-            MapPrevTx mapInputs;
-            bool fInvalid;
-
-            if (!tx.FetchInputs(txdb, mapTestPoolTmp, false, true, mapInputs, fInvalid))
-                continue;
-
-            int64_t nTxFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
-
-            if (nTxFees < nMinFee)
-                continue;
-
-            nTxSigOps += tx.GetP2SHSigOpCount(mapInputs);
-
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            if (!tx.ConnectInputs(txdb, mapInputs, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, false, true))
-                continue;
-
-            mapTestPoolTmp[tx.GetHash()] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
-            swap(mapTestPool, mapTestPoolTmp);
-
-            // Added
-            pblock->vtx.push_back(tx);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            if (fDebug && GetBoolArg("-printpriority"))
-            {
-                LogPrintf("%s : priority %.1f feeperkb %.1f txid %s\n", __func__,
-                       dPriority, dFeePerKb, tx.GetHash().ToString().c_str());
-            }
-
-            // Add transactions that depend on this one to the priority queue
-            uint256 hash = tx.GetHash();
+            AddPoolTransactions(txdb, tmpl, pindexPrev, pblock->vtx[0], fProofOfStake, nSequenceFrom);
+            tmpl.nPoolSequence = mempool.nSequence;
+        }
 
-            if (mapDependers.count(hash))
-            {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-                {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
+        LogPrint("miner", "%s : %s template, %u txs\n", __func__, fNew ? "new" : "extended", tmpl.nBlockTx);
 
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
-        }
+        pblock->vtx.insert(pblock->vtx.end(), tmpl.vtx.begin(), tmpl.vtx.end());
+        nFees = tmpl.nFees;
 
-        nLastBlockTx = nBlockTx;
-        nLastBlockSize = nBlockSize;
+        nLastBlockTx = tmpl.nBlockTx;
+        nLastBlockSize = tmpl.nBlockSize;
 
         if (fDebug && GetBoolArg("-printpriority"))
-            LogPrintf("%s : total size %u\n", __func__, nBlockSize);
+            LogPrintf("%s : total size %u\n", __func__, tmpl.nBlockSize);
 
         if (!fProofOfStake)
             pblock->vtx[0].vout[0].nValue = GetProofOfWorkReward(nFees, pindexPrev->nHeight + 1);
@@ -31,6 +31,10 @@
 #include <miniupnpc/upnperrors.h>
 #endif
 
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 //#include <curl/curl.h>
 //#include <regex>
 
@@ -39,7 +43,6 @@
 // Dump addresses to peers.dat and banlist.dat every 15 minutes (900s)
 #define DUMP_ADDRESSES_INTERVAL 900
 
-void ThreadMessageHandler2(void* parg);
 #ifdef USE_UPNP
 void ThreadMapPort2(void* parg);
 #endif
@@ -81,8 +84,6 @@ CCriticalSection cs_setservAddNodeAddresses;
 NodeId nLastNodeId = 0;
 CCriticalSection cs_nLastNodeId;
 
-boost::condition_variable messageHandlerCondition;
-
 void CConnman::AddOneShot(const std::string& strDest)
 {
     LOCK(cs_vOneShots);
@@ -443,7 +444,7 @@ CNode* CConnman::ConnectNode(CAddress addrConnect, const char *pszDest, bool dar
     if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, GetDefaultPort(), nConnectTimeout, &proxyConnectionFailed) :
                   ConnectSocket(addrConnect, hSocket, nConnectTimeout, &proxyConnectionFailed))
     {
-        if (!IsSelectableSocket(hSocket))
+        if (socketEventsMode == SOCKETEVENTS_SELECT && !IsSelectableSocket(hSocket))
         {
             LogPrintf("%s : cannot create connection, non-selectable socket created\n", __func__);
             CloseSocket(hSocket);
@@ -457,6 +458,7 @@ CNode* CConnman::ConnectNode(CAddress addrConnect, const char *pszDest, bool dar
 
         pnode->AddRef();
         pnode->nTimeConnected = GetTime();
+        RegisterSocketEvents(pnode);
 
         LOCK(cs_vNodes);
         vNodes.push_back(pnode);
@@ -494,6 +496,17 @@ void CConnman::DumpBanlist()
               __func__, banmap.size(), GetTimeMillis() - nStart);
 }
 
+void CNode::UnregisterSocketEvents()
+{
+#ifdef USE_EPOLL
+    if (hPollFd != -1)
+    {
+        epoll_ctl(hPollFd, EPOLL_CTL_DEL, hSocket, NULL);
+        hPollFd = -1;
+    }
+#endif
+}
+
 void CNode::CloseSocketDisconnect()
 {
     fDisconnect = true;
@@ -501,6 +514,7 @@ void CNode::CloseSocketDisconnect()
     if (hSocket != INVALID_SOCKET)
     {
         LogPrintf("%s : disconnecting node %s\n", __func__, addrName.c_str());
+        UnregisterSocketEvents();
         CloseSocket(hSocket);
         hSocket = INVALID_SOCKET;
 
@@ -823,10 +837,7 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
         nBytes -= handled;
 
         if (msg.complete())
-        {
             msg.nTime = GetTimeMicros();
-            messageHandlerCondition.notify_one();
-        }
     }
 
     return true;
@@ -935,6 +946,119 @@ void SocketSendData(CNode *pnode)
     pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
 }
 
+const char* GetSocketEventsModeName(SocketEventsMode mode)
+{
+    return mode == SOCKETEVENTS_EPOLL ? "epoll" : "select";
+}
+
+bool ParseSocketEventsMode(const std::string& strMode, SocketEventsMode& modeRet)
+{
+    if (strMode == "select")
+        modeRet = SOCKETEVENTS_SELECT;
+#ifdef USE_EPOLL
+    else if (strMode == "epoll")
+        modeRet = SOCKETEVENTS_EPOLL;
+#endif
+    else
+        return false;
+
+    return true;
+}
+
+// Sockets stay registered until CNode::UnregisterSocketEvents, so there is no per-iteration setup
+void CConnman::RegisterSocketEvents(CNode* pnode)
+{
+#ifdef USE_EPOLL
+    if (socketEventsMode != SOCKETEVENTS_EPOLL || pnode->hSocket == INVALID_SOCKET)
+        return;
+
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = pnode;
+
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, pnode->hSocket, &event) == 0)
+        pnode->hPollFd = hEpoll;
+    else
+    {
+        LogPrintf("%s : epoll_ctl failed for %s: %d\n", __func__, pnode->addrName.c_str(), errno);
+        pnode->CloseSocketDisconnect();
+    }
+#endif
+}
+
+// Wait for readiness and record it on the nodes; returns whether a listening socket can accept.
+// The caller only runs this in epoll mode.
+bool CConnman::WaitForSocketEvents(int nTimeoutMs)
+{
+#ifdef USE_EPOLL
+    {
+        LOCK(cs_vNodes);
+
+        // Readiness left over from an earlier wakeup will not be reported again, so don't sleep on it
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+
+            // a node busy queueing messages is picked up on the next round, as select skips it too
+            TRY_LOCK(pnode->cs_vSend, lockSend);
+
+            if (!lockSend)
+                continue;
+
+            bool fSendPending = !pnode->vSendMsg.empty();
+
+            if ((pnode->fSocketReadable && !fSendPending) || (pnode->fSocketWritable && fSendPending))
+            {
+                nTimeoutMs = 0;
+                break;
+            }
+        }
+    }
+
+    struct epoll_event events[MAX_SOCKET_EVENTS];
+
+    vnThreadsRunning[THREAD_SOCKETHANDLER]--;
+    int nEvents = epoll_wait(hEpoll, events, MAX_SOCKET_EVENTS, nTimeoutMs);
+    vnThreadsRunning[THREAD_SOCKETHANDLER]++;
+
+    if (nEvents < 0)
+    {
+        if (errno != EINTR)
+        {
+            LogPrintf("%s : epoll_wait error %d\n", __func__, errno);
+            MilliSleep(nTimeoutMs);
+        }
+
+        return false;
+    }
+
+    bool fListenReady = false;
+
+    // Nodes are only deleted by this thread, so every pointer handed back here is still alive
+    for (int i = 0; i < nEvents; i++)
+    {
+        CNode* pnode = (CNode*)events[i].data.ptr;
+
+        if (pnode == NULL)
+        {
+            fListenReady = true;
+            continue;
+        }
+
+        if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            pnode->fSocketReadable = true;
+
+        if (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+            pnode->fSocketWritable = true;
+    }
+
+    return fListenReady;
+#else
+    return false;
+#endif
+}
+
 void CConnman::ThreadSocketHandler()
 {
     // Make this thread recognisable as the networking thread
@@ -969,6 +1093,8 @@ void CConnman::ThreadSocketHandler2()
     while (true)
     {
         // Disconnect nodes
+        vector<NodeId> vNodesDeleted;
+
         {
             LOCK(cs_vNodes);
             vector<CNode*> vNodesCopy = vNodes;
@@ -1030,12 +1156,17 @@ void CConnman::ThreadSocketHandler2()
                     if (fDelete)
                     {
                         vNodesDisconnected.remove(pnode);
+                        vNodesDeleted.push_back(pnode->GetId());
                         delete pnode;
                     }
                 }
             }
         }
 
+        // Outside cs_vNodes, which is taken after cs_main elsewhere
+        BOOST_FOREACH(NodeId nodeid, vNodesDeleted)
+            FinalizeNode(nodeid);
+
         {
             LOCK(cs_vNodes);
 
@@ -1066,67 +1197,74 @@ void CConnman::ThreadSocketHandler2()
         FD_ZERO(&fdsetError);
         SOCKET hSocketMax = 0;
         bool have_fds = false;
+        bool fListenReady = false;
 
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        {
-            FD_SET(hListenSocket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket);
-            have_fds = true;
-        }
-
+        if (socketEventsMode == SOCKETEVENTS_EPOLL)
+            fListenReady = WaitForSocketEvents(timeout.tv_usec / 1000);
+        else
         {
-            LOCK(cs_vNodes);
+            BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+            {
+                FD_SET(hListenSocket, &fdsetRecv);
+                hSocketMax = max(hSocketMax, hListenSocket);
+                have_fds = true;
+            }
 
-            BOOST_FOREACH(CNode* pnode, vNodes)
             {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                LOCK(cs_vNodes);
 
-                    if (lockSend)
+                BOOST_FOREACH(CNode* pnode, vNodes)
+                {
+                    if (pnode->hSocket == INVALID_SOCKET)
+                        continue;
                     {
-                        // do not read, if draining write queue
-                        if (!pnode->vSendMsg.empty())
-                            FD_SET(pnode->hSocket, &fdsetSend);
-                        else
-                            FD_SET(pnode->hSocket, &fdsetRecv);
-
-                        FD_SET(pnode->hSocket, &fdsetError);
-                        hSocketMax = max(hSocketMax, pnode->hSocket);
-                        have_fds = true;
+                        TRY_LOCK(pnode->cs_vSend, lockSend);
+
+                        if (lockSend)
+                        {
+                            // do not read, if draining write queue
+                            if (!pnode->vSendMsg.empty())
+                                FD_SET(pnode->hSocket, &fdsetSend);
+                            else
+                                FD_SET(pnode->hSocket, &fdsetRecv);
+
+                            FD_SET(pnode->hSocket, &fdsetError);
+                            hSocketMax = max(hSocketMax, pnode->hSocket);
+                            have_fds = true;
+                        }
                     }
                 }
             }
-        }
-
-        vnThreadsRunning[THREAD_SOCKETHANDLER]--;
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        vnThreadsRunning[THREAD_SOCKETHANDLER]++;
 
-        if (fShutdown)
-            return;
+            vnThreadsRunning[THREAD_SOCKETHANDLER]--;
+            int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                                 &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+            vnThreadsRunning[THREAD_SOCKETHANDLER]++;
 
-        if (nSelect == SOCKET_ERROR)
-        {
-            if (have_fds)
+            if (nSelect == SOCKET_ERROR)
             {
-                int nErr = WSAGetLastError();
-                LogPrintf("%s : socket select error %d\n", __func__, nErr);
+                if (have_fds)
+                {
+                    int nErr = WSAGetLastError();
+                    LogPrintf("%s : socket select error %d\n", __func__, nErr);
 
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
+                    for (unsigned int i = 0; i <= hSocketMax; i++)
+                        FD_SET(i, &fdsetRecv);
+                }
 
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec / 1000);
+                FD_ZERO(&fdsetSend);
+                FD_ZERO(&fdsetError);
+                MilliSleep(timeout.tv_usec / 1000);
+            }
         }
 
+        if (fShutdown)
+            return;
+
         // Accept new connections
         BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+        if (hListenSocket != INVALID_SOCKET &&
+            (socketEventsMode == SOCKETEVENTS_EPOLL ? fListenReady : FD_ISSET(hListenSocket, &fdsetRecv)))
         {
             struct sockaddr_storage sockaddr;
             socklen_t len = sizeof(sockaddr);
@@ -1159,6 +1297,12 @@ void CConnman::ThreadSocketHandler2()
             {
                 CloseSocket(hSocket);
             }
+            else if (socketEventsMode == SOCKETEVENTS_SELECT && !IsSelectableSocket(hSocket))
+            {
+                LogPrintf("%s : connection from %s dropped (non-selectable socket)\n", __func__,
+                          addr.ToString().c_str());
+                CloseSocket(hSocket);
+            }
             else if (IsBanned(addr))
             {
                 LogPrintf("%s : connection from %s dropped (banned)\n", __func__,
@@ -1170,6 +1314,7 @@ void CConnman::ThreadSocketHandler2()
                 LogPrintf("%s : accepted connection %s\n", __func__, addr.ToString().c_str());
                 CNode* pnode = new CNode(hSocket, addr, "", true);
                 pnode->AddRef();
+                RegisterSocketEvents(pnode);
 
                 {
                     LOCK(cs_vNodes);
@@ -1197,7 +1342,24 @@ void CConnman::ThreadSocketHandler2()
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
 
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            bool fRecvReady, fSendReady;
+
+            if (socketEventsMode == SOCKETEVENTS_EPOLL)
+            {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+
+                // same policy as select: do not read, if draining write queue, and skip a node busy queueing
+                bool fSendPending = !lockSend || !pnode->vSendMsg.empty();
+                fRecvReady = pnode->fSocketReadable && !fSendPending;
+                fSendReady = lockSend && pnode->fSocketWritable && fSendPending;
+            }
+            else
+            {
+                fRecvReady = FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError);
+                fSendReady = FD_ISSET(pnode->hSocket, &fdsetSend);
+            }
+
+            if (fRecvReady)
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
 
@@ -1221,8 +1383,14 @@ void CConnman::ThreadSocketHandler2()
                         {
                             if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
                                 pnode->CloseSocketDisconnect();
+                            else if (!pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete())
+                                ScheduleNode(pnode);
 
                             pnode->nLastRecv = GetTime();
+
+                            // a short read drained the socket, wait for the next edge
+                            if (nBytes < (int)sizeof(pchBuf))
+                                pnode->fSocketReadable = false;
                         }
                         else if (nBytes == 0)
                         {
@@ -1237,6 +1405,9 @@ void CConnman::ThreadSocketHandler2()
                             // error
                             int nErr = WSAGetLastError();
 
+                            if (nErr == WSAEWOULDBLOCK)
+                                pnode->fSocketReadable = false;
+
                             if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
                             {
                                 if (!pnode->fDisconnect)
@@ -1253,12 +1424,18 @@ void CConnman::ThreadSocketHandler2()
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
 
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            if (fSendReady)
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
 
                 if (lockSend)
+                {
                     SocketSendData(pnode);
+
+                    // anything left over means the socket buffer is full
+                    if (!pnode->vSendMsg.empty())
+                        pnode->fSocketWritable = false;
+                }
             }
 
             // Inactivity checking
@@ -1946,114 +2123,154 @@ bool CConnman::OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGran
     return true;
 }
 
-void ThreadMessageHandler(void* parg)
+void CConnman::ScheduleNode(CNode* pnode, bool fSendTrickle)
 {
-    // Make this thread recognisable as the message handling thread
-    RenameThread("neutron-msghand");
+    if (fSendTrickle)
+        pnode->fMsgSendTrickle = true;
+
+    pnode->fMsgPending = true;
+
+    // Already queued or being processed, ProcessNode requeues it once the current pass is done
+    if (pnode->fMsgScheduled.exchange(true))
+        return;
+
+    pnode->AddRef();
+    CMessageWorkQueue& workQueue = *vMessageQueues[nNextMessageQueue++ % vMessageQueues.size()];
 
-    try
-    {
-        vnThreadsRunning[THREAD_MESSAGEHANDLER]++;
-        ThreadMessageHandler2(parg);
-        vnThreadsRunning[THREAD_MESSAGEHANDLER]--;
-    }
-    catch (std::exception& e)
     {
-        vnThreadsRunning[THREAD_MESSAGEHANDLER]--;
-        PrintException(&e, __func__);
+        std::lock_guard<std::mutex> lock(workQueue.mutex);
+        workQueue.queue.push_back(pnode);
     }
-    catch (...)
+
     {
-        vnThreadsRunning[THREAD_MESSAGEHANDLER]--;
-        PrintException(NULL, __func__);
+        std::lock_guard<std::mutex> lock(mutexMsgProc);
+        nScheduledNodes++;
     }
 
-    LogPrintf("%s : exited\n", __func__);
+    condMsgProc.notify_one();
 }
 
-void ThreadMessageHandler2(void* parg)
+CNode* CConnman::PopScheduledNode(unsigned int nWorker)
 {
-    boost::mutex condition_mutex;
-    boost::unique_lock<boost::mutex> lock(condition_mutex);
-    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
-
-    while (!fShutdown)
+    // Serve our own queue from the front, steal from the back of the others when it runs dry
+    for (unsigned int i = 0; i < vMessageQueues.size(); i++)
     {
-        vector<CNode*> vNodesCopy;
-        {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
+        CMessageWorkQueue& workQueue = *vMessageQueues[(nWorker + i) % vMessageQueues.size()];
+        std::lock_guard<std::mutex> lock(workQueue.mutex);
 
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->AddRef();
+        if (workQueue.queue.empty())
+            continue;
+
+        CNode* pnode;
+
+        if (i == 0)
+        {
+            pnode = workQueue.queue.front();
+            workQueue.queue.pop_front();
+        }
+        else
+        {
+            pnode = workQueue.queue.back();
+            workQueue.queue.pop_back();
         }
 
-        // Poll the connected nodes for messages
-        CNode* pnodeTrickle = NULL;
+        nScheduledNodes--;
+        return pnode;
+    }
 
-        if (!vNodesCopy.empty())
-            pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
+    return NULL;
+}
 
-        bool fSleep = true;
+void CConnman::ProcessNode(CNode* pnode)
+{
+    bool fMoreWork = false;
+    pnode->fMsgPending = false;
 
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+    if (!pnode->fDisconnect && !fShutdown)
+    {
+        // Receive messages, ProcessMessages handles at most one message per pass
         {
-            if (pnode->fDisconnect)
-                continue;
+            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+            TRY_LOCK(cs_Shutdown, lockShutdown);
 
-            // Receive messages
-            if (!fShutdown)
+            if (lockRecv && lockShutdown)
             {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                TRY_LOCK(cs_Shutdown, lockShutdown);
+                if (!ProcessMessages(pnode))
+                    pnode->CloseSocketDisconnect();
 
-                if (lockRecv && lockShutdown)
+                if (pnode->nSendSize < SendBufferSize())
                 {
-                    if (!ProcessMessages(pnode))
-                        pnode->CloseSocketDisconnect();
-
-                    if (pnode->nSendSize < SendBufferSize())
-                    {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() &&
-                            pnode->vRecvMsg[0].complete()))
-                        {
-                            fSleep = false;
-                        }
-                    }
+                    fMoreWork = !pnode->vRecvGetData.empty() ||
+                                (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete());
                 }
             }
-            else
-                return;
+        }
 
-            boost::this_thread::interruption_point();
+        // Send messages
+        if (!fShutdown)
+        {
+            TRY_LOCK(cs_Shutdown, lockShutdown);
 
-            // Send messages
-            if (!fShutdown)
-            {
-                TRY_LOCK(cs_Shutdown, lockShutdown);
+            if (lockShutdown)
+                SendMessages(pnode, pnode->fMsgSendTrickle.exchange(false));
+        }
+    }
 
-                if (lockShutdown)
-                    SendMessages(pnode, pnode == pnodeTrickle);
-            }
-            else
-                return;
+    // Requeue at the back so every other peer with work gets a turn first
+    pnode->fMsgScheduled = false;
 
-            boost::this_thread::interruption_point();
-        }
+    if (fMoreWork || pnode->fMsgPending)
+        ScheduleNode(pnode);
 
-        //TODO: Why is the copy locking the main array?
+    pnode->Release();
+}
+
+void CConnman::ThreadMessageWorker(unsigned int nWorker)
+{
+    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+
+    while (!flagInterruptMsgProc)
+    {
+        CNode* pnode = PopScheduledNode(nWorker);
+
+        if (pnode == NULL)
         {
-            LOCK(cs_vNodes);
+            std::unique_lock<std::mutex> lock(mutexMsgProc);
+            condMsgProc.wait_for(lock, std::chrono::milliseconds(100), [this] {
+                return nScheduledNodes > 0 || flagInterruptMsgProc;
+            });
 
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->Release();
+            continue;
         }
 
-        if (fSleep)
+        ProcessNode(pnode);
+    }
+}
+
+void CConnman::ThreadMessageHandler()
+{
+    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+
+    while (!flagInterruptMsgProc)
+    {
+        // Give every peer a pass at least once per tick so periodic sends (pings, inventory and
+        // address trickling) keep going when nothing is received
         {
-            messageHandlerCondition.timed_wait(lock, boost::posix_time::microsec_clock::universal_time() +
-                                               boost::posix_time::milliseconds(50));
+            LOCK(cs_vNodes);
+            CNode* pnodeTrickle = NULL;
+
+            if (!vNodes.empty())
+                pnodeTrickle = vNodes[GetRand(vNodes.size())];
+
+            BOOST_FOREACH(CNode* pnode, vNodes)
+            {
+                if (!pnode->fDisconnect)
+                    ScheduleNode(pnode, pnode == pnodeTrickle);
+            }
         }
+
+        if (!interruptNet.sleep_for(std::chrono::milliseconds(50)))
+            return;
     }
 }
 
@@ -2236,6 +2453,8 @@ CConnman::CConnman(uint64_t nSeed0In, uint64_t nSeed1In) :
     // nReceiveFloodSize = 0;
     semOutbound = NULL;
     semAddnode = NULL;
+    socketEventsMode = SOCKETEVENTS_SELECT;
+    hEpoll = -1;
     // semMasternodeOutbound = NULL;
     nMaxConnections = 0;
     nMaxOutbound = 0;
@@ -2243,6 +2462,8 @@ CConnman::CConnman(uint64_t nSeed0In, uint64_t nSeed1In) :
     // nBestHeight = 0;
     // clientInterface = NULL;
     flagInterruptMsgProc = false;
+    nNextMessageQueue = 0;
+    nScheduledNodes = 0;
 }
 
 CConnman::~CConnman()
@@ -2260,6 +2481,38 @@ bool CConnman::Start(CScheduler& scheduler, Options connOptions)
     nMaxOutbound = std::min((connOptions.nMaxOutbound), nMaxConnections);
     nMaxAddnode = connOptions.nMaxAddnode;
     nMaxFeeler = connOptions.nMaxFeeler;
+    socketEventsMode = connOptions.socketEventsMode;
+
+#ifdef USE_EPOLL
+    if (socketEventsMode == SOCKETEVENTS_EPOLL)
+    {
+        hEpoll = epoll_create1(EPOLL_CLOEXEC);
+
+        if (hEpoll == -1)
+        {
+            LogPrintf("%s : epoll_create1 failed (%d), falling back to select\n", __func__, errno);
+            socketEventsMode = SOCKETEVENTS_SELECT;
+        }
+        else
+        {
+            // Listening sockets are level-triggered with no node attached; the handler accepts
+            // one connection per socket and iteration, like it does with select
+            BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+            {
+                struct epoll_event event;
+                event.events = EPOLLIN;
+                event.data.ptr = NULL;
+
+                if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket, &event) != 0)
+                    LogPrintf("%s : epoll_ctl failed for listening socket: %d\n", __func__, errno);
+            }
+        }
+    }
+#else
+    socketEventsMode = SOCKETEVENTS_SELECT;
+#endif
+
+    LogPrintf("%s : using %s for socket events\n", __func__, GetSocketEventsModeName(socketEventsMode));
 
     clientInterface = &uiInterface;
 
@@ -2323,6 +2576,14 @@ bool CConnman::Start(CScheduler& scheduler, Options connOptions)
     interruptNet.reset();
     flagInterruptMsgProc = false;
 
+    // The socket handler schedules peers as soon as it starts, so the run queues must exist first
+    vMessageQueues.clear();
+
+    for (int i = 0; i < std::max(1, connOptions.nMessageHandlerThreads); i++)
+        vMessageQueues.push_back(std::unique_ptr<CMessageWorkQueue>(new CMessageWorkQueue()));
+
+    LogPrintf("%s : using %u message handler threads\n", __func__, vMessageQueues.size());
+
     // Send and receive from sockets, accept connections
     // threadSocketHandler = std::thread(&TraceThread<std::function<void()> >, "net",
     //                       std::function<void()>(std::bind(&CConnman::ThreadSocketHandler, this)));
@@ -2355,10 +2616,15 @@ bool CConnman::Start(CScheduler& scheduler, Options connOptions)
                                 std::function<void()>(std::bind(&CConnman::ThreadOpenConnections, this)));
     }
 
-    // NTRN TODO: convert this to use std::thread
     // Process messages
-    if (!NewThread(ThreadMessageHandler, NULL))
-        LogPrintf("%s : [ERROR] NewThread(ThreadMessageHandler) failed\n", __func__);
+    threadMessageHandler = std::thread(&TraceThread<std::function<void()> >, "msghand",
+                           std::function<void()>(std::bind(&CConnman::ThreadMessageHandler, this)));
+
+    for (unsigned int i = 0; i < vMessageQueues.size(); i++)
+    {
+        threadMessageWorkers.push_back(std::thread(&TraceThread<std::function<void()> >, "msgproc",
+                                       std::function<void()>(std::bind(&CConnman::ThreadMessageWorker, this, i))));
+    }
 
     // Mine proof-of-stake blocks in the background
     if (!GetBoolArg("-staking", true))
@@ -2383,7 +2649,7 @@ void CConnman::Interrupt()
         flagInterruptMsgProc = true;
     }
 
-    messageHandlerCondition.notify_all();
+    condMsgProc.notify_all();
     interruptNet();
     InterruptSocks5(true);
 
@@ -2410,9 +2676,18 @@ void CConnman::Stop()
 {
     LogPrintf("%s : started\n", __func__);
 
-    // LogPrintf("%s : joining threadMessageHandler\n", __func__);
-    // if (threadMessageHandler.joinable())
-    //     threadMessageHandler.join();
+    LogPrintf("%s : joining threadMessageHandler\n", __func__);
+
+    if (threadMessageHandler.joinable())
+        threadMessageHandler.join();
+
+    for (std::thread& threadMessageWorker : threadMessageWorkers)
+    {
+        if (threadMessageWorker.joinable())
+            threadMessageWorker.join();
+    }
+
+    threadMessageWorkers.clear();
 
     LogPrintf("%s : joining threadOpenConnections\n", __func__);
 
@@ -2447,6 +2722,22 @@ void CConnman::Stop()
         fAddressesInitialized = false;
     }
 
+    // Drop the references held by peers that were still queued for processing
+    for (std::unique_ptr<CMessageWorkQueue>& workQueue : vMessageQueues)
+    {
+        std::lock_guard<std::mutex> lock(workQueue->mutex);
+
+        for (CNode* pnode : workQueue->queue)
+        {
+            pnode->fMsgScheduled = false;
+            pnode->Release();
+        }
+
+        workQueue->queue.clear();
+    }
+
+    nScheduledNodes = 0;
+
     LogPrintf("%s : closing sockets\n", __func__);
 
     // Close sockets
@@ -2466,6 +2757,14 @@ void CConnman::Stop()
         }
     }
 
+#ifdef USE_EPOLL
+    if (hEpoll != -1)
+    {
+        close(hEpoll);
+        hEpoll = -1;
+    }
+#endif
+
     // clean up some globals (to help leak detection)
     // for (CNode *pnode : vNodes) {
     //     DeleteNode(pnode);
@@ -2506,9 +2805,6 @@ void CConnman::Stop()
     if (vnThreadsRunning[THREAD_OPENCONNECTIONS] > 0)
         LogPrintf("%s : ThreadOpenConnections still running\n", __func__);
 
-    if (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0)
-        LogPrintf("%s : ThreadMessageHandler still running\n", __func__);
-
     if (vnThreadsRunning[THREAD_RPCLISTENER] > 0)
         LogPrintf("%s : ThreadRPCListener still running\n", __func__);
 
@@ -2529,7 +2825,7 @@ void CConnman::Stop()
     if (vnThreadsRunning[THREAD_STAKE_MINER] > 0)
         LogPrintf("%s : ThreadStakeMiner still running\n", __func__);
 
-    while (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0 || vnThreadsRunning[THREAD_RPCHANDLER] > 0)
+    while (vnThreadsRunning[THREAD_RPCHANDLER] > 0)
         MilliSleep(20);
 
     MilliSleep(50);
@@ -2709,12 +3005,20 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     fSuccessfullyConnected = false;
     fDisconnect = false;
     nRefCount = 0;
+    fMsgScheduled = false;
+    fMsgPending = false;
+    fMsgSendTrickle = false;
     nSendSize = 0;
     nSendOffset = 0;
+    fSocketReadable = true;
+    fSocketWritable = true;
+    hPollFd = -1;
     hashContinue = 0;
     pindexLastGetBlocksBegin = 0;
     hashLastGetBlocksEnd = 0;
     nStartingHeight = -1;
+    fHeadersSyncStarted = false;
+    nBestHeaderHeight = -1;
     fGetAddr = false;
     fRelayTxes = false;
     nMisbehavior = 0;
@@ -2743,6 +3047,7 @@ CNode::~CNode()
 {
     if (hSocket != INVALID_SOCKET)
     {
+        UnregisterSocketEvents();
         CloseSocket(hSocket);
         hSocket = INVALID_SOCKET;
     }
@@ -25,7 +25,10 @@
 #include "ui_interface.h"
 #include "utiltime.h"
 
+#include <atomic>
+#include <condition_variable>
 #include <deque>
+#include <memory>
 #include <thread>
 
 #ifndef WIN32
@@ -68,6 +71,35 @@ static const bool DEFAULT_UPNP = false;
 /** The maximum number of peer connections to maintain. */
 static const unsigned int DEFAULT_MAX_PEER_CONNECTIONS = 125;
 
+#ifdef __linux__
+#define USE_EPOLL
+#endif
+
+/** How the socket handler waits for socket readiness */
+enum SocketEventsMode
+{
+    SOCKETEVENTS_SELECT = 0,
+    SOCKETEVENTS_EPOLL = 1,
+};
+
+/** -socketevents default */
+#ifdef USE_EPOLL
+static const SocketEventsMode DEFAULT_SOCKETEVENTS = SOCKETEVENTS_EPOLL;
+#else
+static const SocketEventsMode DEFAULT_SOCKETEVENTS = SOCKETEVENTS_SELECT;
+#endif
+
+/** Maximum number of readiness events collected by one epoll_wait() */
+static const int MAX_SOCKET_EVENTS = 256;
+
+const char* GetSocketEventsModeName(SocketEventsMode mode);
+bool ParseSocketEventsMode(const std::string& strMode, SocketEventsMode& modeRet);
+
+/** Maximum number of message processing threads */
+static const int MAX_MSGHANDLER_THREADS = 16;
+/** -msghandthreads default */
+static const int DEFAULT_MSGHANDLER_THREADS = 4;
+
 // NOTE: When adjusting this, update rpcnet:setban's help ("24h")
 static const unsigned int DEFAULT_MISBEHAVING_BANTIME = 60 * 60 * 24;  // Default 24-hour ban
 
@@ -87,6 +119,9 @@ void SocketSendData(CNode *pnode);
 
 typedef int NodeId;
 
+/** Release the header sync lead and block requests of a deleted peer, in main.cpp */
+void FinalizeNode(NodeId nodeid);
+
 #ifdef WIN32
 // Win32 LevelDB doesn't use filedescriptors, and the ones used for
 // accessing block files don't count towards the fd_set size limit
@@ -194,6 +229,8 @@ public:
         unsigned int nReceiveFloodSize = 0;
         uint64_t nMaxOutboundTimeframe = 0;
         uint64_t nMaxOutboundLimit = 0;
+        SocketEventsMode socketEventsMode = DEFAULT_SOCKETEVENTS;
+        int nMessageHandlerThreads = 1;
     };
 
     CConnman(uint64_t seed0, uint64_t seed1);
@@ -234,7 +271,18 @@ public:
     bool RemoveAddedNode(const std::string& node);
     CNode* ConnectNode(CAddress addrConnect, const char *strDest = NULL, bool darkSendMaster=false); // NTRN TODO - eventually make private
 
+    // Queue a peer for a receive/send pass on one of the message handler threads
+    void ScheduleNode(CNode* pnode, bool fSendTrickle = false);
+
 private:
+    // Run queue of peers owned by one message handler thread. A peer sits in at most one queue
+    // at a time, so its messages are handled in order by a single thread
+    struct CMessageWorkQueue
+    {
+        std::mutex mutex;
+        std::deque<CNode*> queue;
+    };
+
     void ThreadOpenAddedConnections();
     void ThreadOpenAddedConnections2();
     void ProcessOneShot();
@@ -242,8 +290,14 @@ private:
     void ThreadOpenConnections2();
     void ThreadSocketHandler();
     void ThreadSocketHandler2();
+    void RegisterSocketEvents(CNode* pnode);
+    bool WaitForSocketEvents(int nTimeoutMs);
     void ThreadDNSAddressSeed();
     void ThreadStakeMiner(CWallet *pwallet);
+    void ThreadMessageHandler();
+    void ThreadMessageWorker(unsigned int nWorker);
+    CNode* PopScheduledNode(unsigned int nWorker);
+    void ProcessNode(CNode* pnode);
 
     // Check is the banlist has unwritten changes
     bool BannedSetIsDirty();
@@ -260,6 +314,8 @@ private:
 
     CSemaphore *semOutbound;
     CSemaphore *semAddnode;
+    SocketEventsMode socketEventsMode;
+    int hEpoll; // epoll instance, -1 when waiting with select()
     int nMaxConnections;
     int nMaxOutbound;
     int nMaxAddnode;
@@ -269,10 +325,14 @@ private:
     // SipHasher seeds for deterministic randomness
     const uint64_t nSeed0, nSeed1;
 
-    // std::condition_variable condMsgProc;
+    std::condition_variable condMsgProc;
     std::mutex mutexMsgProc;
     std::atomic<bool> flagInterruptMsgProc;
 
+    std::vector<std::unique_ptr<CMessageWorkQueue> > vMessageQueues;
+    std::atomic<unsigned int> nNextMessageQueue;
+    std::atomic<int> nScheduledNodes;
+
     CThreadInterrupt interruptNet;
 
     std::thread threadDNSAddressSeed;
@@ -280,6 +340,8 @@ private:
     std::thread threadOpenAddedConnections;
     std::thread threadOpenConnections;
     std::thread threadStakeMiner;
+    std::thread threadMessageHandler;
+    std::vector<std::thread> threadMessageWorkers;
 };
 
 extern std::unique_ptr<CConnman> g_connman;
@@ -361,9 +423,20 @@ public:
     bool fMasternode; // TODO: finish implementing this
     CSemaphoreGrant grantOutbound;
     CSemaphoreGrant grantMasternodeOutbound; // TODO: finish implementing this
-    int nRefCount;
+    std::atomic<int> nRefCount;
     NodeId id;
 
+    // Message scheduler state, see CConnman::ScheduleNode
+    std::atomic<bool> fMsgScheduled;  // queued or being processed by a message handler thread
+    std::atomic<bool> fMsgPending;    // new work arrived while scheduled
+    std::atomic<bool> fMsgSendTrickle;
+
+    // Socket readiness as last reported by epoll. Edge-triggered events only report changes,
+    // so these stay set until a recv or send on the socket would block
+    bool fSocketReadable;
+    bool fSocketWritable;
+    int hPollFd; // epoll instance the socket is registered with, -1 if none
+
     int nMisbehavior;
     std::vector<std::string> vecRequestsFulfilled; // Keep track of what client has asked for
     std::map<uint256, CRequestTracker> mapRequests;
@@ -373,9 +446,14 @@ public:
     uint256 hashLastGetBlocksEnd;
     int nStartingHeight;
 
+    // Headers-first synchronisation, protected by cs_main
+    bool fHeadersSyncStarted;
+    int nBestHeaderHeight; // height of the best header this peer sent us
+
     // Flood relay
     std::vector<CAddress> vAddrToSend;
     mruset<CAddress> setAddrKnown;
+    CCriticalSection cs_vAddrToSend; // protects vAddrToSend and setAddrKnown
     bool fGetAddr;
     std::set<uint256> setKnown;
     uint256 hashCheckpointKnown; // known sent sync-checkpoint
@@ -456,6 +534,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_vAddrToSend);
         setAddrKnown.insert(addr);
     }
 
@@ -464,6 +543,8 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_vAddrToSend);
+
         if (addr.IsValid() && !setAddrKnown.count(addr))
         {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND)
@@ -772,6 +853,7 @@ public:
     void Subscribe(unsigned int nChannel, unsigned int nHops=0);
     void CancelSubscribe(unsigned int nChannel);
     void CloseSocketDisconnect();
+    void UnregisterSocketEvents();
     void Cleanup();
 
     // Denial-of-service detection/prevention
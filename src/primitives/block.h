@@ -74,9 +74,14 @@ public:
         {
             vHave.push_back(pindex->GetBlockHash());
 
-            // Exponentially larger steps back
-            for (int i = 0; pindex && i < nStep; i++)
-                pindex = pindex->pprev;
+            // Exponentially larger steps back, jumping along the active chain where possible
+            if (chainActive.Contains(pindex))
+                pindex = chainActive[pindex->nHeight - nStep];
+            else
+            {
+                for (int i = 0; pindex && i < nStep; i++)
+                    pindex = pindex->pprev;
+            }
 
             if (vHave.size() > 10)
                 nStep *= 2;
@@ -193,7 +193,7 @@ void MasternodeManager::updateNodeList()
     ui->tableWidget->setSortingEnabled(false);
     ui->tableWidget->clearContents();
     ui->tableWidget->setRowCount(0);
-    std::vector<CMasternode> vMasternodes = vecMasternodes;
+    std::vector<CMasternode> vMasternodes = mnodeman.GetFullMasternodeVector();
 
     BOOST_FOREACH(CMasternode& mn, vMasternodes)
     {
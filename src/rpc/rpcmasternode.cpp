@@ -58,13 +58,14 @@ UniValue masternodelist(const UniValue& params, bool fHelp)
     // NTRN TODO: rename mn.pubkey to mn.pubKeyCollateralAddress
 
     UniValue obj(UniValue::VOBJ);
+    std::vector<CMasternode> vMasternodes = mnodeman.GetFullMasternodeVector();
     if (strMode == "rank") {
-        BOOST_FOREACH(CMasternode mn, vecMasternodes) {
+        BOOST_FOREACH(CMasternode& mn, vMasternodes) {
             mn.Check();
             obj.push_back(Pair(mn.addr.ToString().c_str(), (int)(GetMasternodeRank(mn.vin, pindexBest->nHeight))));
         }
     } else {
-        BOOST_FOREACH(CMasternode mn, vecMasternodes) {
+        BOOST_FOREACH(CMasternode& mn, vMasternodes) {
             std::string strOutpoint = mn.addr.ToString().c_str();
             if (strMode == "activeseconds") {
                 if (strFilter !="" && strOutpoint.find(strFilter) == std::string::npos) continue;
@@ -159,7 +160,7 @@ UniValue masternodecount(const UniValue& params, bool fHelp)
             "masternodecount\n"
             "Returns the synced number of MNs on the Network.");
 
-    return (int)vecMasternodes.size();;
+    return mnodeman.size();
 }
 
 static const CRPCCommand commands[] =
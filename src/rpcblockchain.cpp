@@ -217,10 +217,70 @@ UniValue settxfee(const UniValue& params, bool fHelp)
 
 UniValue getrawmempool(const UniValue& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "getrawmempool\n"
-            "Returns all transaction ids in memory pool.");
+            "getrawmempool [verbose=false]\n"
+            "Returns all transaction ids in memory pool.\n"
+            "With verbose, returns an object per transaction id with its size, fee, fee rate,\n"
+            "time and height of arrival, priority, memory usage, descendants and pool dependencies.");
+
+    bool fVerbose = false;
+
+    if (params.size() > 0)
+        fVerbose = params[0].get_bool();
+
+    if (fVerbose)
+    {
+        LOCK(mempool.cs);
+        UniValue o(UniValue::VOBJ);
+
+        // In order of arrival, as the non-verbose list
+        BOOST_FOREACH(const CTxTimeKey& key, mempool.setByTime)
+        {
+            const uint256& hash = key.second;
+            const CTxMemPoolEntry& entry = *mempool.GetEntry(hash);
+
+            set<uint256> setDescendants;
+            mempool.CalculateDescendants(hash, setDescendants);
+
+            uint64_t nDescendantSize = 0;
+            int64_t nDescendantFees = 0;
+
+            BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+            {
+                const CTxMemPoolEntry* pentry = mempool.GetEntry(hashDescendant);
+
+                if (pentry)
+                {
+                    nDescendantSize += pentry->nTxSize;
+                    nDescendantFees += pentry->nFee;
+                }
+            }
+
+            UniValue info(UniValue::VOBJ);
+            info.push_back(Pair("size", (int)entry.nTxSize));
+            info.push_back(Pair("fee", ValueFromAmount(entry.nFee)));
+            info.push_back(Pair("feeperkb", ValueFromAmount((int64_t)entry.dFeePerKb)));
+            info.push_back(Pair("time", entry.nTime));
+            info.push_back(Pair("height", entry.nHeight));
+            info.push_back(Pair("currentpriority", entry.GetPriority(nBestHeight)));
+            info.push_back(Pair("usage", (uint64_t)entry.nUsage));
+            info.push_back(Pair("descendantcount", (uint64_t)setDescendants.size()));
+            info.push_back(Pair("descendantsize", nDescendantSize));
+            info.push_back(Pair("descendantfees", ValueFromAmount(nDescendantFees)));
+
+            UniValue depends(UniValue::VARR);
+
+            BOOST_FOREACH(const uint256& hashParent, entry.setDependsOn)
+                if (mempool.exists(hashParent))
+                    depends.push_back(hashParent.ToString());
+
+            info.push_back(Pair("depends", depends));
+            o.push_back(Pair(hash.ToString(), info));
+        }
+
+        return o;
+    }
 
     vector<uint256> vtxid;
     mempool.queryHashes(vtxid);
@@ -244,7 +304,7 @@ UniValue getblockhash(const UniValue& params, bool fHelp)
     if (nHeight < 0 || nHeight > nBestHeight)
         throw runtime_error("Block number out of range.");
 
-    CBlockIndex* pblockindex = FindBlockByHeight(nHeight);
+    CBlockIndex* pblockindex = chainActive[nHeight];
     return pblockindex->phashBlock->GetHex();
 }
 
@@ -283,7 +343,7 @@ UniValue getblockbynumber(const UniValue& params, bool fHelp)
         throw runtime_error("Block number out of range.");
 
     CBlock block;
-    CBlockIndex* pblockindex = FindBlockByHeight(nHeight);
+    CBlockIndex* pblockindex = chainActive[nHeight];
     block.ReadFromDisk(pblockindex, true);
 
     return blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false);
@@ -307,7 +367,7 @@ UniValue getblockbyrange(const UniValue& params, bool fHelp)
         throw runtime_error("Block range can be at most 1000 blocks.");
 
     CBlock block;
-    CBlockIndex* pblockindex = FindBlockByHeight(low);
+    CBlockIndex* pblockindex = chainActive[low];
     UniValue blocks(UniValue::VARR);
 
     while (pblockindex != nullptr && pblockindex->nHeight <= high)
@@ -362,7 +422,7 @@ UniValue getblockversionstats(const UniValue& params, bool fHelp) {
     int nBlocks = params[1].get_int();
 
     int nTotal = 0;
-    CBlockIndex* pindex = FindBlockByHeight(nBestHeight - nBlocks + 1);
+    CBlockIndex* pindex = chainActive[std::max(0, nBestHeight - nBlocks + 1)];
 
     while (true) {
         if (pindex->nVersion == nVersion)
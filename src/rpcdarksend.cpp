@@ -4,6 +4,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "main.h"
+#include "txmempool.h"
 //#include "primitives/transaction.h"
 #include "db.h"
 #include "init.h"
@@ -58,13 +59,33 @@ UniValue getpoolinfo(const UniValue& params, bool fHelp)
     if (fHelp || params.size() != 0)
         throw runtime_error(
             "getpoolinfo\n"
-            "Returns an object containing anonymous pool-related information.");
+            "Returns an object containing anonymous pool and memory pool information.\n"
+            "current_masternode is the address of the best scoring masternode, empty if there is none.");
+
+    // Registry handles mean nothing outside this node, report the address
+    std::string strCurrentMasternode;
+    CMasternode mnCurrent;
+
+    if (mnodeman.Get(GetCurrentMasterNode(), mnCurrent))
+        strCurrentMasternode = mnCurrent.addr.ToString();
 
     UniValue obj(UniValue::VOBJ);
-    obj.push_back(Pair("current_masternode",        GetCurrentMasterNode()));
+    obj.push_back(Pair("current_masternode",        strCurrentMasternode));
     obj.push_back(Pair("state",        darkSendPool.GetState()));
     obj.push_back(Pair("entries",      darkSendPool.GetEntriesCount()));
     obj.push_back(Pair("entries_accepted",      darkSendPool.GetCountEntriesAccepted()));
+
+    {
+        LOCK(mempool.cs);
+        obj.push_back(Pair("mempool_size",      (uint64_t)mempool.mapTx.size()));
+        obj.push_back(Pair("mempool_bytes",     mempool.nTotalTxSize));
+        obj.push_back(Pair("mempool_usage",     (uint64_t)mempool.DynamicMemoryUsage()));
+        obj.push_back(Pair("mempool_maxusage",  (int64_t)GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000));
+        obj.push_back(Pair("mempool_evicted",   mempool.nEvicted));
+        obj.push_back(Pair("mempool_minfee",    ValueFromAmount(mempool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000))));
+        obj.push_back(Pair("mempool_expired",   mempool.nExpired));
+    }
+
     return obj;
 }
 
@@ -241,8 +262,9 @@ UniValue masternode(const UniValue& params, bool fHelp)
         }
 
         UniValue obj(UniValue::VOBJ);
+        std::vector<CMasternode> vMasternodes = mnodeman.GetFullMasternodeVector();
 
-        BOOST_FOREACH(CMasternode mn, vecMasternodes)
+        BOOST_FOREACH(CMasternode& mn, vMasternodes)
         {
             mn.Check();
 
@@ -270,7 +292,7 @@ UniValue masternode(const UniValue& params, bool fHelp)
     }
 
     if (strCommand == "count")
-        return (int) vecMasternodes.size();
+        return mnodeman.size();
 
     if (strCommand == "start")
     {
@@ -162,6 +162,21 @@ UniValue importprivkey(const UniValue& params, bool fHelp)
     return NullUniValue;
 }
 
+UniValue abortrescan(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "abortrescan\n"
+            "Stops a wallet rescan started by importprivkey or importwallet.\n"
+            "Returns true if a rescan was running.");
+
+    if (!pwalletMain->IsScanning())
+        return false;
+
+    pwalletMain->AbortRescan();
+    return true;
+}
+
 UniValue importwallet(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -7,6 +7,7 @@
 #include "db.h"
 #include "txdb.h"
 #include "init.h"
+#include "kernel.h"
 #include "miner.h"
 #include "bitcoinrpc.h"
 
@@ -82,6 +83,22 @@ UniValue getstakinginfo(const UniValue& params, bool fHelp)
     obj.push_back(Pair("Net Stake Weight", (uint64_t) nNetworkWeight));
     obj.push_back(Pair("Expected Time", nExpectedTime));
 
+    std::vector<CStakeThreadStats> vStats;
+    GetStakeThreadStats(vStats);
+    UniValue threads(UniValue::VARR);
+
+    for (unsigned int i = 0; i < vStats.size(); i++)
+    {
+        UniValue thread(UniValue::VOBJ);
+        thread.push_back(Pair("Thread", (int) i));
+        thread.push_back(Pair("Coins Searched", vStats[i].nCoins));
+        thread.push_back(Pair("Kernels Hashed", vStats[i].nKernels));
+        thread.push_back(Pair("Kernels Found", vStats[i].nFound));
+        threads.push_back(thread);
+    }
+
+    obj.push_back(Pair("Stake Threads", threads));
+
     return obj;
 }
 
@@ -105,6 +105,7 @@ UniValue getinfo(const UniValue& params, bool fHelp)
     obj.push_back(Pair("stake",         ValueFromAmount(pwalletMain->GetStake())));
     obj.push_back(Pair("total",         ValueFromAmount(pwalletMain->GetTotal())));
     obj.push_back(Pair("blocks",        (int) nBestHeight));
+    obj.push_back(Pair("headers",       GetBestHeaderHeight()));
     obj.push_back(Pair("timeoffset",    (int64_t) GetTimeOffset()));
     obj.push_back(Pair("moneysupply",   ValueFromAmount(pindexBest->nMoneySupply)));
     obj.push_back(Pair("connections",   (int) vNodes.size()));
@@ -143,6 +144,19 @@ UniValue getdebuginfo(const UniValue& params, bool fHelp)
     debugObj.push_back(Pair("mn_enabled", mnodeman.CountEnabled()));
     debugObj.push_back(Pair("estimated_blocks", Checkpoints::GetTotalBlocksEstimate()));
 
+    CBlockFileStats blockFileStats = GetBlockFileStats();
+    debugObj.push_back(Pair("blockfile_reads", blockFileStats.nReads));
+    debugObj.push_back(Pair("blockfile_cache_hits", blockFileStats.nCacheHits));
+    debugObj.push_back(Pair("blockfile_opens", blockFileStats.nOpens));
+    debugObj.push_back(Pair("blockfile_appends", blockFileStats.nAppends));
+
+    CSignatureCacheStats sigCacheStats = GetSignatureCacheStats();
+    debugObj.push_back(Pair("sigcache_size", sigCacheStats.nSize));
+    debugObj.push_back(Pair("sigcache_lookups", sigCacheStats.nLookups));
+    debugObj.push_back(Pair("sigcache_hits", sigCacheStats.nHits));
+    debugObj.push_back(Pair("sigcache_hitrate", sigCacheStats.nLookups ? (double)sigCacheStats.nHits / sigCacheStats.nLookups : 0.0));
+    debugObj.push_back(Pair("sigcache_evictions", sigCacheStats.nEvictions));
+
     obj = getinfo(params, fHelp);
     obj.push_back(Pair("debug", debugObj));
 
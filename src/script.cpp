@@ -4,9 +4,12 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include <atomic>
+
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <openssl/sha.h>
 
 using namespace std;
 using namespace boost;
@@ -16,6 +19,9 @@ using namespace boost;
 #include "bignum.h"
 #include "key.h"
 #include "main.h"
+#include "random.h"
+#include "robinhood.h"
+#include "collectionhashing.h"
 #include "sync.h"
 #include "util.h"
 #include "opensslcompat.h"
@@ -1169,21 +1175,59 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
 class CSignatureCache
 {
 private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, std::vector<unsigned char> > sigdata_type;
-    std::set< sigdata_type> setValid;
-    CCriticalSection cs_sigcache;
+    // Entries are SHA256(salt || sighash || pubkey || signature). The salt is random per node,
+    // so nobody can predict where entries land in the table or which ones get evicted
+    SHA256_CTX ctxSalted;
+
+    // vEntries is what we evict from at random; mapEntries maps an entry to its slot in vEntries
+    std::vector<uint256> vEntries;
+    robin_hood::unordered_flat_map<uint256, uint32_t> mapEntries;
+    FastRandomContext rng;
+    boost::shared_mutex cs_sigcache;
+
+    std::atomic<uint64_t> nLookups;
+    std::atomic<uint64_t> nHits;
+    std::atomic<uint64_t> nInserts;
+    std::atomic<uint64_t> nEvictions;
+
+    uint256 ComputeEntry(const uint256& hash, const std::vector<unsigned char>& vchSig,
+                         const std::vector<unsigned char>& pubKey) const
+    {
+        SHA256_CTX ctx = ctxSalted;
+        uint32_t nPubKeySize = pubKey.size();
+        uint256 entry;
+
+        SHA256_Update(&ctx, hash.begin(), hash.size());
+        SHA256_Update(&ctx, &nPubKeySize, sizeof(nPubKeySize));
+        SHA256_Update(&ctx, pubKey.data(), pubKey.size());
+        SHA256_Update(&ctx, vchSig.data(), vchSig.size());
+        SHA256_Final(entry.begin(), &ctx);
+
+        return entry;
+    }
 
 public:
+    CSignatureCache() : nLookups(0), nHits(0), nInserts(0), nEvictions(0)
+    {
+        uint256 salt = GetRandHash();
+        SHA256_Init(&ctxSalted);
+        SHA256_Update(&ctxSalted, salt.begin(), salt.size());
+    }
+
     bool
     Get(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
     {
-        LOCK(cs_sigcache);
+        uint256 entry = ComputeEntry(hash, vchSig, pubKey);
+        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+
+        nLookups++;
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
+        if (mapEntries.count(entry))
+        {
+            nHits++;
             return true;
+        }
+
         return false;
     }
 
@@ -1196,33 +1240,67 @@ public:
         int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
         if (nMaxCacheSize <= 0) return;
 
-        LOCK(cs_sigcache);
+        uint256 entry = ComputeEntry(hash, vchSig, pubKey);
+        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
+
+        if (mapEntries.count(entry))
+            return;
 
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
+        while (static_cast<int64_t>(vEntries.size()) >= nMaxCacheSize)
         {
             // Evict a random entry. Random because that helps
             // foil would-be DoS attackers who might try to pre-generate
             // and re-use a set of valid signatures just-slightly-greater
             // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+            uint32_t nEvict = rng.rand32() % vEntries.size();
+
+            mapEntries.erase(vEntries[nEvict]);
+
+            if (nEvict != vEntries.size() - 1)
+            {
+                vEntries[nEvict] = vEntries.back();
+                mapEntries[vEntries[nEvict]] = nEvict;
+            }
+
+            vEntries.pop_back();
+            nEvictions++;
         }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+        mapEntries[entry] = vEntries.size();
+        vEntries.push_back(entry);
+        nInserts++;
+    }
+
+    CSignatureCacheStats GetStats()
+    {
+        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        CSignatureCacheStats stats;
+
+        stats.nSize = vEntries.size();
+        stats.nLookups = nLookups;
+        stats.nHits = nHits;
+        stats.nInserts = nInserts;
+        stats.nEvictions = nEvictions;
+
+        return stats;
     }
 };
 
-bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode,
-              const CTransaction& txTo, unsigned int nIn, int nHashType)
+// Constructed on first use, the salt and eviction RNG must not be seeded during static initialization
+static CSignatureCache& GetSignatureCache()
 {
     static CSignatureCache signatureCache;
+    return signatureCache;
+}
 
+CSignatureCacheStats GetSignatureCacheStats()
+{
+    return GetSignatureCache().GetStats();
+}
+
+bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode,
+              const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
     // Hash type is one byte tacked on to the end of the signature
     if (vchSig.empty())
         return false;
@@ -1234,14 +1312,12 @@ bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CSc
 
     uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
 
+    CSignatureCache& signatureCache = GetSignatureCache();
+
     if (signatureCache.Get(sighash, vchSig, vchPubKey))
         return true;
 
-    CKey key;
-    if (!key.SetPubKey(vchPubKey))
-        return false;
-
-    if (!key.Verify(sighash, vchSig))
+    if (!CPubKey(vchPubKey).Verify(sighash, vchSig))
         return false;
 
     signatureCache.Set(sighash, vchSig, vchPubKey);
@@ -1574,6 +1650,12 @@ bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, vecto
 
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
                   int nHashType)
+{
+    return VerifyScript(scriptSig, scriptPubKey, txTo, nIn, true, nHashType);
+}
+
+bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
+                  bool fValidatePayToScriptHash, int nHashType)
 {
     vector<vector<unsigned char> > stack, stackCopy;
     if (!EvalScript(stack, scriptSig, txTo, nIn, nHashType))
@@ -1590,7 +1672,7 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         return false;
 
     // Additional validation for spend-to-script-hash transactions:
-    if (scriptPubKey.IsPayToScriptHash())
+    if (fValidatePayToScriptHash && scriptPubKey.IsPayToScriptHash())
     {
         if (!scriptSig.IsPushOnly()) // scriptSig must be literals-only
             return false;            // or validation fails
@@ -0,0 +1,63 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(chain_tests)
+
+// Links a branch of nCount blocks onto pindexFork, or starts a chain if it is NULL
+static void LinkBranch(vector<CBlockIndex>& vBranch, CBlockIndex* pindexFork, unsigned int nCount)
+{
+    vBranch.resize(nCount);
+
+    for (unsigned int i = 0; i < nCount; i++)
+    {
+        vBranch[i].pprev = i ? &vBranch[i - 1] : pindexFork;
+        vBranch[i].nHeight = vBranch[i].pprev ? vBranch[i].pprev->nHeight + 1 : 0;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(chain_height_index)
+{
+    vector<CBlockIndex> vMain, vFork;
+    LinkBranch(vMain, NULL, 100);
+    LinkBranch(vFork, &vMain[59], 60);
+
+    CChain chain;
+    BOOST_CHECK(chain.Tip() == NULL);
+    BOOST_CHECK(chain.FindFork(&vFork[10]) == NULL);
+
+    chain.SetTip(&vMain[99]);
+    BOOST_CHECK_EQUAL(chain.Height(), 99);
+    BOOST_CHECK(chain.Genesis() == &vMain[0]);
+
+    for (int i = 0; i < 100; i++)
+    {
+        BOOST_CHECK(chain[i] == &vMain[i]);
+        BOOST_CHECK(chain.Contains(&vMain[i]));
+    }
+
+    BOOST_CHECK(chain[100] == NULL);
+    BOOST_CHECK(chain[-1] == NULL);
+    BOOST_CHECK(chain.Next(&vMain[41]) == &vMain[42]);
+    BOOST_CHECK(chain.Next(&vMain[99]) == NULL);
+    BOOST_CHECK(!chain.Contains(&vFork[0]));
+    BOOST_CHECK(chain.FindFork(&vFork[50]) == &vMain[59]);
+
+    // Switching to the longer fork only rewrites the heights above the fork point
+    chain.SetTip(&vFork[59]);
+    BOOST_CHECK_EQUAL(chain.Height(), 119);
+    BOOST_CHECK(chain[59] == &vMain[59]);
+    BOOST_CHECK(chain[60] == &vFork[0]);
+    BOOST_CHECK(!chain.Contains(&vMain[60]));
+    BOOST_CHECK(chain.FindFork(&vMain[99]) == &vMain[59]);
+
+    // And back to a shorter tip
+    chain.SetTip(&vMain[80]);
+    BOOST_CHECK_EQUAL(chain.Height(), 80);
+    BOOST_CHECK(chain.Tip() == &vMain[80]);
+    BOOST_CHECK(chain[81] == NULL);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
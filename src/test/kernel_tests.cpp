@@ -0,0 +1,101 @@
+#include <limits>
+
+#include <boost/test/unit_test.hpp>
+
+#include "kernel.h"
+#include "random.h"
+
+using namespace std;
+
+// The v2 kernel hash and target as computed before CStakeKernel existed
+static uint256 ReferenceKernelHash(uint64_t nStakeModifier, unsigned int nTimeBlockFrom, unsigned int nTimeTxPrev,
+                                   const COutPoint& prevout, unsigned int nTimeTx)
+{
+    CDataStream ss(SER_GETHASH, 0);
+    ss << nStakeModifier << nTimeBlockFrom << nTimeTxPrev << prevout.hash << prevout.n << nTimeTx;
+    return Hash(ss.begin(), ss.end());
+}
+
+static CBigNum ReferenceKernelTarget(unsigned int nBits, int64_t nValueIn)
+{
+    CBigNum bnTarget;
+    bnTarget.SetCompact(nBits);
+    bnTarget *= CBigNum(nValueIn);
+    return bnTarget;
+}
+
+BOOST_AUTO_TEST_SUITE(kernel_tests)
+
+BOOST_AUTO_TEST_CASE(stake_kernel_matches_datastream)
+{
+    const unsigned int vBits[] = { 0x1d00ffff, 0x1e0fffff, 0x1c0ffff0, 0x207fffff, 0x2100ffff };
+
+    for (int i = 0; i < 200; i++)
+    {
+        uint64_t nStakeModifier = GetRand(std::numeric_limits<uint64_t>::max());
+        unsigned int nTimeBlockFrom = 1500000000 + GetRand(100000000);
+        unsigned int nTimeTxPrev = nTimeBlockFrom - GetRand(600);
+        COutPoint prevout(GetRandHash(), GetRand(64));
+        int64_t nValueIn = 1 + GetRand(100000 * COIN);
+        unsigned int nBits = vBits[i % (sizeof(vBits) / sizeof(vBits[0]))];
+
+        CStakeKernel kernel(nStakeModifier, nBits, nTimeBlockFrom, nTimeTxPrev, nValueIn, prevout);
+        CBigNum bnTarget = ReferenceKernelTarget(nBits, nValueIn);
+        BOOST_CHECK(kernel.GetTarget() == bnTarget.getuint256());
+
+        unsigned int nTimeTx = nTimeBlockFrom + nStakeMinAge + GetRand(1000000);
+
+        for (unsigned int n = 0; n < 16; n++)
+        {
+            uint256 hashReference = ReferenceKernelHash(nStakeModifier, nTimeBlockFrom, nTimeTxPrev, prevout, nTimeTx - n);
+            BOOST_CHECK(kernel.GetHash(nTimeTx - n) == hashReference);
+            BOOST_CHECK_EQUAL(kernel.MeetsTarget(hashReference), !(CBigNum(hashReference) > bnTarget));
+
+            uint256 hashProofOfStake;
+            BOOST_CHECK_EQUAL(kernel.Check(nTimeTx - n, hashProofOfStake), !(CBigNum(hashReference) > bnTarget));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(stake_kernel_matches_checkstakekernelhash)
+{
+    CBlockIndex indexPrev;
+    indexPrev.nHeight = 2100000;
+    indexPrev.nStakeModifier = 0x0123456789abcdefULL;
+    BOOST_REQUIRE_EQUAL(GetPOSProtocolVersion(indexPrev.nHeight + 1), 2);
+
+    unsigned int nBits = 0x1e0fffff;
+    unsigned int nTimeBlockFrom = 1600000000;
+    unsigned int nTimeTxPrev = nTimeBlockFrom - 30;
+    COutPoint prevout(GetRandHash(), 1);
+    int64_t nValueIn = 2500 * COIN;
+
+    CStakeKernel kernel(indexPrev.nStakeModifier, nBits, nTimeBlockFrom, nTimeTxPrev, nValueIn, prevout);
+
+    for (unsigned int nTimeTx = nTimeBlockFrom + nStakeMinAge; nTimeTx < nTimeBlockFrom + nStakeMinAge + 64; nTimeTx++)
+    {
+        uint256 hashProofOfStake = 0, targetProofOfStake = 0;
+        bool fPass = CheckStakeKernelHash(&indexPrev, nBits, 0, nTimeBlockFrom, 0, nTimeTxPrev, nValueIn, prevout,
+                                          nTimeTx, hashProofOfStake, targetProofOfStake);
+
+        uint256 hashKernel;
+        BOOST_CHECK_EQUAL(kernel.Check(nTimeTx, hashKernel), fPass);
+        BOOST_CHECK(hashKernel == hashProofOfStake);
+        BOOST_CHECK(kernel.GetTarget() == targetProofOfStake);
+    }
+
+    // Timestamp rules are enforced without hashing
+    uint256 hashProofOfStake;
+    BOOST_CHECK(!kernel.Check(nTimeTxPrev - 1, hashProofOfStake));
+    BOOST_CHECK(!kernel.Check(nTimeBlockFrom + nStakeMinAge - 1, hashProofOfStake));
+}
+
+BOOST_AUTO_TEST_CASE(stake_kernel_overflowing_target)
+{
+    // A weighted target beyond 256 bits is met by every hash
+    CStakeKernel kernel(1, 0x2100ffff, 1000, 1000, 1000000 * COIN, COutPoint(GetRandHash(), 0));
+    BOOST_CHECK(ReferenceKernelTarget(0x2100ffff, 1000000 * COIN).bitSize() > 256);
+    BOOST_CHECK(kernel.MeetsTarget(~uint256(0)));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
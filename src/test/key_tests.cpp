@@ -5,6 +5,7 @@
 
 #include "key.h"
 #include "base58.h"
+#include "random.h"
 #include "uint256.h"
 #include "util.h"
 
@@ -144,4 +145,53 @@ BOOST_AUTO_TEST_CASE(key_test1)
     }
 }
 
+#ifdef USE_SECP256K1
+BOOST_AUTO_TEST_CASE(key_sigbackend_differential)
+{
+    SigVerifyBackend backendOrig = GetSigVerifyBackend();
+
+    for (int n = 0; n < 64; n++)
+    {
+        CKey key;
+        key.MakeNewKey(n % 2);
+        CPubKey pubkey = key.GetPubKey();
+
+        string strMsg = strprintf("Differential message %i", n);
+        uint256 hashMsg = Hash(strMsg.begin(), strMsg.end());
+        uint256 hashOther = Hash(strMsg.begin(), strMsg.end() - 1);
+        vector<unsigned char> vchSig, vchCompact;
+        BOOST_CHECK(key.Sign(hashMsg, vchSig));
+        BOOST_CHECK(key.SignCompact(hashMsg, vchCompact));
+
+        // Corrupt a different byte of the signature every round, including the DER framing
+        vector<unsigned char> vchBad(vchSig);
+        vchBad[n % vchBad.size()] ^= 1 << (n % 8);
+        vector<unsigned char> vchTrailing(vchSig);
+        vchTrailing.push_back(0);
+
+        for (int b = 0; b < 2; b++)
+        {
+            BOOST_CHECK(SetSigVerifyBackend(b == 0 ? SIGVERIFY_OPENSSL : SIGVERIFY_SECP256K1));
+
+            BOOST_CHECK( pubkey.Verify(hashMsg, vchSig));
+            BOOST_CHECK( key.Verify(hashMsg, vchSig));
+            BOOST_CHECK(!pubkey.Verify(hashMsg, vchTrailing));
+            BOOST_CHECK(!pubkey.Verify(hashMsg, vector<unsigned char>()));
+            BOOST_CHECK(!pubkey.Verify(hashOther, vchSig));
+
+            CKey rkey;
+            BOOST_CHECK(rkey.SetCompactSignature(hashMsg, vchCompact));
+            BOOST_CHECK(rkey.GetPubKey() == pubkey);
+        }
+
+        BOOST_CHECK(SetSigVerifyBackend(SIGVERIFY_OPENSSL));
+        bool fOpenSSL = pubkey.Verify(hashMsg, vchBad);
+        BOOST_CHECK(SetSigVerifyBackend(SIGVERIFY_SECP256K1));
+        BOOST_CHECK_EQUAL(fOpenSSL, pubkey.Verify(hashMsg, vchBad));
+    }
+
+    SetSigVerifyBackend(backendOrig);
+}
+#endif
+
 BOOST_AUTO_TEST_SUITE_END()
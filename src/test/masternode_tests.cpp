@@ -0,0 +1,146 @@
+#include <boost/test/unit_test.hpp>
+
+#include "clientversion.h"
+#include "masternode.h"
+#include "random.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(masternode_tests)
+
+static CMasternode MakeMasternode(unsigned int n)
+{
+    CKey key;
+    key.MakeNewKey(true);
+
+    CTxIn vin(COutPoint(GetRandHash(), n));
+    CService addr(strprintf("1.2.3.%u", n + 1), 32000);
+
+    return CMasternode(addr, vin, key.GetPubKey(), vector<unsigned char>(), 0, key.GetPubKey(), PROTOCOL_VERSION);
+}
+
+BOOST_AUTO_TEST_CASE(masternode_registry_indexes)
+{
+    CMasternodeMan registry;
+    vector<CMasternode> vMasternodes;
+    vector<int> vHandles;
+
+    for (unsigned int i = 0; i < 10; i++)
+    {
+        vMasternodes.push_back(MakeMasternode(i));
+        vHandles.push_back(registry.Add(vMasternodes[i]));
+        BOOST_CHECK(vHandles[i] != -1);
+    }
+
+    BOOST_CHECK_EQUAL(registry.size(), 10);
+    BOOST_CHECK_EQUAL(registry.Add(vMasternodes[3]), -1);
+
+    for (unsigned int i = 0; i < 10; i++)
+        BOOST_CHECK_EQUAL(registry.GetHandle(vMasternodes[i].vin), vHandles[i]);
+
+    // The snapshot keeps the order of arrival
+    vector<CMasternode> vSnapshot = registry.GetFullMasternodeVector();
+    BOOST_REQUIRE_EQUAL(vSnapshot.size(), 10U);
+    for (unsigned int i = 0; i < 10; i++)
+        BOOST_CHECK(vSnapshot[i].vin == vMasternodes[i].vin);
+
+    // Moving to a new address changes the entry in place
+    CService addrNew("5.6.7.8", 32000);
+    unsigned int nVersion = nMasternodeListVersion;
+    BOOST_CHECK(registry.Update(vMasternodes[4].vin, [&](CMasternode& mn) { mn.addr = addrNew; }));
+    CMasternode mnMoved;
+    BOOST_REQUIRE(registry.Get(vHandles[4], mnMoved));
+    BOOST_CHECK(mnMoved.addr == addrNew);
+    BOOST_CHECK_EQUAL(nMasternodeListVersion, nVersion);
+
+    // Changes that matter to the rankings are counted
+    BOOST_CHECK(registry.Update(vMasternodes[4].vin, [](CMasternode& mn) { mn.protocolVersion++; }));
+    BOOST_CHECK(nMasternodeListVersion != nVersion);
+
+    CMasternode mn;
+    BOOST_CHECK(registry.Get(vHandles[4], mn));
+    BOOST_CHECK(mn.addr == addrNew);
+    BOOST_CHECK(!registry.Update(CTxIn(COutPoint(GetRandHash(), 0)), [](CMasternode&) {}));
+
+    registry.Clear();
+    BOOST_CHECK_EQUAL(registry.size(), 0);
+    BOOST_CHECK(!registry.Get(vMasternodes[0].vin, mn));
+
+    // Handles are never reused
+    BOOST_CHECK(registry.Add(vMasternodes[0]) > vHandles[9]);
+}
+
+BOOST_AUTO_TEST_CASE(masternode_collateral_spent_by_block)
+{
+    CMasternodeMan registry;
+    CMasternode mnSpent = MakeMasternode(0), mnKept = MakeMasternode(1);
+    registry.Add(mnSpent);
+    registry.Add(mnKept);
+    registry.Update(mnSpent.vin, [](CMasternode& mn) { mn.UpdateLastSeen(); });
+
+    CBlock block;
+    block.vtx.resize(2);
+    block.vtx[0].vin.resize(1);
+    block.vtx[0].vin[0].prevout.SetNull();
+    block.vtx[0].vout.resize(1);
+    block.vtx[1].vin.push_back(CTxIn(mnSpent.vin.prevout));
+    block.vtx[1].vout.resize(1);
+
+    unsigned int nVersion = nMasternodeListVersion;
+    registry.BlockConnected(block);
+
+    CMasternode mn;
+    BOOST_REQUIRE(registry.Get(mnSpent.vin, mn));
+    BOOST_CHECK_EQUAL(mn.nActiveState, CMasternode::MASTERNODE_VIN_SPENT);
+    BOOST_REQUIRE(registry.Get(mnKept.vin, mn));
+    BOOST_CHECK_EQUAL(mn.nActiveState, CMasternode::MASTERNODE_ENABLED);
+    BOOST_CHECK(nMasternodeListVersion != nVersion);
+
+    // Disconnecting the block brings it back
+    registry.BlockDisconnected(block);
+    BOOST_REQUIRE(registry.Get(mnSpent.vin, mn));
+    BOOST_CHECK_EQUAL(mn.nActiveState, CMasternode::MASTERNODE_ENABLED);
+}
+
+BOOST_AUTO_TEST_CASE(masternode_cache_roundtrip)
+{
+    CMasternodeCache cache;
+    cache.nTime = GetTime();
+    cache.hashBestChain = GetRandHash();
+    cache.vMasternodes.push_back(MakeMasternode(0));
+    cache.vMasternodes.push_back(MakeMasternode(1));
+    cache.vMasternodes[1].nActiveState = CMasternode::MASTERNODE_EXPIRED;
+    cache.vMasternodes[1].nLastDsq = 42;
+
+    CMasternodePaymentWinner winner;
+    winner.nBlockHeight = 1000;
+    winner.vin = cache.vMasternodes[0].vin;
+    cache.mapWinners[1000] = winner;
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << cache;
+
+    CMasternodeCache cacheRead;
+    ss >> cacheRead;
+    BOOST_CHECK(cacheRead.hashBestChain == cache.hashBestChain);
+    BOOST_CHECK_EQUAL(cacheRead.nTime, cache.nTime);
+    BOOST_REQUIRE_EQUAL(cacheRead.vMasternodes.size(), 2U);
+
+    for (unsigned int i = 0; i < 2; i++)
+    {
+        BOOST_CHECK(cacheRead.vMasternodes[i].vin == cache.vMasternodes[i].vin);
+        BOOST_CHECK(cacheRead.vMasternodes[i].addr == cache.vMasternodes[i].addr);
+        BOOST_CHECK(cacheRead.vMasternodes[i].pubkey2 == cache.vMasternodes[i].pubkey2);
+        BOOST_CHECK_EQUAL(cacheRead.vMasternodes[i].nActiveState, cache.vMasternodes[i].nActiveState);
+    }
+    BOOST_CHECK_EQUAL(cacheRead.vMasternodes[1].nLastDsq, 42);
+    BOOST_REQUIRE_EQUAL(cacheRead.mapWinners.count(1000), 1U);
+    BOOST_CHECK(cacheRead.mapWinners[1000].vin == winner.vin);
+
+    // A layout from another version is refused
+    CDataStream ssOther(SER_DISK, CLIENT_VERSION);
+    ssOther << (int)(MASTERNODE_CACHE_VERSION + 1) << cache.nTime << cache.hashBestChain;
+    BOOST_CHECK_THROW(ssOther >> cacheRead, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,207 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "txmempool.h"
+#include "utiltime.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(mempool_tests)
+
+BOOST_AUTO_TEST_CASE(mempool_entry_cache)
+{
+    CTxMemPool pool;
+
+    // Parent spends an unknown input, the children spend the parent
+    CTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txParent.vout.resize(3);
+    for (int i = 0; i < 3; i++)
+    {
+        txParent.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txParent.vout[i].nValue = 10 * COIN;
+    }
+    uint256 hashParent = txParent.GetHash();
+    pool.addUnchecked(hashParent, txParent);
+
+    vector<CTransaction> vChild(3);
+    for (int i = 0; i < 3; i++)
+    {
+        vChild[i].vin.resize(1);
+        vChild[i].vin[0].scriptSig = CScript() << OP_11;
+        vChild[i].vin[0].prevout = COutPoint(hashParent, i);
+        vChild[i].vout.resize(1);
+        vChild[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        vChild[i].vout[0].nValue = 10 * COIN - (i + 1) * CENT;
+        pool.addUnchecked(vChild[i].GetHash(), vChild[i]);
+    }
+
+    BOOST_CHECK_EQUAL(pool.mapTx.size(), 4U);
+    BOOST_CHECK_EQUAL(pool.setByFeeRate.size(), 4U);
+    BOOST_CHECK_EQUAL(pool.nSequence, 4U);
+
+    for (int i = 0; i < 3; i++)
+    {
+        const CTxMemPoolEntry* pentry = pool.GetEntry(vChild[i].GetHash());
+        BOOST_REQUIRE(pentry);
+        BOOST_CHECK_EQUAL(pentry->nFee, (i + 1) * CENT);
+        BOOST_CHECK_EQUAL(pentry->nTxSize, ::GetSerializeSize(vChild[i], SER_NETWORK, PROTOCOL_VERSION));
+        BOOST_CHECK(pentry->setDependsOn.count(hashParent));
+        BOOST_CHECK_EQUAL(pentry->nValueInChain, 0);
+    }
+
+    // Lookups share the pool's copy, which outlives its removal
+    CTransactionRef ptx = pool.get(vChild[1].GetHash());
+    BOOST_REQUIRE(ptx);
+    BOOST_CHECK(ptx == pool.get(vChild[1].GetHash()));
+    BOOST_CHECK(*ptx == vChild[1]);
+    BOOST_CHECK(!pool.get(GetRandHash()));
+
+    // Highest fee rate first
+    set<CTxFeeRateKey, CompareTxFeeRate>::const_iterator it = pool.setByFeeRate.begin();
+    for (int i = 2; i >= 0; i--, ++it)
+        BOOST_CHECK(it->second == vChild[i].GetHash());
+
+    // Removing takes the transaction out of the index and is counted
+    unsigned int nRemovals = pool.nRemovalsUpdated;
+    pool.remove(vChild[1]);
+    BOOST_CHECK(!pool.GetEntry(vChild[1].GetHash()));
+    BOOST_CHECK(ptx->GetHash() == vChild[1].GetHash());
+    BOOST_CHECK_EQUAL(pool.setByFeeRate.size(), 3U);
+    BOOST_CHECK_EQUAL(pool.nRemovalsUpdated, nRemovals + 1);
+
+    pool.remove(txParent, true);
+    BOOST_CHECK(pool.setByFeeRate.empty());
+    BOOST_CHECK(pool.mapTx.empty());
+}
+
+BOOST_AUTO_TEST_CASE(mempool_limits)
+{
+    CTxMemPool pool;
+
+    // Ten chains of a parent and a child, the fee rate rising with each chain
+    vector<CTransaction> vParent(10), vChild(10);
+    for (int i = 0; i < 10; i++)
+    {
+        vParent[i].vin.resize(1);
+        vParent[i].vin[0].scriptSig = CScript() << OP_11;
+        vParent[i].vin[0].prevout = COutPoint(GetRandHash(), 0);
+        vParent[i].vout.resize(1);
+        vParent[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        vParent[i].vout[0].nValue = 10 * COIN;
+        pool.addUnchecked(vParent[i].GetHash(), vParent[i]);
+
+        vChild[i].vin.resize(1);
+        vChild[i].vin[0].scriptSig = CScript() << OP_11;
+        vChild[i].vin[0].prevout = COutPoint(vParent[i].GetHash(), 0);
+        vChild[i].vout.resize(1);
+        vChild[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        vChild[i].vout[0].nValue = 10 * COIN - (i + 1) * CENT;
+        pool.addUnchecked(vChild[i].GetHash(), vChild[i]);
+    }
+
+    size_t nUsage = 0;
+    uint64_t nTxSize = 0;
+    for (CTxMemPool::txmap_t::const_iterator mi = pool.mapTx.begin(); mi != pool.mapTx.end(); ++mi)
+    {
+        BOOST_CHECK(mi->second->nUsage > mi->second->nTxSize);
+        nUsage += mi->second->nUsage;
+        nTxSize += mi->second->nTxSize;
+    }
+    BOOST_CHECK_EQUAL(pool.nTotalUsage, nUsage);
+    BOOST_CHECK(pool.DynamicMemoryUsage() >= nUsage);
+    BOOST_CHECK_EQUAL(pool.nTotalTxSize, nTxSize);
+
+    set<uint256> setDescendants;
+    pool.CalculateDescendants(vParent[3].GetHash(), setDescendants);
+    BOOST_CHECK_EQUAL(setDescendants.size(), 2U);
+    BOOST_CHECK(setDescendants.count(vChild[3].GetHash()));
+
+    // The parents pay nothing and go first, taking their children along
+    BOOST_CHECK_EQUAL(pool.TrimToSize(nUsage - 1), 2);
+    int nChains = 0;
+    for (int i = 0; i < 10; i++)
+    {
+        BOOST_CHECK_EQUAL(pool.exists(vParent[i].GetHash()), pool.exists(vChild[i].GetHash()));
+        nChains += pool.exists(vParent[i].GetHash());
+    }
+    BOOST_CHECK_EQUAL(nChains, 9);
+    BOOST_CHECK_EQUAL(pool.nEvicted, 2U);
+    BOOST_CHECK(pool.nTotalUsage < nUsage);
+
+    BOOST_CHECK_EQUAL(pool.TrimToSize(0), 18);
+    BOOST_CHECK_EQUAL(pool.nTotalUsage, 0U);
+    BOOST_CHECK_EQUAL(pool.nTotalTxSize, 0U);
+
+    // Expiry
+    pool.addUnchecked(vParent[0].GetHash(), vParent[0]);
+    pool.addUnchecked(vChild[0].GetHash(), vChild[0]);
+    BOOST_CHECK_EQUAL(pool.Expire(GetTime() - 60), 0);
+    BOOST_CHECK_EQUAL(pool.Expire(GetTime() + 1), 2);
+    BOOST_CHECK_EQUAL(pool.nExpired, 2U);
+    BOOST_CHECK(pool.setByTime.empty());
+}
+
+BOOST_AUTO_TEST_CASE(mempool_package_eviction)
+{
+    CTxMemPool pool;
+
+    // Confirmed outputs for the pool transactions to spend
+    CTransaction txFunding;
+    txFunding.vout.resize(2);
+    for (int i = 0; i < 2; i++)
+    {
+        txFunding.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txFunding.vout[i].nValue = 10 * COIN;
+    }
+    MapPrevTx mapInputs;
+    mapInputs[txFunding.GetHash()] = make_pair(CTxIndex(CDiskTxPos(1,1,1), 2), txFunding);
+
+    // A parent paying nothing with a child paying for both, and a
+    // transaction on its own paying less than the two together
+    CTransaction txParent, txChild, txAlone;
+    txParent.vin.resize(1);
+    txParent.vin[0].prevout = COutPoint(txFunding.GetHash(), 0);
+    txParent.vout.resize(1);
+    txParent.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txParent.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(txParent.GetHash(), txParent, &mapInputs);
+
+    txChild.vin.resize(1);
+    txChild.vin[0].prevout = COutPoint(txParent.GetHash(), 0);
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txChild.vout[0].nValue = 10 * COIN - 4 * CENT;
+    pool.addUnchecked(txChild.GetHash(), txChild);
+
+    txAlone.vin.resize(1);
+    txAlone.vin[0].prevout = COutPoint(txFunding.GetHash(), 1);
+    txAlone.vout.resize(1);
+    txAlone.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txAlone.vout[0].nValue = 10 * COIN - CENT;
+    pool.addUnchecked(txAlone.GetHash(), txAlone, &mapInputs);
+
+    const CTxMemPoolEntry* pentry = pool.GetEntry(txParent.GetHash());
+    BOOST_REQUIRE(pentry);
+    BOOST_CHECK_EQUAL(pentry->nFee, 0);
+    BOOST_CHECK_EQUAL(pentry->nFeesWithDescendants, 4 * CENT);
+    BOOST_CHECK(pentry->GetDescendantScore() > pool.GetEntry(txAlone.GetHash())->GetDescendantScore());
+    BOOST_CHECK_EQUAL(pool.GetMinFee(0), 0);
+
+    // The transaction on its own goes, not the parent and its child
+    double dAloneRate = pool.GetEntry(txAlone.GetHash())->dFeePerKb;
+    BOOST_CHECK_EQUAL(pool.TrimToSize(pool.nTotalUsage - 1), 1);
+    BOOST_CHECK(!pool.exists(txAlone.GetHash()));
+    BOOST_CHECK(pool.exists(txParent.GetHash()) && pool.exists(txChild.GetHash()));
+    BOOST_CHECK(pool.GetMinFee(pool.nTotalUsage) >= (int64_t)dAloneRate + MIN_RELAY_TX_FEE - 1);
+
+    // Taking the child out leaves the parent with its own fee only
+    pool.remove(txChild);
+    BOOST_CHECK_EQUAL(pentry->nFeesWithDescendants, 0);
+    BOOST_CHECK_EQUAL(pentry->nSizeWithDescendants, (int64_t)pentry->nTxSize);
+    BOOST_CHECK_EQUAL(pool.setByDescendantScore.size(), 1U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -151,6 +151,64 @@ BOOST_AUTO_TEST_CASE(tx_invalid)
     }
 }
 
+#ifdef USE_SECP256K1
+// Evaluate every input of the tx_valid/tx_invalid vectors with each signature backend
+// and require identical results. The signature cache is disabled so that the second
+// backend really verifies instead of hitting entries stored by the first.
+BOOST_AUTO_TEST_CASE(tx_sigbackend_differential)
+{
+    SigVerifyBackend backendOrig = GetSigVerifyBackend();
+    string strSigCacheOrig = mapArgs["-maxsigcachesize"];
+    mapArgs["-maxsigcachesize"] = "0";
+
+    const char* files[] = { "tx_valid.json", "tx_invalid.json" };
+
+    for (unsigned int f = 0; f < sizeof(files) / sizeof(files[0]); f++)
+    {
+        Array tests = read_json(files[f]);
+
+        BOOST_FOREACH(Value& tv, tests)
+        {
+            Array test = tv.get_array();
+            string strTest = write_string(tv, false);
+
+            if (test[0].type() != array_type || test.size() != 3 || test[1].type() != str_type)
+                continue;
+
+            map<COutPoint, CScript> mapprevOutScriptPubKeys;
+
+            BOOST_FOREACH(Value& input, test[0].get_array())
+            {
+                Array vinput = input.get_array();
+                mapprevOutScriptPubKeys[COutPoint(uint256(vinput[0].get_str()), vinput[1].get_int())] = ParseScript(vinput[2].get_str());
+            }
+
+            CDataStream stream(ParseHex(test[1].get_str()), SER_NETWORK, PROTOCOL_VERSION);
+            CTransaction tx;
+            stream >> tx;
+
+            for (unsigned int i = 0; i < tx.vin.size(); i++)
+            {
+                if (!mapprevOutScriptPubKeys.count(tx.vin[i].prevout))
+                    continue;
+
+                const CScript& scriptPubKey = mapprevOutScriptPubKeys[tx.vin[i].prevout];
+
+                BOOST_CHECK(SetSigVerifyBackend(SIGVERIFY_OPENSSL));
+                bool fOpenSSL = VerifyScript(tx.vin[i].scriptSig, scriptPubKey, tx, i, 0);
+                BOOST_CHECK(SetSigVerifyBackend(SIGVERIFY_SECP256K1));
+                bool fSecp256k1 = VerifyScript(tx.vin[i].scriptSig, scriptPubKey, tx, i, 0);
+
+                BOOST_CHECK_MESSAGE(fOpenSSL == fSecp256k1, strprintf("input %u of ", i) + strTest);
+            }
+        }
+    }
+
+    SetSigVerifyBackend(backendOrig);
+    mapArgs["-maxsigcachesize"] = strSigCacheOrig;
+}
+#endif
+
 BOOST_AUTO_TEST_CASE(basic_transaction_tests)
 {
     // Random real transaction (e2769b09e784f32f62ef849763d4f45b98e07ba658647343b915ff832b110436)
@@ -0,0 +1,44 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "wallet.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(wallet_coinindex_tests)
+
+BOOST_AUTO_TEST_CASE(coin_index_tests)
+{
+    CWallet keystore;
+    CKey key;
+    key.MakeNewKey(true);
+    keystore.AddKey(key);
+
+    CTransaction tx;
+    tx.vout.resize(2);
+    tx.vout[0].nValue = 3 * COIN;
+    tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    tx.vout[1].nValue = 5 * COIN;
+    tx.vout[1].scriptPubKey = CScript() << OP_TRUE;
+
+    CWalletTx& wtx = keystore.mapWallet.emplace(std::make_pair(tx.GetHash(), CWalletTx(&keystore, tx))).first->second;
+    keystore.UpdateCoinIndex(wtx);
+
+    // Unconfirmed and not from us, only our output counts
+    BOOST_CHECK_EQUAL(keystore.setUnspentTxs.size(), 1U);
+    BOOST_CHECK_EQUAL(keystore.GetBalance(), 0);
+    BOOST_CHECK_EQUAL(keystore.GetUnconfirmedBalance(), 3 * COIN);
+
+    // Spending our output takes it out of the index and the totals follow
+    wtx.MarkSpent(0);
+    keystore.UpdateCoinIndex(wtx);
+    BOOST_CHECK(keystore.setUnspentTxs.empty());
+    BOOST_CHECK_EQUAL(keystore.GetUnconfirmedBalance(), 0);
+
+    wtx.MarkUnspent(0);
+    keystore.RebuildCoinIndex();
+    BOOST_CHECK_EQUAL(keystore.setUnspentTxs.size(), 1U);
+    BOOST_CHECK_EQUAL(keystore.GetUnconfirmedBalance(), 3 * COIN);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
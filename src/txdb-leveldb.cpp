@@ -9,13 +9,18 @@
 #include <boost/version.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 #include <leveldb/env.h>
 #include <leveldb/cache.h>
 #include <leveldb/filter_policy.h>
 #include <memenv/memenv.h>
 #include <chrono>
+#include <functional>
+#include <boost/thread.hpp>
 
 #include "backtrace.h"
+#include "checkqueue.h"
 #include "collectionhashing.h"
 #include "robinhood.h"
 #include "kernel.h"
@@ -33,6 +38,128 @@ extern std::atomic<bool> fRequestShutdown;
 
 leveldb::DB *txdb; // global pointer for LevelDB object instance
 
+// Block index snapshot, written on clean shutdown and consumed on the next start
+static const char* BLOCKINDEX_SNAPSHOT_FILENAME = "blkindex.snapshot";
+static const char BLOCKINDEX_SNAPSHOT_MAGIC[8] = { 'N', 'T', 'R', 'N', 'B', 'I', 'D', 'X' };
+static const uint32_t BLOCKINDEX_SNAPSHOT_VERSION = 1;
+static const int32_t BLOCKINDEX_SNAPSHOT_NULL = -1;
+
+struct CBlockIndexSnapshotHeader
+{
+    char pchMagic[8];
+    uint32_t nVersion;
+    uint32_t nCount;
+    uint256 hashBestChain;
+};
+
+// Flat, fixed-size image of a CBlockIndex. Records are stored in height order
+// and reference each other by position, so the file can be mapped and decoded
+// in place. The layout is native to the machine that wrote it.
+struct CBlockIndexSnapshotRecord
+{
+    uint256 hashBlock;
+    uint256 hashProof;
+    uint256 hashMerkleRoot;
+    uint256 hashPrevoutStake;
+    int64_t nMint;
+    int64_t nMoneySupply;
+    uint64_t nStakeModifier;
+    int32_t nPrev;
+    int32_t nNext;
+    uint32_t nFile;
+    uint32_t nBlockPos;
+    int32_t nHeight;
+    uint32_t nFlags;
+    uint32_t nPrevoutStakeIndex;
+    uint32_t nStakeTime;
+    int32_t nVersion;
+    uint32_t nTime;
+    uint32_t nBits;
+    uint32_t nNonce;
+};
+
+static_assert(sizeof(CBlockIndexSnapshotRecord) == 200, "unexpected padding in CBlockIndexSnapshotRecord");
+
+// A contiguous range of block index entries, run as one job on the load queue
+class CBlockIndexRangeCheck
+{
+private:
+    const std::function<void(size_t)>* pfn;
+    size_t nBegin;
+    size_t nEnd;
+
+public:
+    CBlockIndexRangeCheck() : pfn(NULL), nBegin(0), nEnd(0) {}
+    CBlockIndexRangeCheck(const std::function<void(size_t)>* pfnIn, size_t nBeginIn, size_t nEndIn) :
+        pfn(pfnIn), nBegin(nBeginIn), nEnd(nEndIn) {}
+
+    bool operator()()
+    {
+        for (size_t i = nBegin; i < nEnd; i++)
+            (*pfn)(i);
+
+        return true;
+    }
+
+    void swap(CBlockIndexRangeCheck& check)
+    {
+        std::swap(pfn, check.pfn);
+        std::swap(nBegin, check.nBegin);
+        std::swap(nEnd, check.nEnd);
+    }
+};
+
+// Worker threads for the block index load, kept for the whole load and
+// stopped when it goes out of scope. The loading thread joins in on every
+// ParallelFor, so one thread less than there are cores is started.
+class CBlockIndexWorkers
+{
+private:
+    CCheckQueue<CBlockIndexRangeCheck> queue;
+    boost::thread_group threadGroup;
+    int nThreads;
+
+public:
+    CBlockIndexWorkers() : queue(1)
+    {
+        nThreads = std::max(1, (int)boost::thread::hardware_concurrency());
+
+        for (int i = 1; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&CCheckQueue<CBlockIndexRangeCheck>::Thread, &queue));
+    }
+
+    ~CBlockIndexWorkers()
+    {
+        queue.Quit();
+        threadGroup.join_all();
+    }
+
+    // Runs fn(i) for every i in [0, nCount). Small inputs are handled on the calling thread.
+    void ParallelFor(size_t nCount, const std::function<void(size_t)>& fn)
+    {
+        static const size_t MIN_ITEMS_PER_RANGE = 1024;
+
+        if (nThreads <= 1 || nCount < 2 * MIN_ITEMS_PER_RANGE)
+        {
+            for (size_t i = 0; i < nCount; i++)
+                fn(i);
+
+            return;
+        }
+
+        // A few ranges per thread, so threads finishing early can pick up more work
+        size_t nRange = std::max(MIN_ITEMS_PER_RANGE, nCount / (nThreads * 4));
+        vector<CBlockIndexRangeCheck> vChecks;
+
+        for (size_t nBegin = 0; nBegin < nCount; nBegin += nRange)
+            vChecks.push_back(CBlockIndexRangeCheck(&fn, nBegin, std::min(nCount, nBegin + nRange)));
+
+        CCheckQueueControl<CBlockIndexRangeCheck> control(&queue);
+        control.Add(vChecks);
+        control.Wait();
+    }
+};
+
 static leveldb::Options GetOptions() {
     leveldb::Options options;
     int nCacheSizeMB = GetArg("-dbcache", 64);
@@ -139,6 +266,11 @@ CTxDB::CTxDB(const char* pszMode)
 
 void CTxDB::Close()
 {
+    {
+        LOCK(cs_main);
+        WriteBlockIndexSnapshot();
+    }
+
     // Free these, otherwise we get memory leaks on shutdown
     for (auto i : mapBlockIndex)
         delete i.second;
@@ -154,12 +286,14 @@ void CTxDB::Close()
 
     delete activeBatch;
     activeBatch = NULL;
+    batchOverlay.clear();
 }
 
 bool CTxDB::TxnBegin()
 {
     assert(!activeBatch);
     activeBatch = new leveldb::WriteBatch();
+    batchOverlay.clear();
     return true;
 }
 
@@ -170,6 +304,7 @@ bool CTxDB::TxnCommit()
     delete activeBatch;
 
     activeBatch = NULL;
+    batchOverlay.clear();
 
     if (!status.ok())
     {
@@ -180,56 +315,26 @@ bool CTxDB::TxnCommit()
     return true;
 }
 
-class CBatchScanner : public leveldb::WriteBatch::Handler
-{
-public:
-    std::string needle;
-    bool *deleted;
-    std::string *foundValue;
-    bool foundEntry;
-
-    CBatchScanner() : foundEntry(false) {}
-
-    virtual void Put(const leveldb::Slice& key, const leveldb::Slice& value)
-    {
-        if (key.ToString() == needle)
-        {
-            foundEntry = true;
-            *deleted = false;
-            *foundValue = value.ToString();
-        }
-    }
-
-    virtual void Delete(const leveldb::Slice& key)
-    {
-        if (key.ToString() == needle)
-        {
-            foundEntry = true;
-            *deleted = true;
-        }
-    }
-};
-
 // When performing a read, if we have an active batch we need to check it first
 // before reading from the database, as the rest of the code assumes that once
-// a database transaction begins reads are consistent with it. It would be good
-// to change that assumption in future and avoid the performance hit, though in
-// practice it does not appear to be large.
+// a database transaction begins reads are consistent with it. The batch itself
+// can only be iterated, so lookups go through the hashed overlay kept next to it.
 
 bool CTxDB::ScanBatch(const CDataStream &key, string *value, bool *deleted) const
 {
     assert(activeBatch);
     *deleted = false;
-    CBatchScanner scanner;
-    scanner.needle = key.str();
-    scanner.deleted = deleted;
-    scanner.foundValue = value;
-    leveldb::Status status = activeBatch->Iterate(&scanner);
+    auto it = batchOverlay.find(key.str());
 
-    if (!status.ok())
-        throw runtime_error(status.ToString());
+    if (it == batchOverlay.end())
+        return false;
 
-    return scanner.foundEntry;
+    if (it->second.fDeleted)
+        *deleted = true;
+    else
+        *value = it->second.strValue;
+
+    return true;
 }
 
 bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
@@ -364,19 +469,260 @@ static CBlockIndex *InsertBlockIndex(uint256 hash)
     return pindexNew;
 }
 
-bool CTxDB::LoadBlockIndex()
+static void ResetBlockIndex()
+{
+    for (auto& item : mapBlockIndex)
+        delete item.second;
+
+    mapBlockIndex.clear();
+    setStakeSeen.clear();
+    pindexGenesisBlock = NULL;
+}
+
+bool CTxDB::WriteBlockIndexSnapshot()
 {
+    if (pindexBest == NULL || mapBlockIndex.empty())
+        return false;
+
     auto start = high_resolution_clock::now();
+    vector<CBlockIndex*> vIndex;
+    vIndex.reserve(mapBlockIndex.size());
 
-    if (mapBlockIndex.size() > 0)
+    for (auto& item : mapBlockIndex)
+        vIndex.push_back(item.second);
+
+    // Height order guarantees that a record's predecessor is always decoded first
+    sort(vIndex.begin(), vIndex.end(), [](const CBlockIndex* a, const CBlockIndex* b) {
+        return a->nHeight < b->nHeight;
+    });
+
+    robin_hood::unordered_flat_map<const CBlockIndex*, int32_t> mapPosition;
+    mapPosition.reserve(vIndex.size());
+
+    for (size_t i = 0; i < vIndex.size(); i++)
+        mapPosition[vIndex[i]] = i;
+
+    auto position = [&mapPosition](const CBlockIndex* pindex) -> int32_t {
+        if (pindex == NULL)
+            return BLOCKINDEX_SNAPSHOT_NULL;
+
+        auto mi = mapPosition.find(pindex);
+        return mi == mapPosition.end() ? BLOCKINDEX_SNAPSHOT_NULL : mi->second;
+    };
+
+    vector<CBlockIndexSnapshotRecord> vRecords(vIndex.size());
+
+    for (size_t i = 0; i < vIndex.size(); i++)
     {
-        // Already loaded once in this session. It can happen during migration from BDB
-        return true;
+        const CBlockIndex* pindex = vIndex[i];
+        CBlockIndexSnapshotRecord& record = vRecords[i];
+
+        record.hashBlock          = pindex->GetBlockHash();
+        record.hashProof          = pindex->hashProof;
+        record.hashMerkleRoot     = pindex->hashMerkleRoot;
+        record.hashPrevoutStake   = pindex->prevoutStake.hash;
+        record.nMint              = pindex->nMint;
+        record.nMoneySupply       = pindex->nMoneySupply;
+        record.nStakeModifier     = pindex->nStakeModifier;
+        record.nPrev              = position(pindex->pprev);
+        record.nNext              = position(pindex->pnext);
+        record.nFile              = pindex->nFile;
+        record.nBlockPos          = pindex->nBlockPos;
+        record.nHeight            = pindex->nHeight;
+        record.nFlags             = pindex->nFlags;
+        record.nPrevoutStakeIndex = pindex->prevoutStake.n;
+        record.nStakeTime         = pindex->nStakeTime;
+        record.nVersion           = pindex->nVersion;
+        record.nTime              = pindex->nTime;
+        record.nBits              = pindex->nBits;
+        record.nNonce             = pindex->nNonce;
     }
 
-    // The block index is an in-memory structure that maps hashes to on-disk
-    // locations where the contents of the block can be found. Here, we scan it
-    // out of the DB and into mapBlockIndex.
+    CBlockIndexSnapshotHeader header;
+    memcpy(header.pchMagic, BLOCKINDEX_SNAPSHOT_MAGIC, sizeof(header.pchMagic));
+    header.nVersion = BLOCKINDEX_SNAPSHOT_VERSION;
+    header.nCount = vRecords.size();
+    header.hashBestChain = pindexBest->GetBlockHash();
+
+    filesystem::path pathSnapshot = GetDataDir() / BLOCKINDEX_SNAPSHOT_FILENAME;
+    filesystem::path pathTmp = pathSnapshot;
+    pathTmp += ".new";
+
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+
+    if (!file)
+        return error("%s : open failed", __func__);
+
+    bool fWritten = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                    fwrite(vRecords.data(), sizeof(CBlockIndexSnapshotRecord), vRecords.size(), file) == vRecords.size();
+
+    FileCommit(file);
+    fclose(file);
+
+    if (!fWritten)
+    {
+        filesystem::remove(pathTmp);
+        return error("%s : write failed", __func__);
+    }
+
+    if (!RenameOver(pathTmp, pathSnapshot))
+        return error("%s : rename-into-place failed", __func__);
+
+    auto duration = duration_cast<milliseconds>(high_resolution_clock::now() - start);
+    LogPrintf("%s : wrote %u entries in %ld ms\n", __func__, vRecords.size(), duration.count());
+    return true;
+}
+
+// Loads the block index from the snapshot left by the last clean shutdown. The
+// snapshot is only trusted if it was taken at the tip LevelDB still points at,
+// and it is removed once consumed so that a later unclean shutdown can never
+// bring back an outdated copy.
+bool CTxDB::LoadBlockIndexSnapshot(vector<CBlockIndex*>& vSortedByHeight, CBlockIndexWorkers& workers)
+{
+    namespace ip = boost::interprocess;
+    filesystem::path pathSnapshot = GetDataDir() / BLOCKINDEX_SNAPSHOT_FILENAME;
+
+    if (!filesystem::exists(pathSnapshot))
+        return false;
+
+    auto start = high_resolution_clock::now();
+    uint256 hashTip;
+    bool fLoaded = false;
+
+    try
+    {
+        ip::file_mapping mapping(pathSnapshot.string().c_str(), ip::read_only);
+        ip::mapped_region region(mapping, ip::read_only);
+
+        const char* pbegin = static_cast<const char*>(region.get_address());
+        size_t nSize = region.get_size();
+
+        CBlockIndexSnapshotHeader header;
+
+        if (nSize < sizeof(header))
+            throw runtime_error("truncated header");
+
+        memcpy(&header, pbegin, sizeof(header));
+
+        if (memcmp(header.pchMagic, BLOCKINDEX_SNAPSHOT_MAGIC, sizeof(header.pchMagic)) != 0 ||
+            header.nVersion != BLOCKINDEX_SNAPSHOT_VERSION)
+        {
+            throw runtime_error("unknown format");
+        }
+
+        if (nSize != sizeof(header) + (size_t) header.nCount * sizeof(CBlockIndexSnapshotRecord))
+            throw runtime_error("size mismatch");
+
+        if (!ReadHashBestChain(hashTip) || hashTip != header.hashBestChain)
+            throw runtime_error("stale, best chain has moved");
+
+        const CBlockIndexSnapshotRecord* records = reinterpret_cast<const CBlockIndexSnapshotRecord*>(pbegin + sizeof(header));
+        const size_t nCount = header.nCount;
+        vector<CBlockIndex*> vIndex(nCount);
+        std::atomic<bool> fLinksValid(true);
+
+        workers.ParallelFor(nCount, [&](size_t i) {
+            CBlockIndexSnapshotRecord record;
+            memcpy(&record, &records[i], sizeof(record));
+
+            if (record.nPrev >= (int32_t) i || record.nNext >= (int32_t) nCount ||
+                record.nPrev < BLOCKINDEX_SNAPSHOT_NULL || record.nNext < BLOCKINDEX_SNAPSHOT_NULL)
+            {
+                fLinksValid = false;
+            }
+
+            CBlockIndex* pindexNew    = new CBlockIndex();
+            pindexNew->nFile          = record.nFile;
+            pindexNew->nBlockPos      = record.nBlockPos;
+            pindexNew->nHeight        = record.nHeight;
+            pindexNew->nMint          = record.nMint;
+            pindexNew->nMoneySupply   = record.nMoneySupply;
+            pindexNew->nFlags         = record.nFlags;
+            pindexNew->nStakeModifier = record.nStakeModifier;
+            pindexNew->prevoutStake   = COutPoint(record.hashPrevoutStake, record.nPrevoutStakeIndex);
+            pindexNew->nStakeTime     = record.nStakeTime;
+            pindexNew->hashProof      = record.hashProof;
+            pindexNew->nVersion       = record.nVersion;
+            pindexNew->hashMerkleRoot = record.hashMerkleRoot;
+            pindexNew->nTime          = record.nTime;
+            pindexNew->nBits          = record.nBits;
+            pindexNew->nNonce         = record.nNonce;
+            vIndex[i] = pindexNew;
+        });
+
+        if (!fLinksValid)
+        {
+            for (CBlockIndex* pindex : vIndex)
+                delete pindex;
+
+            throw runtime_error("corrupt links");
+        }
+
+        uint256 hashGenesis = (!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet);
+        mapBlockIndex.reserve(nCount);
+
+        for (size_t i = 0; i < nCount; i++)
+        {
+            CBlockIndex* pindexNew = vIndex[i];
+            auto inserted = mapBlockIndex.emplace(records[i].hashBlock, pindexNew);
+
+            if (!inserted.second)
+            {
+                for (size_t j = i; j < nCount; j++)
+                    delete vIndex[j];
+
+                ResetBlockIndex();
+                throw runtime_error("duplicate entry");
+            }
+
+            pindexNew->phashBlock = &inserted.first->first;
+            pindexNew->pprev = records[i].nPrev == BLOCKINDEX_SNAPSHOT_NULL ? NULL : vIndex[records[i].nPrev];
+            pindexNew->pnext = records[i].nNext == BLOCKINDEX_SNAPSHOT_NULL ? NULL : vIndex[records[i].nNext];
+
+            if (pindexGenesisBlock == NULL && records[i].hashBlock == hashGenesis)
+                pindexGenesisBlock = pindexNew;
+
+            if (pindexNew->IsProofOfStake())
+                setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+        }
+
+        std::atomic<bool> fIndexValid(true);
+
+        workers.ParallelFor(nCount, [&](size_t i) {
+            if (!vIndex[i]->CheckIndex())
+                fIndexValid = false;
+        });
+
+        if (!fIndexValid)
+        {
+            ResetBlockIndex();
+            throw runtime_error("CheckIndex failed");
+        }
+
+        vSortedByHeight.swap(vIndex);
+        fLoaded = true;
+    }
+    catch (const std::exception& e)
+    {
+        LogPrintf("%s : ignoring block index snapshot: %s\n", __func__, e.what());
+    }
+
+    filesystem::remove(pathSnapshot);
+
+    if (fLoaded)
+    {
+        auto duration = duration_cast<milliseconds>(high_resolution_clock::now() - start);
+        LogPrintf("%s : loaded %u entries in %ld ms\n", __func__, vSortedByHeight.size(), duration.count());
+    }
+
+    return fLoaded;
+}
+
+// Scans the block index out of LevelDB. Values are read in batches and decoded
+// on all cores, only the linking into mapBlockIndex is done on this thread.
+bool CTxDB::LoadBlockIndexGuts(vector<CBlockIndex*>& vSortedByHeight, CBlockIndexWorkers& workers)
+{
+    static const size_t BATCH_SIZE = 16384;
     leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
 
     // Seek to start key.
@@ -384,59 +730,106 @@ bool CTxDB::LoadBlockIndex()
     ssStartKey << make_pair(string("blockindex"), uint256(0));
     iterator->Seek(ssStartKey.str());
 
-    // Now read each entry.
-    while (iterator->Valid())
+    CDataStream ssKeyPrefix(SER_DISK, CLIENT_VERSION);
+    ssKeyPrefix << string("blockindex");
+    const string strKeyPrefix = ssKeyPrefix.str();
+
+    uint256 hashGenesis = (!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet);
+    vector<CDataStream> vValues;
+    vector<CDiskBlockIndex> vDiskIndex;
+    vector<uint256> vHash;
+    vector<CBlockIndex*> vBatch;
+    vValues.reserve(BATCH_SIZE);
+
+    bool fDone = false;
+
+    while (!fDone)
     {
-        // Unpack keys and values.
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.write(iterator->key().data(), iterator->key().size());
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        ssValue.write(iterator->value().data(), iterator->value().size());
-        string strType;
-        ssKey >> strType;
+        vValues.clear();
 
         // Did we reach the end of the data to read?
-        if (fRequestShutdown || strType != "blockindex")
-            break;
+        while (vValues.size() < BATCH_SIZE && iterator->Valid() && !fRequestShutdown &&
+               iterator->key().starts_with(strKeyPrefix))
+        {
+            const leveldb::Slice value = iterator->value();
+            vValues.emplace_back(value.data(), value.data() + value.size(), SER_DISK, CLIENT_VERSION);
+            iterator->Next();
+        }
+
+        fDone = vValues.size() < BATCH_SIZE;
+
+        // Unpack values and compute their block hashes
+        vDiskIndex.assign(vValues.size(), CDiskBlockIndex());
+        vHash.resize(vValues.size());
+        std::atomic<bool> fDecoded(true);
 
-        CDiskBlockIndex diskindex;
-        ssValue >> diskindex;
-        uint256 blockHash = diskindex.GetBlockHash();
-
-        // Construct block index object
-        CBlockIndex* pindexNew    = InsertBlockIndex(blockHash);
-        pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-        pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
-        pindexNew->nFile          = diskindex.nFile;
-        pindexNew->nBlockPos      = diskindex.nBlockPos;
-        pindexNew->nHeight        = diskindex.nHeight;
-        pindexNew->nMint          = diskindex.nMint;
-        pindexNew->nMoneySupply   = diskindex.nMoneySupply;
-        pindexNew->nFlags         = diskindex.nFlags;
-        pindexNew->nStakeModifier = diskindex.nStakeModifier;
-        pindexNew->prevoutStake   = diskindex.prevoutStake;
-        pindexNew->nStakeTime     = diskindex.nStakeTime;
-        pindexNew->hashProof      = diskindex.hashProof;
-        pindexNew->nVersion       = diskindex.nVersion;
-        pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-        pindexNew->nTime          = diskindex.nTime;
-        pindexNew->nBits          = diskindex.nBits;
-        pindexNew->nNonce         = diskindex.nNonce;
-
-        // Watch for genesis block
-        if (pindexGenesisBlock == NULL && blockHash == (!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet))
-            pindexGenesisBlock = pindexNew;
-
-        if (!pindexNew->CheckIndex())
+        workers.ParallelFor(vValues.size(), [&](size_t i) {
+            try
+            {
+                vValues[i] >> vDiskIndex[i];
+                vHash[i] = vDiskIndex[i].GetBlockHash();
+            }
+            catch (const std::exception& e)
+            {
+                fDecoded = false;
+            }
+        });
+
+        if (!fDecoded)
         {
             delete iterator;
-            return error("%s : CheckIndex failed at %d", __func__, pindexNew->nHeight);
+            return error("%s : failed to deserialize block index entry", __func__);
+        }
+
+        vBatch.resize(vDiskIndex.size());
+
+        for (size_t i = 0; i < vDiskIndex.size(); i++)
+        {
+            const CDiskBlockIndex& diskindex = vDiskIndex[i];
+            const uint256& blockHash = vHash[i];
+
+            // Construct block index object
+            CBlockIndex* pindexNew    = InsertBlockIndex(blockHash);
+            pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+            pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
+            pindexNew->nFile          = diskindex.nFile;
+            pindexNew->nBlockPos      = diskindex.nBlockPos;
+            pindexNew->nHeight        = diskindex.nHeight;
+            pindexNew->nMint          = diskindex.nMint;
+            pindexNew->nMoneySupply   = diskindex.nMoneySupply;
+            pindexNew->nFlags         = diskindex.nFlags;
+            pindexNew->nStakeModifier = diskindex.nStakeModifier;
+            pindexNew->prevoutStake   = diskindex.prevoutStake;
+            pindexNew->nStakeTime     = diskindex.nStakeTime;
+            pindexNew->hashProof      = diskindex.hashProof;
+            pindexNew->nVersion       = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->nTime          = diskindex.nTime;
+            pindexNew->nBits          = diskindex.nBits;
+            pindexNew->nNonce         = diskindex.nNonce;
+
+            // Watch for genesis block
+            if (pindexGenesisBlock == NULL && blockHash == hashGenesis)
+                pindexGenesisBlock = pindexNew;
+
+            if (pindexNew->IsProofOfStake())
+                setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+
+            vBatch[i] = pindexNew;
         }
 
-        if (pindexNew->IsProofOfStake())
-            setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+        std::atomic<int> nFailedHeight(-1);
 
-        iterator->Next();
+        workers.ParallelFor(vBatch.size(), [&](size_t i) {
+            if (!vBatch[i]->CheckIndex())
+                nFailedHeight = vBatch[i]->nHeight;
+        });
+
+        if (nFailedHeight != -1)
+        {
+            delete iterator;
+            return error("%s : CheckIndex failed at %d", __func__, nFailedHeight.load());
+        }
     }
 
     delete iterator;
@@ -444,21 +837,47 @@ bool CTxDB::LoadBlockIndex()
     if (fRequestShutdown)
         return true;
 
-    // Calculate nChainTrust
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
+    vSortedByHeight.clear();
     vSortedByHeight.reserve(mapBlockIndex.size());
 
     for (auto& item : mapBlockIndex)
+        vSortedByHeight.push_back(item.second);
+
+    sort(vSortedByHeight.begin(), vSortedByHeight.end(), [](const CBlockIndex* a, const CBlockIndex* b) {
+        return a->nHeight < b->nHeight;
+    });
+
+    return true;
+}
+
+bool CTxDB::LoadBlockIndex()
+{
+    auto start = high_resolution_clock::now();
+
+    if (mapBlockIndex.size() > 0)
     {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
+        // Already loaded once in this session. It can happen during migration from BDB
+        return true;
+    }
+
+    // The block index is an in-memory structure that maps hashes to on-disk
+    // locations where the contents of the block can be found. It comes from the
+    // shutdown snapshot when that is still current, otherwise from LevelDB.
+    vector<CBlockIndex*> vSortedByHeight;
+
+    {
+        CBlockIndexWorkers workers;
+
+        if (!LoadBlockIndexSnapshot(vSortedByHeight, workers) && !LoadBlockIndexGuts(vSortedByHeight, workers))
+            return false;
     }
 
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
+    if (fRequestShutdown)
+        return true;
 
-    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+    // Calculate nChainTrust
+    BOOST_FOREACH(CBlockIndex* pindex, vSortedByHeight)
     {
-        CBlockIndex* pindex = item.second;
         pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->GetBlockTrust();
         pindex->nStakeModifierChecksum = GetStakeModifierChecksum(pindex);
 
@@ -482,6 +901,7 @@ bool CTxDB::LoadBlockIndex()
         return error("%s : hashBestChain not found in the block index", __func__);
 
     pindexBest = mapBlockIndex[hashBestChain];
+    chainActive.SetTip(pindexBest);
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexBest->nChainTrust;
 
@@ -490,6 +910,8 @@ bool CTxDB::LoadBlockIndex()
               nBestHeight, CBigNum(nBestChainTrust).ToString().c_str(),
               DateTimeStrFormat("%x %H:%M:%S", pindexBest->GetBlockTime()).c_str());
 
+    LoadKernelStakeModifierCache();
+
     if (!ReadSyncCheckpoint(Checkpoints::hashSyncCheckpoint))
         return error("%s : hashSyncCheckpoint not loaded", __func__);
 
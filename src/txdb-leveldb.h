@@ -7,6 +7,7 @@
 #define BITCOIN_LEVELDB_H
 
 #include "main.h"
+#include "robinhood.h"
 #include "streams.h"
 
 #include <map>
@@ -16,6 +17,8 @@
 #include <leveldb/db.h>
 #include <leveldb/write_batch.h>
 
+class CBlockIndexWorkers;
+
 // Class that provides access to a LevelDB. Note that this class is frequently
 // instantiated on the stack and then destroyed again, so instantiation has to
 // be very cheap. Unfortunately that means, a CTxDB instance is actually just a
@@ -36,6 +39,7 @@ public:
         // Note that this is not the same as Close() because it deletes only
         // data scoped to this TxDB object.
         delete activeBatch;
+        batchOverlay.clear();
     }
 
     // Destroys the underlying shared global state accessed by this TxDB.
@@ -47,6 +51,19 @@ private:
     // A batch stores up writes and deletes for atomic application. When this
     // field is non-NULL, writes/deletes go there instead of directly to disk.
     leveldb::WriteBatch *activeBatch;
+
+    // Pending batch entry as seen by reads inside the transaction. The last
+    // put or delete for a key wins, exactly as when the batch is applied.
+    struct CBatchEntry
+    {
+        bool fDeleted;
+        std::string strValue;
+    };
+
+    // Hashed mirror of activeBatch, keyed by serialized key. It lets reads
+    // inside a transaction find pending changes without iterating the batch.
+    robin_hood::unordered_node_map<std::string, CBatchEntry> batchOverlay;
+
     leveldb::Options options;
     bool fReadOnly;
     int nVersion;
@@ -112,7 +129,10 @@ protected:
         ssValue << value;
 
         if (activeBatch) {
-            activeBatch->Put(ssKey.str(), ssValue.str());
+            CBatchEntry& entry = batchOverlay[ssKey.str()];
+            entry.fDeleted = false;
+            entry.strValue = ssValue.str();
+            activeBatch->Put(ssKey.str(), entry.strValue);
             return true;
         }
         leveldb::Status status = pdb->Put(leveldb::WriteOptions(), ssKey.str(), ssValue.str());
@@ -135,6 +155,9 @@ protected:
         ssKey.reserve(1000);
         ssKey << key;
         if (activeBatch) {
+            CBatchEntry& entry = batchOverlay[ssKey.str()];
+            entry.fDeleted = true;
+            entry.strValue.clear();
             activeBatch->Delete(ssKey.str());
             return true;
         }
@@ -152,9 +175,8 @@ protected:
 
         if (activeBatch) {
             bool deleted;
-            if (ScanBatch(ssKey, &unused, &deleted) && !deleted) {
-                return true;
-            }
+            if (ScanBatch(ssKey, &unused, &deleted))
+                return !deleted;
         }
 
 
@@ -170,6 +192,7 @@ public:
     {
         delete activeBatch;
         activeBatch = NULL;
+        batchOverlay.clear();
         return true;
     }
 
@@ -203,8 +226,10 @@ public:
     bool ReadCheckpointPubKey(std::string& strPubKey);
     bool WriteCheckpointPubKey(const std::string& strPubKey);
     bool LoadBlockIndex();
+    bool WriteBlockIndexSnapshot();
 private:
-    bool LoadBlockIndexGuts();
+    bool LoadBlockIndexGuts(std::vector<CBlockIndex*>& vSortedByHeight, CBlockIndexWorkers& workers);
+    bool LoadBlockIndexSnapshot(std::vector<CBlockIndex*>& vSortedByHeight, CBlockIndexWorkers& workers);
 };
 
 
@@ -12,15 +12,8 @@
 #include "txdb.h"
 // class CTxDB;
 
-// erases transaction with the given hash from all wallets
-void static EraseFromWallets(uint256 hash)
-{
-    BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
-        pwallet->EraseFromWallet(hash);
-}
-
 // check whether the passed transaction is from us
-bool static IsFromMe(CTransaction& tx)
+bool static IsFromMe(const CTransaction& tx)
 {
     BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
         if (pwallet->IsFromMe(tx))
@@ -34,6 +27,12 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
     if (pfMissingInputs)
         *pfMissingInputs = false;
 
+    // Acceptance is staged so that only the last step is serialised. The
+    // context-free checks and the signature checks take no locks, so that
+    // transactions arriving on different message handler threads are
+    // verified side by side. The inputs are fetched under cs_main, and the
+    // final conflict checks and the insert happen under cs_main and cs.
+
     if (!tx.CheckTransaction())
         return error("CTxMemPool::accept() : CheckTransaction failed");
 
@@ -53,125 +52,112 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
     if (!fTestNet && !tx.IsStandard())
         return error("CTxMemPool::accept() : nonstandard transaction type");
 
-    // Do we already have it?
+    // Do we already have it, or something spending the same inputs?
     uint256 hash = tx.GetHash();
     {
         LOCK(cs);
-        if (mapTx.count(hash))
+        if (mapTx.count(hash) || HasConflicts(tx))
             return false;
     }
-    if (fCheckInputs)
-        if (txdb.ContainsTx(hash))
-            return false;
 
-    // Check for conflicts with in-memory transactions
-    CTransaction* ptxOld = NULL;
-    for (unsigned int i = 0; i < tx.vin.size(); i++)
+    MapPrevTx mapInputs;
+    std::vector<CScriptCheck> vChecks;
+    int64_t nFees = 0;
+    const CBlockIndex* pindexChecked = NULL;
+    unsigned int nRemovalsChecked = 0;
+    int64_t nTimeStart = GetTimeMicros();
+
+    if (fCheckInputs)
     {
-        COutPoint outpoint = tx.vin[i].prevout;
-        if (mapNextTx.count(outpoint))
-        {
-            // Disable replacement feature for now
+        LOCK(cs_main);
+        pindexChecked = pindexBest;
+        nRemovalsChecked = nRemovalsUpdated;
+
+        if (!CheckInputs(txdb, tx, pfMissingInputs, mapInputs, nFees, vChecks))
             return false;
+    }
 
-            // Allow replacing with a newer version of the same transaction
-            if (i != 0)
-                return false;
-            ptxOld = mapNextTx[outpoint].ptx;
-            if (ptxOld->IsFinal())
-                return false;
-            if (!tx.IsNewerThan(*ptxOld))
-                return false;
-            for (unsigned int i = 0; i < tx.vin.size(); i++)
-            {
-                COutPoint outpoint = tx.vin[i].prevout;
-                if (!mapNextTx.count(outpoint) || mapNextTx[outpoint].ptx != ptxOld)
-                    return false;
-            }
-            break;
-        }
+    int64_t nTimeInputs = GetTimeMicros();
+
+    // The expensive part, with no locks held
+    BOOST_FOREACH(const CScriptCheck& check, vChecks)
+    {
+        if (!check())
+            return tx.DoS(100, error("CTxMemPool::accept() : VerifySignature failed %s", hash.ToString().substr(0,10).c_str()));
     }
 
-    if (fCheckInputs)
+    int64_t nTimeVerify = GetTimeMicros();
+
+    unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+
+    // Store transaction in memory
     {
-        MapPrevTx mapInputs;
-        map<uint256, CTxIndex> mapUnused;
-        bool fInvalid = false;
-        if (!tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid))
-        {
-            if (fInvalid)
-                return error("CTxMemPool::accept() : FetchInputs found invalid tx %s", hash.ToString().substr(0,10).c_str());
-            if (pfMissingInputs)
-                *pfMissingInputs = true;
+        LOCK2(cs_main, cs);
+
+        // Another thread may have got there first
+        if (mapTx.count(hash) || HasConflicts(tx))
             return false;
-        }
 
-        // Check for non-standard pay-to-script-hash in inputs
-        if (!tx.AreInputsStandard(mapInputs) && !fTestNet)
-            return error("CTxMemPool::accept() : nonstandard transaction input");
+        // If the chain or the pool lost something since the inputs were
+        // fetched, check them again. The signatures only depend on the
+        // previous transactions themselves, so those checks stand.
+        if (fCheckInputs && (pindexBest != pindexChecked || nRemovalsUpdated != nRemovalsChecked))
+        {
+            std::vector<CScriptCheck> vUnused;
+            mapInputs.clear();
 
-        // Note: if you modify this code to accept non-standard transactions, then
-        // you should add code here to check that the transaction does a
-        // reasonable number of ECDSA signature verifications.
+            if (!CheckInputs(txdb, tx, pfMissingInputs, mapInputs, nFees, vUnused))
+                return false;
+        }
 
-        int64_t nFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
-        unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+        size_t nSizeLimit = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
 
-        // Don't accept it if it can't get into a block
-        int64_t txMinFee = tx.GetMinFee(1000, GMF_RELAY, nSize);
-        if (nFees < txMinFee)
-            return error("CTxMemPool::accept() : not enough fees %s, %d < %d",
-                         hash.ToString().c_str(),
-                         nFees, txMinFee);
+        // While the pool is evicting, pay more than what it last let go
+        int64_t nMinFeeRate = GetMinFee(nSizeLimit);
+        if (fCheckInputs && nMinFeeRate > 0 && nFees < nMinFeeRate * (int64_t)nSize / 1000)
+        {
+            LogPrint("mempool", "%s : mempool min fee not met by %s, %d < %d\n", __func__,
+                     hash.ToString().substr(0,10).c_str(), nFees, nMinFeeRate * (int64_t)nSize / 1000);
+            return false;
+        }
 
         // Continuously rate-limit free transactions
         // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
         // be annoying or make others' transactions take longer to confirm.
-        if (nFees < MIN_RELAY_TX_FEE)
+        if (fCheckInputs && nFees < MIN_RELAY_TX_FEE)
         {
-            static CCriticalSection cs;
             static double dFreeCount;
             static int64_t nLastTime;
             int64_t nNow = GetTime();
 
-            {
-                LOCK(cs);
-                // Use an exponentially decaying ~10-minute window:
-                dFreeCount *= pow(1.0 - 1.0/600.0, (double)(nNow - nLastTime));
-                nLastTime = nNow;
-                // -limitfreerelay unit is thousand-bytes-per-minute
-                // At default rate it would take over a month to fill 1GB
-                if (dFreeCount > GetArg("-limitfreerelay", 15)*10*1000 && !IsFromMe(tx))
-                    return error("CTxMemPool::accept() : free transaction rejected by rate limiter");
-                if (fDebug)
-                    LogPrintf("Rate limit dFreeCount: %g => %g\n", dFreeCount, dFreeCount+nSize);
-                dFreeCount += nSize;
-            }
+            // Use an exponentially decaying ~10-minute window:
+            dFreeCount *= pow(1.0 - 1.0/600.0, (double)(nNow - nLastTime));
+            nLastTime = nNow;
+            // -limitfreerelay unit is thousand-bytes-per-minute
+            // At default rate it would take over a month to fill 1GB
+            if (dFreeCount > GetArg("-limitfreerelay", 15)*10*1000 && !IsFromMe(tx))
+                return error("CTxMemPool::accept() : free transaction rejected by rate limiter");
+            if (fDebug)
+                LogPrintf("Rate limit dFreeCount: %g => %g\n", dFreeCount, dFreeCount+nSize);
+            dFreeCount += nSize;
         }
 
-        // Check against previous transactions
-        // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!tx.ConnectInputs(txdb, mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false))
-        {
-            return error("CTxMemPool::accept() : ConnectInputs failed %s", hash.ToString().substr(0,10).c_str());
-        }
-    }
+        addUnchecked(hash, tx, fCheckInputs ? &mapInputs : NULL);
 
-    // Store transaction in memory
-    {
-        LOCK(cs);
-        if (ptxOld)
+        // Make room, this may take the new transaction right back out
+        LimitSize(nSizeLimit, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+
+        if (!mapTx.count(hash))
         {
-            LogPrintf("CTxMemPool::accept() : replacing tx %s with new version\n", ptxOld->GetHash().ToString().c_str());
-            remove(*ptxOld);
+            LogPrint("mempool", "%s : mempool full, fee rate of %s too low\n", __func__,
+                     hash.ToString().substr(0,10).c_str());
+            return false;
         }
-        addUnchecked(hash, tx);
     }
 
-    ///// are we sure this is ok when loading transactions or restoring block txes
-    // If updated, erase old tx from wallet
-    if (ptxOld)
-        EraseFromWallets(ptxOld->GetHash());
+    LogPrint("bench", "%s : inputs %.2fms, signatures %.2fms, insert %.2fms (poolsz %u)\n", __func__,
+             (nTimeInputs - nTimeStart) * 0.001, (nTimeVerify - nTimeInputs) * 0.001,
+             (GetTimeMicros() - nTimeVerify) * 0.001, mapTx.size());
 
     LogPrintf("CTxMemPool::accept() : accepted %s (poolsz %u)\n",
            hash.ToString().substr(0,10).c_str(),
@@ -179,15 +165,201 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
     return true;
 }
 
+bool CTxMemPool::HasConflicts(const CTransaction& tx) const
+{
+    // Replacing pool transactions is not supported
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        if (mapNextTx.count(txin.prevout))
+            return true;
+
+    return false;
+}
+
+// Check tx against the chain and the pool, with its script checks put in
+// vChecks instead of being run. Requires cs_main.
+bool CTxMemPool::CheckInputs(CTxDB& txdb, const CTransaction& tx, bool* pfMissingInputs,
+                             MapPrevTx& mapInputs, int64_t& nFees, std::vector<CScriptCheck>& vChecks)
+{
+    uint256 hash = tx.GetHash();
+
+    if (txdb.ContainsTx(hash))
+        return false;
+
+    map<uint256, CTxIndex> mapUnused;
+    bool fInvalid = false;
+    if (!tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid))
+    {
+        if (fInvalid)
+            return error("CTxMemPool::accept() : FetchInputs found invalid tx %s", hash.ToString().substr(0,10).c_str());
+        if (pfMissingInputs)
+            *pfMissingInputs = true;
+        return false;
+    }
+
+    // Check for non-standard pay-to-script-hash in inputs
+    if (!tx.AreInputsStandard(mapInputs) && !fTestNet)
+        return error("CTxMemPool::accept() : nonstandard transaction input");
+
+    // Note: if you modify this code to accept non-standard transactions, then
+    // you should add code here to check that the transaction does a
+    // reasonable number of ECDSA signature verifications.
+
+    nFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
+    unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+
+    // Don't accept it if it can't get into a block
+    int64_t txMinFee = tx.GetMinFee(1000, GMF_RELAY, nSize);
+    if (nFees < txMinFee)
+        return error("CTxMemPool::accept() : not enough fees %s, %d < %d",
+                     hash.ToString().c_str(),
+                     nFees, txMinFee);
+
+    // Check against previous transactions
+    // This is done last to help prevent CPU exhaustion denial-of-service attacks.
+    if (!tx.ConnectInputs(txdb, mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false, NULL, &vChecks))
+    {
+        return error("CTxMemPool::accept() : ConnectInputs failed %s", hash.ToString().substr(0,10).c_str());
+    }
+
+    return true;
+}
+
+
+// Allocated size of a heap block of nAlloc bytes, with the bookkeeping
+// and alignment of the usual 64-bit malloc implementations
+static inline size_t MallocUsage(size_t nAlloc)
+{
+    if (nAlloc == 0)
+        return 0;
+
+    return ((nAlloc + 31) >> 4) << 4;
+}
+
+// A std::map or std::set node holds three pointers and a colour word ahead of the value
+static inline size_t MapNodeUsage(size_t nValue)
+{
+    return MallocUsage(sizeof(void*) * 4 + nValue);
+}
+
+// A robin hood flat map keeps its values inline, with one info byte each,
+// and is grown before it is 80% full, so on average a slot is about half used
+static inline size_t FlatMapSlotUsage(size_t nValue)
+{
+    return (nValue + 1) * 2;
+}
+
+static size_t TransactionUsage(const CTransaction& tx)
+{
+    size_t nUsage = MallocUsage(tx.vin.capacity() * sizeof(CTxIn)) + MallocUsage(tx.vout.capacity() * sizeof(CTxOut));
+
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        nUsage += MallocUsage(txin.scriptSig.capacity()) + MallocUsage(txin.prevPubKey.capacity());
+
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        nUsage += MallocUsage(txout.scriptPubKey.capacity());
+
+    return nUsage;
+}
+
+void CTxMemPool::MakeEntry(const uint256& hash, const CTransaction& tx, const MapPrevTx* pmapInputs,
+                           CTxMemPoolEntry& entry)
+{
+    int64_t nValueIn = 0;
+
+    entry.nSequence = ++nSequence;
+    entry.nTime = GetTime();
+    entry.nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    entry.nHeight = nBestHeight;
+
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        // Inputs still in the pool make the transaction wait for them
+        txmap_t::const_iterator mi = mapTx.find(txin.prevout.hash);
+
+        if (mi != mapTx.end())
+        {
+            const CTransaction& txPrev = *mi->second->tx;
+
+            if (txin.prevout.n < txPrev.vout.size())
+                nValueIn += txPrev.vout[txin.prevout.n].nValue;
+
+            entry.setDependsOn.insert(txin.prevout.hash);
+            continue;
+        }
+
+        // Use the inputs accept() already fetched, read them otherwise
+        CTransaction txPrev;
+        CTxIndex txindex;
+        MapPrevTx::const_iterator it = pmapInputs ? pmapInputs->find(txin.prevout.hash) : MapPrevTx::const_iterator();
 
-bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
+        if (pmapInputs && it != pmapInputs->end())
+        {
+            txindex = it->second.first;
+            txPrev = it->second.second;
+        }
+        else
+        {
+            CTxDB txdb("r");
+
+            if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
+            {
+                LogPrint("mempool", "%s : input %s of %s not found\n", __func__,
+                         txin.prevout.ToString().c_str(), hash.ToString().substr(0,10).c_str());
+                continue;
+            }
+        }
+
+        if (txin.prevout.n >= txPrev.vout.size())
+            continue;
+
+        int64_t nValue = txPrev.vout[txin.prevout.n].nValue;
+        nValueIn += nValue;
+
+        if (txindex.pos == CDiskTxPos(1,1,1))
+            continue;
+
+        entry.nValueInChain += nValue;
+        entry.dPriorityInChain += (double)nValue * txindex.GetDepthInMainChain();
+    }
+
+    entry.nFee = nValueIn - tx.GetValueOut();
+
+    // This is a more accurate fee-per-kilobyte than is used by the client code, because the
+    // client code rounds up the size to the nearest 1K. That's good, because it gives an
+    // incentive to create smaller transactions.
+    entry.dFeePerKb = double(entry.nFee) / (double(entry.nTxSize) / 1000.0);
+}
+
+bool CTxMemPool::addUnchecked(const uint256& hash, const CTransaction &tx, const MapPrevTx* pmapInputs)
 {
     // Add to memory pool without checking anything.  Don't call this directly,
     // call CTxMemPool::accept to properly check the transaction first.
     {
-        mapTx[hash] = tx;
+        LOCK(cs);
+        CTxMemPoolEntry* pentry = arena.Allocate();
+        CTxMemPoolEntry& entry = *pentry;
+        MakeEntry(hash, tx, pmapInputs, entry);
+        entry.tx = std::make_shared<const CTransaction>(tx);
+        entry.nFeesWithDescendants = entry.nFee;
+        entry.nSizeWithDescendants = entry.nTxSize;
+        setByFeeRate.insert(CTxFeeRateKey(entry.dFeePerKb, hash));
+        setByDescendantScore.insert(CTxFeeRateKey(entry.GetDescendantScore(), hash));
+        setByTime.insert(CTxTimeKey(entry.nTime, hash));
+        UpdateAncestors(entry, entry.nFee, entry.nTxSize);
+
+        mapTx[hash] = pentry;
         for (unsigned int i = 0; i < tx.vin.size(); i++)
-            mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
+            mapNextTx[tx.vin[i].prevout] = CInPoint(entry.tx.get(), i);
+
+        // The entry's arena slot and the shared transaction with its control block
+        entry.nUsage = sizeof(CTxMemPoolEntry) + MallocUsage(sizeof(CTransaction) + 2 * sizeof(long)) +
+                       TransactionUsage(*entry.tx) +
+                       FlatMapSlotUsage(sizeof(txmap_t::value_type)) +
+                       tx.vin.size() * FlatMapSlotUsage(sizeof(nexttxmap_t::value_type)) +
+                       entry.setDependsOn.size() * MapNodeUsage(sizeof(uint256)) +
+                       2 * MapNodeUsage(sizeof(CTxFeeRateKey)) + MapNodeUsage(sizeof(CTxTimeKey));
+        nTotalTxSize += entry.nTxSize;
+        nTotalUsage += entry.nUsage;
         nTransactionsUpdated++;
     }
     return true;
@@ -195,27 +367,84 @@ bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
 
 
 bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
+{
+    LOCK(cs);
+    int64_t nTimeStart = GetTimeMicros();
+    unsigned int nSizeBefore = mapTx.size();
+
+    removeUnchecked(tx, fRecursive);
+
+    if (mapTx.size() != nSizeBefore)
+        LogPrint("bench", "%s : %u txs in %.3fms (poolsz %u)\n", __func__,
+                 nSizeBefore - mapTx.size(), (GetTimeMicros() - nTimeStart) * 0.001, mapTx.size());
+
+    return true;
+}
+
+void CTxMemPool::removeUnchecked(const CTransaction &tx, bool fRecursive)
 {
     // Remove transaction from memory pool
     {
-        LOCK(cs);
         uint256 hash = tx.GetHash();
-        if (mapTx.count(hash))
+        txmap_t::iterator mi = mapTx.find(hash);
+        if (mi != mapTx.end())
         {
+            // tx may be the pool's own copy, keep it alive until we are done
+            CTxMemPoolEntry* pentry = mi->second;
+            CTransactionRef ptx = pentry->tx;
+
             if (fRecursive) {
-                for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
+                for (unsigned int i = 0; i < ptx->vout.size(); i++) {
+                    nexttxmap_t::iterator it = mapNextTx.find(COutPoint(hash, i));
                     if (it != mapNextTx.end())
-                        remove(*it->second.ptx, true);
+                        removeUnchecked(*it->second.ptx, true);
                 }
             }
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            BOOST_FOREACH(const CTxIn& txin, ptx->vin)
                     mapNextTx.erase(txin.prevout);
+
+            // Descendants removed above have already taken themselves off
+            // the ancestors, those that stay are no longer counted there
+            UpdateAncestors(*pentry, -pentry->nFeesWithDescendants, -pentry->nSizeWithDescendants);
+
+            setByFeeRate.erase(CTxFeeRateKey(pentry->dFeePerKb, hash));
+            setByDescendantScore.erase(CTxFeeRateKey(pentry->GetDescendantScore(), hash));
+            setByTime.erase(CTxTimeKey(pentry->nTime, hash));
+            nTotalTxSize -= pentry->nTxSize;
+            nTotalUsage -= pentry->nUsage;
+
             mapTx.erase(hash);
+            arena.Free(pentry);
             nTransactionsUpdated++;
+            nRemovalsUpdated++;
         }
     }
-    return true;
+}
+
+// Add to the descendant totals of every pool transaction entry spends,
+// directly or through others
+void CTxMemPool::UpdateAncestors(const CTxMemPoolEntry& entry, int64_t nFeesDelta, int64_t nSizeDelta)
+{
+    std::set<uint256> setDone;
+    std::vector<uint256> vStage(entry.setDependsOn.begin(), entry.setDependsOn.end());
+
+    while (!vStage.empty())
+    {
+        uint256 hash = vStage.back();
+        vStage.pop_back();
+
+        txmap_t::iterator mi = mapTx.find(hash);
+        if (mi == mapTx.end() || !setDone.insert(hash).second)
+            continue;
+
+        CTxMemPoolEntry& ancestor = *mi->second;
+        setByDescendantScore.erase(CTxFeeRateKey(ancestor.GetDescendantScore(), hash));
+        ancestor.nFeesWithDescendants += nFeesDelta;
+        ancestor.nSizeWithDescendants += nSizeDelta;
+        setByDescendantScore.insert(CTxFeeRateKey(ancestor.GetDescendantScore(), hash));
+
+        vStage.insert(vStage.end(), ancestor.setDependsOn.begin(), ancestor.setDependsOn.end());
+    }
 }
 
 bool CTxMemPool::removeConflicts(const CTransaction &tx)
@@ -223,7 +452,7 @@ bool CTxMemPool::removeConflicts(const CTransaction &tx)
     // Remove transactions which depend on inputs of tx, recursively
     LOCK(cs);
     BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-        std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(txin.prevout);
+        nexttxmap_t::iterator it = mapNextTx.find(txin.prevout);
         if (it != mapNextTx.end()) {
             const CTransaction &txConflict = *it->second.ptx;
             if (txConflict != tx)
@@ -236,9 +465,18 @@ bool CTxMemPool::removeConflicts(const CTransaction &tx)
 void CTxMemPool::clear()
 {
     LOCK(cs);
+    for (txmap_t::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+        arena.Free(mi->second);
+    arena.Clear();
     mapTx.clear();
     mapNextTx.clear();
+    setByFeeRate.clear();
+    setByDescendantScore.clear();
+    setByTime.clear();
+    nTotalTxSize = 0;
+    nTotalUsage = 0;
     ++nTransactionsUpdated;
+    ++nRemovalsUpdated;
 }
 
 void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
@@ -247,15 +485,139 @@ void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
 
     LOCK(cs);
     vtxid.reserve(mapTx.size());
-    for (map<uint256, CTransaction>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
-        vtxid.push_back((*mi).first);
+
+    // In order of arrival, the hash map iterates in no useful order
+    BOOST_FOREACH(const CTxTimeKey& key, setByTime)
+        vtxid.push_back(key.second);
+}
+
+void CTxMemPool::CalculateDescendants(const uint256& hash, std::set<uint256>& setDescendants)
+{
+    LOCK(cs);
+    std::vector<uint256> vStage(1, hash);
+
+    while (!vStage.empty())
+    {
+        uint256 hashTx = vStage.back();
+        vStage.pop_back();
+
+        txmap_t::const_iterator mi = mapTx.find(hashTx);
+        if (mi == mapTx.end() || !setDescendants.insert(hashTx).second)
+            continue;
+
+        for (unsigned int i = 0; i < mi->second->tx->vout.size(); i++)
+        {
+            nexttxmap_t::const_iterator it = mapNextTx.find(COutPoint(hashTx, i));
+            if (it != mapNextTx.end())
+                vStage.push_back(it->second.ptx->GetHash());
+        }
+    }
+}
+
+// Drop transactions that entered the pool before nTime, with everything
+// that spends them
+int CTxMemPool::Expire(int64_t nTime)
+{
+    LOCK(cs);
+    unsigned int nSizeBefore = mapTx.size();
+
+    while (!setByTime.empty() && setByTime.begin()->first < nTime)
+    {
+        uint256 hash = setByTime.begin()->second;
+        removeUnchecked(*mapTx[hash]->tx, true);
+    }
+
+    int nRemoved = nSizeBefore - mapTx.size();
+    nExpired += nRemoved;
+    return nRemoved;
+}
+
+// Drop the transactions with the lowest descendant score, each together
+// with the transactions spending it, until the pool uses no more than
+// nSizeLimit bytes. The minimum fee goes above what the dropped packages paid.
+int CTxMemPool::TrimToSize(size_t nSizeLimit)
+{
+    LOCK(cs);
+    int64_t nTimeStart = GetTimeMicros();
+    unsigned int nSizeBefore = mapTx.size();
+
+    while (nTotalUsage > nSizeLimit && !setByDescendantScore.empty())
+    {
+        uint256 hash = setByDescendantScore.rbegin()->second;
+        const CTxMemPoolEntry& entry = *mapTx[hash];
+
+        double dRemovedRate = entry.GetPackageFeeRate() + MIN_RELAY_TX_FEE;
+        if (dRemovedRate > dRollingMinFeeRate)
+        {
+            dRollingMinFeeRate = dRemovedRate;
+            nLastRollingFeeUpdate = GetTime();
+        }
+
+        removeUnchecked(*entry.tx, true);
+    }
+
+    int nRemoved = nSizeBefore - mapTx.size();
+    nEvicted += nRemoved;
+
+    if (nRemoved > 0)
+        LogPrint("bench", "%s : evicted %d txs in %.3fms (poolsz %u)\n", __func__,
+                 nRemoved, (GetTimeMicros() - nTimeStart) * 0.001, mapTx.size());
+
+    return nRemoved;
+}
+
+void CTxMemPool::LimitSize(size_t nSizeLimit, int64_t nAge)
+{
+    int nExpiredNow = Expire(GetTime() - nAge);
+    if (nExpiredNow > 0)
+        LogPrint("mempool", "%s : expired %d transactions\n", __func__, nExpiredNow);
+
+    int nEvictedNow = TrimToSize(nSizeLimit);
+    if (nEvictedNow > 0)
+        LogPrint("mempool", "%s : evicted %d transactions to stay below %u bytes\n", __func__, nEvictedNow, nSizeLimit);
+}
+
+// Fee per kilobyte needed to get in, zero once it has decayed below half
+// the relay fee. It decays faster while the pool is far from nSizeLimit.
+int64_t CTxMemPool::GetMinFee(size_t nSizeLimit)
+{
+    LOCK(cs);
+    int64_t nNow = GetTime();
+
+    if (dRollingMinFeeRate > 0 && nNow > nLastRollingFeeUpdate + 10)
+    {
+        double dHalfLife = ROLLING_FEE_HALFLIFE;
+
+        if (nTotalUsage < nSizeLimit / 4)
+            dHalfLife /= 4;
+        else if (nTotalUsage < nSizeLimit / 2)
+            dHalfLife /= 2;
+
+        dRollingMinFeeRate /= pow(2.0, (nNow - nLastRollingFeeUpdate) / dHalfLife);
+        nLastRollingFeeUpdate = nNow;
+
+        if (dRollingMinFeeRate < MIN_RELAY_TX_FEE / 2)
+            dRollingMinFeeRate = 0;
+    }
+
+    return (int64_t)dRollingMinFeeRate;
 }
 
 bool CTxMemPool::lookup(uint256 hash, CTransaction& result) const
 {
     LOCK(cs);
-    std::map<uint256, CTransaction>::const_iterator i = mapTx.find(hash);
+    int64_t nTimeStart = GetTimeMicros();
+    txmap_t::const_iterator i = mapTx.find(hash);
     if (i == mapTx.end()) return false;
-    result = i->second;
+    result = *i->second->tx;
+    LogPrint("bench", "%s : %.3fms (poolsz %u)\n", __func__, (GetTimeMicros() - nTimeStart) * 0.001, mapTx.size());
     return true;
 }
+
+CTransactionRef CTxMemPool::get(const uint256& hash) const
+{
+    LOCK(cs);
+    txmap_t::const_iterator i = mapTx.find(hash);
+    if (i == mapTx.end()) return CTransactionRef();
+    return i->second->tx;
+}
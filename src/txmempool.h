@@ -6,27 +6,222 @@
 #ifndef BITCOIN_TXMEMPOOL_H
 #define BITCOIN_TXMEMPOOL_H
 
+#include <memory>
+#include <type_traits>
+
 #include "main.h"
+#include "collectionhashing.h"
+#include "robinhood.h"
 
 class CInPoint;
 class COutPoint;
 class CTxDB;
 
+/** Default for -maxmempool, maximum megabytes of memory the pool may use */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -mempoolexpiry, hours after which pool transactions are dropped */
+static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 72;
+/** Seconds in which the minimum fee raised by eviction falls back by half */
+static const int ROLLING_FEE_HALFLIFE = 60 * 60 * 12;
+
+/** What block assembly needs to know about a memory pool transaction,
+ *  worked out once when it enters the pool instead of reading its inputs
+ *  back from disk for every new block template.
+ */
+class CTxMemPoolEntry
+{
+public:
+    CTransactionRef tx;
+    uint64_t nSequence;             // order in which the pool received it
+    int64_t nTime;                  // when the pool received it
+    size_t nUsage;                  // memory the pool holds for it
+    unsigned int nTxSize;
+    int64_t nFee;
+    double dFeePerKb;
+    int nHeight;                    // best height when the entry was made
+    int64_t nValueInChain;          // value of the inputs confirmed at nHeight
+    double dPriorityInChain;        // sum(value * confirmations) of those inputs at nHeight
+    std::set<uint256> setDependsOn; // pool transactions it spends
+    int64_t nFeesWithDescendants;   // fees of it and the pool transactions spending it
+    int64_t nSizeWithDescendants;   // and their sizes
+
+    CTxMemPoolEntry()
+    {
+        nSequence = 0;
+        nTime = 0;
+        nUsage = 0;
+        nTxSize = 0;
+        nFee = 0;
+        dFeePerKb = 0;
+        nHeight = 0;
+        nValueInChain = 0;
+        dPriorityInChain = 0;
+        nFeesWithDescendants = 0;
+        nSizeWithDescendants = 0;
+    }
+
+    // Priority is sum(valuein * age) / txsize. Inputs that were still in the
+    // pool when the entry was made do not add to it.
+    double GetPriority(int nBestHeightIn) const
+    {
+        return (dPriorityInChain + (double)nValueInChain * (nBestHeightIn - nHeight)) / nTxSize;
+    }
+
+    // Fee rate of the transaction together with those spending it
+    double GetPackageFeeRate() const
+    {
+        return double(nFeesWithDescendants) / (double(nSizeWithDescendants) / 1000.0);
+    }
+
+    // What evicting it would give up: a parent is worth keeping for as
+    // long as its children pay for it
+    double GetDescendantScore() const
+    {
+        return std::max(dFeePerKb, GetPackageFeeRate());
+    }
+};
+
+/** Orders pool transactions by fee rate, highest first */
+typedef std::pair<double, uint256> CTxFeeRateKey;
+typedef std::pair<int64_t, uint256> CTxTimeKey;
+
+struct CompareTxFeeRate
+{
+    bool operator()(const CTxFeeRateKey& a, const CTxFeeRateKey& b) const
+    {
+        if (a.first != b.first)
+            return a.first > b.first;
+
+        return a.second < b.second;
+    }
+};
+
+/** Storage for pool entries, allocated ENTRIES_PER_BLOCK at a time. Slots
+ *  of removed entries are handed out again, so accepting a transaction does
+ *  not allocate an entry of its own and the entries stay close together.
+ */
+class CTxMemPoolArena
+{
+public:
+    static const size_t ENTRIES_PER_BLOCK = 1024;
+
+    CTxMemPoolArena() : nAllocated(0) {}
+
+    CTxMemPoolEntry* Allocate()
+    {
+        void* pslot;
+
+        if (!vFree.empty())
+        {
+            pslot = vFree.back();
+            vFree.pop_back();
+        }
+        else
+        {
+            if (nAllocated == vBlocks.size() * ENTRIES_PER_BLOCK)
+                vBlocks.push_back(std::unique_ptr<Slot[]>(new Slot[ENTRIES_PER_BLOCK]));
+
+            pslot = &vBlocks.back()[nAllocated % ENTRIES_PER_BLOCK];
+            nAllocated++;
+        }
+
+        return new (pslot) CTxMemPoolEntry();
+    }
+
+    void Free(CTxMemPoolEntry* pentry)
+    {
+        pentry->~CTxMemPoolEntry();
+        vFree.push_back(pentry);
+    }
+
+    // Only once every entry has been freed
+    void Clear()
+    {
+        vBlocks.clear();
+        vFree.clear();
+        nAllocated = 0;
+    }
+
+    size_t DynamicMemoryUsage() const
+    {
+        return vBlocks.size() * ENTRIES_PER_BLOCK * sizeof(Slot) + vFree.capacity() * sizeof(void*);
+    }
+
+private:
+    typedef std::aligned_storage<sizeof(CTxMemPoolEntry), alignof(CTxMemPoolEntry)>::type Slot;
+
+    std::vector<std::unique_ptr<Slot[]> > vBlocks;
+    std::vector<void*> vFree;
+    size_t nAllocated;
+};
+
+struct COutPointHasher
+{
+    size_t operator()(const COutPoint& outpoint) const
+    {
+        size_t nSeed = std::hash<uint256>()(outpoint.hash);
+        boost::hash_combine(nSeed, outpoint.n);
+        return nSeed;
+    }
+};
+
 class CTxMemPool
 {
 public:
+    typedef robin_hood::unordered_flat_map<uint256, CTxMemPoolEntry*> txmap_t;
+    typedef robin_hood::unordered_flat_map<COutPoint, CInPoint, COutPointHasher> nexttxmap_t;
+
     mutable CCriticalSection cs;
-    std::map<uint256, CTransaction> mapTx;
-    std::map<COutPoint, CInPoint> mapNextTx;
+    txmap_t mapTx;
+    nexttxmap_t mapNextTx;
+    std::set<CTxFeeRateKey, CompareTxFeeRate> setByFeeRate;
+    std::set<CTxFeeRateKey, CompareTxFeeRate> setByDescendantScore;
+    std::set<CTxTimeKey> setByTime;
+
+    // Last sequence number handed out, and a counter bumped whenever a
+    // transaction leaves the pool, so that block assembly can tell when
+    // transactions were only added since its last template
+    uint64_t nSequence;
+    unsigned int nRemovalsUpdated;
+
+    // Totals over all entries, and how many were dropped to stay within
+    // -maxmempool and -mempoolexpiry
+    uint64_t nTotalTxSize;
+    size_t nTotalUsage;
+    uint64_t nEvicted;
+    uint64_t nExpired;
+
+    CTxMemPool()
+    {
+        nSequence = 0;
+        nRemovalsUpdated = 0;
+        nTotalTxSize = 0;
+        nTotalUsage = 0;
+        nEvicted = 0;
+        nExpired = 0;
+        dRollingMinFeeRate = 0;
+        nLastRollingFeeUpdate = 0;
+    }
+
+    ~CTxMemPool()
+    {
+        clear();
+    }
 
     bool accept(CTxDB& txdb, CTransaction &tx,
                 bool fCheckInputs, bool* pfMissingInputs);
-    bool addUnchecked(const uint256& hash, CTransaction &tx);
+    bool addUnchecked(const uint256& hash, const CTransaction &tx, const MapPrevTx* pmapInputs = NULL);
     bool remove(const CTransaction &tx, bool fRecursive = false);
     bool removeConflicts(const CTransaction &tx);
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
+    void CalculateDescendants(const uint256& hash, std::set<uint256>& setDescendants);
+    int Expire(int64_t nTime);
+    int TrimToSize(size_t nSizeLimit);
+    void LimitSize(size_t nSizeLimit, int64_t nAge);
+    int64_t GetMinFee(size_t nSizeLimit);
     bool lookup(uint256 hash, CTransaction& result) const;
+    CTransactionRef get(const uint256& hash) const;
 
     unsigned long size()
     {
@@ -34,15 +229,40 @@ public:
         return mapTx.size();
     }
 
+    // What the entries account for, plus arena slots that are not in use.
+    // Eviction only looks at nTotalUsage, as evicting cannot shrink the arena.
+    size_t DynamicMemoryUsage() const
+    {
+        LOCK(cs);
+        return nTotalUsage + arena.DynamicMemoryUsage() - mapTx.size() * sizeof(CTxMemPoolEntry);
+    }
+
     bool exists(uint256 hash)
     {
         return (mapTx.count(hash) != 0);
     }
 
-    CTransaction& lookup(uint256 hash)
+    const CTxMemPoolEntry* GetEntry(const uint256& hash) const
     {
-        return mapTx[hash];
+        txmap_t::const_iterator mi = mapTx.find(hash);
+        return (mi == mapTx.end()) ? NULL : mi->second;
     }
+
+private:
+    CTxMemPoolArena arena;
+
+    // Fee per kilobyte a transaction has to pay to get in, raised above
+    // what the last evicted package paid and halving every
+    // ROLLING_FEE_HALFLIFE seconds after that
+    double dRollingMinFeeRate;
+    int64_t nLastRollingFeeUpdate;
+
+    void MakeEntry(const uint256& hash, const CTransaction& tx, const MapPrevTx* pmapInputs, CTxMemPoolEntry& entry);
+    bool HasConflicts(const CTransaction& tx) const;
+    void removeUnchecked(const CTransaction &tx, bool fRecursive);
+    void UpdateAncestors(const CTxMemPoolEntry& entry, int64_t nFeesDelta, int64_t nSizeDelta);
+    bool CheckInputs(CTxDB& txdb, const CTransaction& tx, bool* pfMissingInputs,
+                     MapPrevTx& mapInputs, int64_t& nFees, std::vector<CScriptCheck>& vChecks);
 };
 
 #endif // BITCOIN_TXMEMPOOL_H
@@ -15,6 +15,19 @@
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 
+#include <fcntl.h>
+#include <list>
+#include <memory>
+#include <unordered_map>
+
+#ifdef WIN32
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 using namespace std;
 using namespace boost;
 
@@ -26,6 +39,249 @@ static filesystem::path BlockFilePath(unsigned int nFile)
     return GetDataDir() / strBlockFn;
 }
 
+#ifndef WIN32
+// Read-only mapping of a block file, unmapped once its last reader is done with it
+class CBlockFileMapping
+{
+public:
+    const char* pbegin;
+    size_t nSize;
+
+    CBlockFileMapping(const char* pbeginIn, size_t nSizeIn) : pbegin(pbeginIn), nSize(nSizeIn) { }
+
+    ~CBlockFileMapping()
+    {
+        munmap(const_cast<char*>(pbegin), nSize);
+    }
+};
+#endif
+
+// Read-only descriptor of a block file. It is closed when the last user lets go
+// of it, so evicting it from the cache never pulls it from under a reader.
+class CBlockFileHandle
+{
+private:
+    int fd;
+    CCriticalSection cs;
+#ifndef WIN32
+    std::shared_ptr<CBlockFileMapping> mapping;
+
+    // Only map on 64-bit hosts, block files would exhaust a 32-bit address space
+    static const bool fUseMapping = sizeof(void*) >= 8;
+
+    std::shared_ptr<CBlockFileMapping> GetMapping(uint64_t nEnd)
+    {
+        LOCK(cs);
+
+        if (mapping && mapping->nSize >= nEnd)
+            return mapping;
+
+        // The file being appended to grows, remap it to cover the new data
+        struct stat st;
+
+        if (fstat(fd, &st) != 0 || (uint64_t) st.st_size < nEnd)
+            return std::shared_ptr<CBlockFileMapping>();
+
+        void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+        if (p == MAP_FAILED)
+            return std::shared_ptr<CBlockFileMapping>();
+
+        mapping = std::make_shared<CBlockFileMapping>(static_cast<const char*>(p), st.st_size);
+        return mapping;
+    }
+#endif
+
+public:
+    explicit CBlockFileHandle(int fdIn) : fd(fdIn) { }
+
+    ~CBlockFileHandle()
+    {
+#ifdef WIN32
+        _close(fd);
+#else
+        mapping.reset();
+        close(fd);
+#endif
+    }
+
+    bool ReadAt(char* pch, size_t nSize, uint64_t nPos)
+    {
+#ifdef WIN32
+        // seek + read is not atomic on windows
+        LOCK(cs);
+
+        if (_lseeki64(fd, nPos, SEEK_SET) < 0)
+            return false;
+#else
+        if (fUseMapping)
+        {
+            std::shared_ptr<CBlockFileMapping> current = GetMapping(nPos + nSize);
+
+            if (current)
+            {
+                memcpy(pch, current->pbegin + nPos, nSize);
+                return true;
+            }
+        }
+#endif
+
+        while (nSize > 0)
+        {
+#ifdef WIN32
+            int nRead = _read(fd, pch, nSize);
+#else
+            ssize_t nRead = pread(fd, pch, nSize, nPos);
+
+            if (nRead < 0 && errno == EINTR)
+                continue;
+#endif
+            if (nRead <= 0)
+                return false;
+
+            pch += nRead;
+            nPos += nRead;
+            nSize -= nRead;
+        }
+
+        return true;
+    }
+};
+
+typedef std::shared_ptr<CBlockFileHandle> BlockFileHandlePtr;
+
+static CCriticalSection cs_blockfiles;
+static std::list<std::pair<unsigned int, BlockFileHandlePtr> > lruBlockFiles;
+static std::unordered_map<unsigned int, decltype(lruBlockFiles)::iterator> mapBlockFiles;
+
+static std::atomic<uint64_t> nBlockFileReads(0);
+static std::atomic<uint64_t> nBlockFileCacheHits(0);
+static std::atomic<uint64_t> nBlockFileOpens(0);
+static std::atomic<uint64_t> nBlockFileAppends(0);
+
+static BlockFileHandlePtr GetBlockFileHandle(unsigned int nFile)
+{
+    if ((nFile < 1) || (nFile == (unsigned int) -1))
+        return BlockFileHandlePtr();
+
+    LOCK(cs_blockfiles);
+    auto mi = mapBlockFiles.find(nFile);
+
+    if (mi != mapBlockFiles.end())
+    {
+        // Move to the front, least recently used handles are at the back
+        lruBlockFiles.splice(lruBlockFiles.begin(), lruBlockFiles, mi->second);
+        nBlockFileCacheHits++;
+        return mi->second->second;
+    }
+
+#ifdef WIN32
+    int fd = _open(BlockFilePath(nFile).string().c_str(), _O_RDONLY | _O_BINARY);
+#else
+    int fd = open(BlockFilePath(nFile).string().c_str(), O_RDONLY);
+#endif
+
+    if (fd < 0)
+        return BlockFileHandlePtr();
+
+    nBlockFileOpens++;
+    static const size_t nMaxHandles = std::max((int64_t) 1, GetArg("-blockfilecache", DEFAULT_BLOCKFILE_CACHE_SIZE));
+
+    while (lruBlockFiles.size() >= nMaxHandles)
+    {
+        mapBlockFiles.erase(lruBlockFiles.back().first);
+        lruBlockFiles.pop_back();
+    }
+
+    lruBlockFiles.emplace_front(nFile, std::make_shared<CBlockFileHandle>(fd));
+    mapBlockFiles[nFile] = lruBlockFiles.begin();
+    return lruBlockFiles.front().second;
+}
+
+bool ReadBlockFileAt(unsigned int nFile, unsigned int nPos, char* pch, size_t nSize)
+{
+    BlockFileHandlePtr handle = GetBlockFileHandle(nFile);
+
+    if (!handle)
+        return false;
+
+    nBlockFileReads++;
+    return handle->ReadAt(pch, nSize, nPos);
+}
+
+// Every block is stored behind the network magic and its serialized size
+static bool ReadBlockFileSize(unsigned int nFile, unsigned int nBlockPos, unsigned int& nSizeRet)
+{
+    char pchHeader[8];
+
+    if (nBlockPos < sizeof(pchHeader) || !ReadBlockFileAt(nFile, nBlockPos - sizeof(pchHeader), pchHeader, sizeof(pchHeader)))
+        return false;
+
+    if (memcmp(pchHeader, pchMessageStart, sizeof(pchMessageStart)) != 0)
+        return false;
+
+    CDataStream ssSize(pchHeader + sizeof(pchMessageStart), pchHeader + sizeof(pchHeader), SER_DISK, CLIENT_VERSION);
+    ssSize >> nSizeRet;
+    return nSizeRet <= MAX_SIZE;
+}
+
+bool ReadBlockFileRaw(unsigned int nFile, unsigned int nBlockPos, CDataStream& ssBlockRet)
+{
+    unsigned int nSize;
+
+    if (!ReadBlockFileSize(nFile, nBlockPos, nSize))
+        return error("%s : no block found at %u:%u", __func__, nFile, nBlockPos);
+
+    size_t nOffset = ssBlockRet.size();
+    ssBlockRet.resize(nOffset + nSize);
+
+    if (nSize > 0 && !ReadBlockFileAt(nFile, nBlockPos, &ssBlockRet[nOffset], nSize))
+    {
+        ssBlockRet.resize(nOffset);
+        return error("%s : read of %u bytes at %u:%u failed", __func__, nSize, nFile, nBlockPos);
+    }
+
+    return true;
+}
+
+bool ReadTransactionFromBlockFile(const CDiskTxPos& pos, CTransaction& txRet)
+{
+    unsigned int nBlockSize;
+
+    if (!ReadBlockFileSize(pos.nFile, pos.nBlockPos, nBlockSize))
+        return error("%s : no block found at %s", __func__, pos.ToString());
+
+    if (pos.nTxPos < pos.nBlockPos || pos.nTxPos >= (uint64_t) pos.nBlockPos + nBlockSize)
+        return error("%s : transaction position outside of block at %s", __func__, pos.ToString());
+
+    // The size of a single transaction is not stored, so start with a small read
+    // and widen it until the transaction deserializes or the block is exhausted
+    const size_t nAvailable = pos.nBlockPos + nBlockSize - pos.nTxPos;
+    size_t nChunk = std::min(nAvailable, (size_t) 4096);
+
+    while (true)
+    {
+        CDataStream ssTx(SER_DISK, CLIENT_VERSION);
+        ssTx.resize(nChunk);
+
+        if (!ReadBlockFileAt(pos.nFile, pos.nTxPos, &ssTx[0], nChunk))
+            return error("%s : read failed at %s", __func__, pos.ToString());
+
+        try
+        {
+            ssTx >> txRet;
+            return true;
+        }
+        catch (const std::exception& e)
+        {
+            if (nChunk == nAvailable)
+                return error("%s : deserialize or I/O error at %s", __func__, pos.ToString());
+
+            nChunk = std::min(nAvailable, nChunk * 8);
+        }
+    }
+}
+
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode)
 {
     if ((nFile < 1) || (nFile == (unsigned int) -1))
@@ -48,32 +304,100 @@ FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszM
     return file;
 }
 
+// The block file currently appended to stays open, with its size tracked here
+static CCriticalSection cs_appendfile;
 static unsigned int nCurrentBlockFile = 1;
+static FILE* fileAppend = NULL;
+static uint64_t nAppendPos = 0;
+
+static void CloseAppendFile()
+{
+    if (fileAppend)
+    {
+        FileCommit(fileAppend);
+        fclose(fileAppend);
+        fileAppend = NULL;
+    }
+}
 
-FILE* AppendBlockFile(unsigned int& nFileRet)
+bool AppendBlockFile(const CDataStream& ssBlock, unsigned int& nFileRet, unsigned int& nBlockPosRet, bool fCommit)
 {
+    LOCK(cs_appendfile);
     nFileRet = 0;
 
     while (true)
     {
-        FILE* file = OpenBlockFile(nCurrentBlockFile, 0, "ab");
+        if (!fileAppend)
+        {
+            fileAppend = OpenBlockFile(nCurrentBlockFile, 0, "ab");
 
-        if (!file)
-            return NULL;
+            if (!fileAppend)
+                return false;
 
-        if (fseek(file, 0, SEEK_END) != 0)
-            return NULL;
+            long nPos;
 
-        // FAT32 file size max 4GB, fseek and ftell max 2GB, so we must stay under 2GB
-        if (ftell(file) < (long) (0x7F000000 - MAX_SIZE))
-        {
-            nFileRet = nCurrentBlockFile;
-            return file;
+            if (fseek(fileAppend, 0, SEEK_END) != 0 || (nPos = ftell(fileAppend)) < 0)
+            {
+                fclose(fileAppend);
+                fileAppend = NULL;
+                return false;
+            }
+
+            nAppendPos = nPos;
+            nBlockFileOpens++;
         }
 
-        fclose(file);
+        // FAT32 file size max 4GB, fseek and ftell max 2GB, so we must stay under 2GB
+        if (nAppendPos < (uint64_t) (0x7F000000 - MAX_SIZE))
+            break;
+
+        CloseAppendFile();
         nCurrentBlockFile++;
     }
+
+    CDataStream ssHeader(SER_DISK, CLIENT_VERSION);
+    ssHeader << FLATDATA(pchMessageStart) << (unsigned int) ssBlock.size();
+
+    if (fwrite(&ssHeader[0], 1, ssHeader.size(), fileAppend) != ssHeader.size() ||
+        fwrite(&ssBlock[0], 1, ssBlock.size(), fileAppend) != ssBlock.size() ||
+        fflush(fileAppend) != 0)
+    {
+        // The tracked position can no longer be trusted, reopen on the next append
+        fclose(fileAppend);
+        fileAppend = NULL;
+        return error("%s : write to blk%04u.dat failed", __func__, nCurrentBlockFile);
+    }
+
+    if (fCommit)
+        FileCommit(fileAppend);
+
+    nFileRet = nCurrentBlockFile;
+    nBlockPosRet = nAppendPos + ssHeader.size();
+    nAppendPos += ssHeader.size() + ssBlock.size();
+    nBlockFileAppends++;
+    return true;
+}
+
+void CloseBlockFiles()
+{
+    {
+        LOCK(cs_appendfile);
+        CloseAppendFile();
+    }
+
+    LOCK(cs_blockfiles);
+    mapBlockFiles.clear();
+    lruBlockFiles.clear();
+}
+
+CBlockFileStats GetBlockFileStats()
+{
+    CBlockFileStats stats;
+    stats.nReads = nBlockFileReads;
+    stats.nCacheHits = nBlockFileCacheHits;
+    stats.nOpens = nBlockFileOpens;
+    stats.nAppends = nBlockFileAppends;
+    return stats;
 }
 
 // Once this function has returned false it should remain so most of the time
@@ -14,11 +14,30 @@
 
 static const int MAX_INACTIVITY_IBD = 60 * 5; /* 5 minutes */
 static const int64_t DEFAULT_MAX_TIP_AGE = 60 * 60 * 2;
+static const unsigned int DEFAULT_BLOCKFILE_CACHE_SIZE = 64;
 extern int64_t nMaxTipAge;
 class CBlockIndex;
+class CDataStream;
+class CDiskTxPos;
+class CTransaction;
+
+/** Counters for the cache of open block file descriptors */
+struct CBlockFileStats
+{
+    uint64_t nReads;
+    uint64_t nCacheHits;
+    uint64_t nOpens;
+    uint64_t nAppends;
+};
 
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
-FILE* AppendBlockFile(unsigned int& nFileRet);
+bool AppendBlockFile(const CDataStream& ssBlock, unsigned int& nFileRet, unsigned int& nBlockPosRet, bool fCommit);
+bool ReadBlockFileAt(unsigned int nFile, unsigned int nPos, char* pch, size_t nSize);
+/** Appends the serialized block stored at nBlockPos to ssBlockRet, without deserializing it */
+bool ReadBlockFileRaw(unsigned int nFile, unsigned int nBlockPos, CDataStream& ssBlockRet);
+bool ReadTransactionFromBlockFile(const CDiskTxPos& pos, CTransaction& txRet);
+void CloseBlockFiles();
+CBlockFileStats GetBlockFileStats();
 void DelatchIsInitialBlockDownload();
 bool IsInitialBlockDownload();
 
@@ -20,6 +20,8 @@
 #include "darksend.h"
 #include "masternode.h"
 #include "validation.h"
+#include "checkqueue.h"
+#include "init.h"
 
 using namespace std;
 
@@ -446,6 +448,11 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx, bool fBlock)
 
                     wtx.MarkSpent(txin.prevout.n);
                     wtx.WriteToDisk();
+                    UpdateCoinIndex(wtx);
+
+                    if (mapStakeCandidates.erase(txin.prevout) && fFileBacked)
+                        CWalletDB(strWalletFile).EraseStakeCandidate(txin.prevout);
+
                     NotifyTransactionChanged(this, txin.prevout.hash, CT_UPDATED);
                 }
             }
@@ -463,6 +470,7 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx, bool fBlock)
                 {
                     wtx.MarkUnspent(&txout - &tx.vout[0]);
                     wtx.WriteToDisk();
+                    UpdateCoinIndex(wtx);
                     NotifyTransactionChanged(this, hash, CT_UPDATED);
                 }
             }
@@ -477,6 +485,33 @@ void CWallet::MarkDirty()
 
     for (auto& item : mapWallet)
         item.second.MarkDirty();
+
+    nCoinIndexUpdated++;
+}
+
+// Requires cs_wallet
+void CWallet::UpdateCoinIndex(const CWalletTx& wtx)
+{
+    bool fUnspent = false;
+
+    for (unsigned int i = 0; i < wtx.vout.size() && !fUnspent; i++)
+        fUnspent = !wtx.IsSpent(i) && IsMine(wtx.vout[i]);
+
+    if (fUnspent)
+        setUnspentTxs.insert(wtx.GetHash());
+    else
+        setUnspentTxs.erase(wtx.GetHash());
+
+    nCoinIndexUpdated++;
+}
+
+void CWallet::RebuildCoinIndex()
+{
+    LOCK(cs_wallet);
+    setUnspentTxs.clear();
+
+    for (auto it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateCoinIndex((*it).second);
 }
 
 bool CWallet::AddToWallet(const CWalletTx& wtxIn)
@@ -584,6 +619,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
         if (fInsertedNew || fUpdated)
             if (!wtx.WriteToDisk())
                 return false;
+
+        UpdateCoinIndex(wtx);
 #ifndef QT_GUI
         // If default receiving address gets used, replace it with a new one
         if (vchDefaultKey.IsValid()) {
@@ -643,7 +680,13 @@ bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pbl
             if (pblock)
                 wtx.SetMerkleBranch(pblock);
 
-            return AddToWallet(wtx);
+            if (!AddToWallet(wtx))
+                return false;
+
+            if (pblock)
+                AddStakeCandidates(wtx, *pblock);
+
+            return true;
         }
         else
             WalletUpdateSpent(tx);
@@ -661,6 +704,9 @@ bool CWallet::EraseFromWallet(uint256 hash)
 
         if (mapWallet.erase(hash))
             CWalletDB(strWalletFile).EraseTx(hash);
+
+        setUnspentTxs.erase(hash);
+        nCoinIndexUpdated++;
     }
 
     return true;
@@ -971,12 +1017,141 @@ void CWalletTx::GetAccountAmounts(const string& strAccount, int64_t& nReceived,
     }
 }
 
+namespace {
+
+// Upper bound on the threads reading and matching blocks during a rescan
+static const int MAX_RESCAN_THREADS = 8;
+
+// Blocks per rescan thread in each window handed to the rescan threads
+static const unsigned int RESCAN_BLOCKS_PER_THREAD = 16;
+
+/** Key and script IDs of a wallet, taken once so the rescan threads can match outputs without
+  * the wallet lock. Passes every output IsMine accepts and a few it does not, such as multisig
+  * with only some of the keys, AddToWalletIfInvolvingMe has the final say on those. */
+class CRescanFilter
+{
+private:
+    std::set<CKeyID> setKeyID;
+    std::set<CScriptID> setScriptID;
+
+public:
+    CRescanFilter(const CWallet& wallet)
+    {
+        wallet.GetKeys(setKeyID);
+        wallet.GetCScripts(setScriptID);
+    }
+
+    bool Matches(const CScript& scriptPubKey) const
+    {
+        std::vector<valtype> vSolutions;
+        txnouttype whichType;
+
+        if (!Solver(scriptPubKey, whichType, vSolutions))
+            return false;
+
+        switch (whichType)
+        {
+        case TX_PUBKEY:
+            return setKeyID.count(CPubKey(vSolutions[0]).GetID());
+        case TX_PUBKEYHASH:
+            return setKeyID.count(CKeyID(uint160(vSolutions[0])));
+        case TX_SCRIPTHASH:
+            return setScriptID.count(CScriptID(uint160(vSolutions[0])));
+        case TX_MULTISIG:
+            for (unsigned int i = 1; i + 1 < vSolutions.size(); i++)
+            {
+                if (setKeyID.count(CPubKey(vSolutions[i]).GetID()))
+                    return true;
+            }
+
+            return false;
+        default:
+            return false;
+        }
+    }
+};
+
+/** A block of a rescan, with the transactions having an output that passed the filter */
+struct CRescanBlock
+{
+    CBlockIndex* pindex;
+    CBlock block;
+    bool fRead;
+    std::vector<char> vfMatch;
+
+    CRescanBlock(CBlockIndex* pindexIn) : pindex(pindexIn), fRead(false) {}
+};
+
+/** Reads and matches one block, queued on the rescan threads */
+class CRescanCheck
+{
+private:
+    CRescanBlock* pslot;
+    const CRescanFilter* pfilter;
+
+public:
+    CRescanCheck() : pslot(NULL), pfilter(NULL) {}
+    CRescanCheck(CRescanBlock* pslotIn, const CRescanFilter* pfilterIn) : pslot(pslotIn), pfilter(pfilterIn) {}
+
+    bool operator()()
+    {
+        pslot->fRead = pslot->block.ReadFromDisk(pslot->pindex, true);
+        pslot->vfMatch.assign(pslot->block.vtx.size(), false);
+
+        for (unsigned int i = 0; pslot->fRead && i < pslot->block.vtx.size(); i++)
+        {
+            BOOST_FOREACH(const CTxOut& txout, pslot->block.vtx[i].vout)
+            {
+                if (pfilter->Matches(txout.scriptPubKey))
+                {
+                    pslot->vfMatch[i] = true;
+                    break;
+                }
+            }
+        }
+
+        return true;
+    }
+
+    void swap(CRescanCheck& check)
+    {
+        std::swap(pslot, check.pslot);
+        std::swap(pfilter, check.pfilter);
+    }
+};
+
+// Queue the blocks from pindex on for reading and matching, returns the block after them
+CBlockIndex* QueueRescanWindow(CCheckQueue<CRescanCheck>& queue, const CRescanFilter& filter,
+                               CBlockIndex* pindex, std::vector<CRescanBlock>& vWindow, unsigned int nSize)
+{
+    vWindow.clear();
+
+    for (; pindex && vWindow.size() < nSize; pindex = pindex->pnext)
+        vWindow.push_back(CRescanBlock(pindex));
+
+    std::vector<CRescanCheck> vChecks;
+    vChecks.reserve(vWindow.size());
+
+    BOOST_FOREACH(CRescanBlock& slot, vWindow)
+        vChecks.push_back(CRescanCheck(&slot, &filter));
+
+    queue.Add(vChecks);
+    return pindex;
+}
+
+}
+
 // Scan the block chain (starting in pindexStart) for transactions
 // from or to us. If fUpdate is true, found transactions that already
 // exist in the wallet will be updated.
+//
+// Blocks are read and matched against the wallet's keys on a few threads, a window of
+// blocks ahead of the one being added to the wallet in order on the calling thread.
+// Stops early on shutdown or AbortRescan().
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
     int ret = 0;
+    int64_t nStart = GetTimeMillis();
     int64_t nNow = GetTime();
 
     CBlockIndex* pindex = pindexStart;
@@ -988,41 +1163,106 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
         while (pindex && nTimeFirstKey && (pindex->nTime < (nTimeFirstKey - 7200)))
             pindex = pindex->pnext;
 
+        if (!pindex)
+            return 0;
+
+        fAbortRescan = false;
+        fScanningWallet = true;
+
         ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
         double dProgressStart = GuessVerificationProgress(pindex);
         double dProgressTip = GuessVerificationProgress(pindexBest);
+        int nHeightStart = pindex->nHeight;
+
+        int nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency(), MAX_RESCAN_THREADS));
+
+        LogPrintf("[Rescan] Start - pindexBest->nHeight=%d, pindex->nHeight=%d,  dProgressStart=%lf, dProgressTip=%lf, threads=%d\n",
+                  pindexBest->nHeight, pindex->nHeight, dProgressStart, dProgressTip, nThreads);
+
+        // The calling thread works through the queue as well while waiting on it
+        CRescanFilter filter(*this);
+        CCheckQueue<CRescanCheck> queue(1);
+        boost::thread_group threadGroup;
 
-        LogPrintf("[Rescan] Start - pindexBest->nHeight=%d, pindex->nHeight=%d,  dProgressStart=%lf, dProgressTip=%lf\n",
-                  pindexBest->nHeight, pindex->nHeight, dProgressStart, dProgressTip);
+        for (int i = 1; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&CCheckQueue<CRescanCheck>::Thread, &queue));
 
-        while (pindex)
+        const unsigned int nWindowSize = nThreads * RESCAN_BLOCKS_PER_THREAD;
+        std::vector<CRescanBlock> vWindow[2];
+        int nHeightLast = nHeightStart;
+        bool fAborted = false;
+
+        pindex = QueueRescanWindow(queue, filter, pindex, vWindow[0], nWindowSize);
+        queue.Wait();
+
+        for (unsigned int n = 0; !vWindow[n % 2].empty(); n++)
         {
-            if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
+            std::vector<CRescanBlock>& vCurrent = vWindow[n % 2];
+
+            if (fAbortRescan || ShutdownRequested())
             {
-                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((GuessVerificationProgress(pindex) -
-                                                 dProgressStart) / (dProgressTip - dProgressStart) * 100))));
+                fAborted = true;
+                break;
             }
 
-            if (GetTime() >= nNow + 30)
+            // Have the next window read while this one goes into the wallet
+            pindex = QueueRescanWindow(queue, filter, pindex, vWindow[(n + 1) % 2], nWindowSize);
+
+            BOOST_FOREACH(CRescanBlock& slot, vCurrent)
             {
-                nNow = GetTime();
-                LogPrintf("[Rescan] Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, GuessVerificationProgress(pindex));
+                if (!slot.fRead)
+                {
+                    LogPrintf("[Rescan] Failed to read block %d\n", slot.pindex->nHeight);
+                    continue;
+                }
+
+                for (unsigned int i = 0; i < slot.block.vtx.size(); i++)
+                {
+                    const CTransaction& tx = slot.block.vtx[i];
+                    bool fRelevant = slot.vfMatch[i] || mapWallet.count(tx.GetHash());
+
+                    // Spending or updating one of ours
+                    for (unsigned int j = 0; j < tx.vin.size() && !fRelevant; j++)
+                        fRelevant = mapWallet.count(tx.vin[j].prevout.hash);
+
+                    if (fRelevant && AddToWalletIfInvolvingMe(tx, &slot.block, fUpdate))
+                        ret++;
+                }
             }
 
-            CBlock block;
-            block.ReadFromDisk(pindex, true);
+            CBlockIndex* pindexLast = vCurrent.back().pindex;
+            nHeightLast = pindexLast->nHeight;
 
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+            if (dProgressTip - dProgressStart > 0.0)
             {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
-                    ret++;
+                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((GuessVerificationProgress(pindexLast) -
+                                                 dProgressStart) / (dProgressTip - dProgressStart) * 100))));
             }
 
-            pindex = pindex->pnext;
+            if (GetTime() >= nNow + 30)
+            {
+                nNow = GetTime();
+                LogPrintf("[Rescan] Still rescanning. At block %d. Progress=%f, %.1f blocks/s\n", nHeightLast,
+                          GuessVerificationProgress(pindexLast),
+                          (nHeightLast - nHeightStart + 1) * 1000.0 / std::max(GetTimeMillis() - nStart, (int64_t)1));
+            }
+
+            queue.Wait();
         }
 
-        LogPrintf("[Rescan] Completed - %d transactions identified as part of this wallet.\n", ret);
+        queue.Quit();
+        threadGroup.join_all();
+
+        double dRate = (nHeightLast - nHeightStart + 1) * 1000.0 / std::max(GetTimeMillis() - nStart, (int64_t)1);
+
+        if (fAborted)
+            LogPrintf("[Rescan] Aborted at block %d, %.1f blocks/s - %d transactions identified as part of this wallet.\n",
+                      nHeightLast, dRate, ret);
+        else
+            LogPrintf("[Rescan] Completed, %.1f blocks/s - %d transactions identified as part of this wallet.\n", dRate, ret);
+
         ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
+        fScanningWallet = false;
     }
 
     return ret;
@@ -1080,6 +1320,7 @@ void CWallet::ReacceptWalletTransactions()
 
                         wtx.MarkDirty();
                         wtx.WriteToDisk();
+                        UpdateCoinIndex(wtx);
                     }
                 }
                 else
@@ -1392,23 +1633,64 @@ void CWallet::ResendWalletTransactions(bool fForce)
     }
 }
 
-int64_t CWallet::GetBalance() const
+// Totals over the transactions in setUnspentTxs. They only move with the tip or the wallet, so
+// they are kept until either does. Immature coinbase and coinstake outputs cannot have been spent,
+// so those transactions are all in the index. Requires cs_wallet.
+const CWalletBalances& CWallet::GetBalances() const
 {
-    int64_t nTotal = 0;
+    if (fBalancesCached && pindexBalancesCached == pindexBest && nBalancesCachedUpdate == nCoinIndexUpdated)
+        return balancesCached;
+
+    CWalletBalances balances;
+    bool fCacheable = true;
 
+    BOOST_FOREACH(const uint256& hash, setUnspentTxs)
     {
-        LOCK(cs_wallet);
+        auto mi = mapWallet.find(hash);
 
-        for (auto it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
+        if (mi == mapWallet.end())
+            continue;
 
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
+        const CWalletTx& wtx = (*mi).second;
+        bool fFinal = wtx.IsFinal();
+
+        // A transaction locked until a time can become final without the tip moving
+        if (!fFinal)
+            fCacheable = false;
+
+        int nDepth = wtx.GetDepthInMainChain();
+        bool fTrusted = wtx.IsTrusted();
+
+        if (fTrusted)
+            balances.nTrusted += wtx.GetAvailableCredit();
+
+        if (!fFinal || (!fTrusted && nDepth == 0))
+            balances.nUnconfirmed += wtx.GetAvailableCredit();
+
+        if (nDepth > 0 && wtx.GetBlocksToMaturity() > 0)
+        {
+            if (wtx.IsCoinBase())
+            {
+                balances.nImmature += GetCredit(wtx);
+                balances.nNewMint += GetCredit(wtx);
+            }
+            else if (wtx.IsCoinStake())
+                balances.nStake += GetCredit(wtx);
         }
     }
 
-    return nTotal;
+    balancesCached = balances;
+    fBalancesCached = fCacheable;
+    pindexBalancesCached = pindexBest;
+    nBalancesCachedUpdate = nCoinIndexUpdated;
+
+    return balancesCached;
+}
+
+int64_t CWallet::GetBalance() const
+{
+    LOCK(cs_wallet);
+    return GetBalances().nTrusted;
 }
 
 //TODO: Remove me
@@ -1436,9 +1718,14 @@ CAmount CWallet::GetDenominatedBalance(bool onlyDenom, bool onlyUnconfirmed) con
     {
         LOCK(cs_wallet);
 
-        for (auto it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        BOOST_FOREACH(const uint256& hash, setUnspentTxs)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            auto mi = mapWallet.find(hash);
+
+            if (mi == mapWallet.end())
+                continue;
+
+            const CWalletTx* pcoin = &(*mi).second;
             int nDepth = pcoin->GetDepthInMainChain();
 
             // skip conflicted
@@ -1477,38 +1764,14 @@ CAmount CWallet::GetDenominatedBalance(bool onlyDenom, bool onlyUnconfirmed) con
 
 int64_t CWallet::GetUnconfirmedBalance() const
 {
-    int64_t nTotal = 0;
-    {
-        LOCK(cs_wallet);
-
-        for (auto it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-
-            if (!pcoin->IsFinal() || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-
-    return nTotal;
+    LOCK(cs_wallet);
+    return GetBalances().nUnconfirmed;
 }
 
 int64_t CWallet::GetImmatureBalance() const
 {
-    int64_t nTotal = 0;
-    {
-        LOCK(cs_wallet);
-
-        for (auto it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx& pcoin = (*it).second;
-
-            if (pcoin.IsCoinBase() && pcoin.GetBlocksToMaturity() > 0 && pcoin.IsInMainChain())
-                nTotal += GetCredit(pcoin);
-        }
-    }
-
-    return nTotal;
+    LOCK(cs_wallet);
+    return GetBalances().nImmature;
 }
 
 void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const CCoinControl *coinControl,
@@ -1519,8 +1782,13 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
     {
         LOCK(cs_wallet);
 
-        for (auto it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        BOOST_FOREACH(const uint256& hash, setUnspentTxs)
         {
+            auto it = mapWallet.find(hash);
+
+            if (it == mapWallet.end())
+                continue;
+
             const CWalletTx* pcoin = &(*it).second;
 
             if (!pcoin->IsFinal())
@@ -1603,8 +1871,13 @@ void CWallet::AvailableCoinsMN(vector<COutput>& vCoins, bool fOnlyConfirmed, con
     {
         LOCK2(cs_main, cs_wallet);
 
-        for (auto it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        BOOST_FOREACH(const uint256& hash, setUnspentTxs)
         {
+            auto it = mapWallet.find(hash);
+
+            if (it == mapWallet.end())
+                continue;
+
             const CWalletTx* pcoin = &(*it).second;
 
             if (!pcoin->IsFinal())
@@ -1678,8 +1951,13 @@ void CWallet::AvailableCoinsMinConf(vector<COutput>& vCoins, int nConf) const
     {
         LOCK(cs_wallet);
 
-        for (auto it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        BOOST_FOREACH(const uint256& hash, setUnspentTxs)
         {
+            auto it = mapWallet.find(hash);
+
+            if (it == mapWallet.end())
+                continue;
+
             const CWalletTx* pcoin = &(*it).second;
 
             if (!pcoin->IsFinal())
@@ -1753,34 +2031,14 @@ bool less_then_denom(const COutput& out1, const COutput& out2)
 
 int64_t CWallet::GetStake() const
 {
-    int64_t nTotal = 0;
     LOCK(cs_wallet);
-
-    for (auto it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-
-        if (pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin);
-    }
-
-    return nTotal;
+    return GetBalances().nStake;
 }
 
 int64_t CWallet::GetNewMint() const
 {
-    int64_t nTotal = 0;
     LOCK(cs_wallet);
-
-    for (auto it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-
-        if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin);
-    }
-
-    return nTotal;
+    return GetBalances().nNewMint;
 }
 
 int64_t CWallet::GetTotal() const
@@ -2517,6 +2775,73 @@ uint64_t CWallet::GetStakeWeight() const
     return nWeight;
 }
 
+// Get the key staking a kernel output and the script paying the coinstake back to it,
+// pay to address outputs being converted to pay to public key
+static bool GetKernelKey(const CKeyStore& keystore, const CScript& scriptPubKeyKernel, CKey& key, CScript& scriptPubKeyOut)
+{
+    vector<valtype> vSolutions;
+    txnouttype whichType;
+
+    if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
+    {
+        if (fDebug && GetBoolArg("-printcoinstake"))
+            LogPrintf("%s : failed to parse kernel\n", __func__);
+
+        return false;
+    }
+
+    if (fDebug && GetBoolArg("-printcoinstake"))
+        LogPrintf("%s : parsed kernel type=%d\n", __func__, whichType);
+
+    if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
+    {
+        if (fDebug && GetBoolArg("-printcoinstake"))
+            LogPrintf("%s : no support for kernel type=%d\n", __func__, whichType);
+
+        return false;  // only support pay to public key and pay to address
+    }
+
+    if (whichType == TX_PUBKEYHASH) // pay to address type
+    {
+        // convert to pay to public key type
+        if (!keystore.GetKey(uint160(vSolutions[0]), key))
+        {
+            if (fDebug && GetBoolArg("-printcoinstake"))
+                LogPrintf("%s : failed to get key for kernel type=%d\n", __func__, whichType);
+
+            return false;  // unable to find corresponding public key
+        }
+
+        scriptPubKeyOut.clear();
+        scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
+    }
+
+    if (whichType == TX_PUBKEY)
+    {
+        valtype& vchPubKey = vSolutions[0];
+
+        if (!keystore.GetKey(Hash160(vchPubKey), key))
+        {
+            if (fDebug && GetBoolArg("-printcoinstake"))
+                LogPrintf("%s : failed to get key for kernel type=%d\n", __func__, whichType);
+
+            return false;  // unable to find corresponding public key
+        }
+
+        if (key.GetPubKey() != vchPubKey)
+        {
+            if (fDebug && GetBoolArg("-printcoinstake"))
+                LogPrintf("%s : invalid key for kernel type=%d\n", __func__, whichType);
+
+            return false; // keys mismatch
+        }
+
+        scriptPubKeyOut = scriptPubKeyKernel;
+    }
+
+    return true;
+}
+
 bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64_t nSearchInterval, int64_t nFees, CTransaction& txNew, CKey& key)
 {
     CBlockIndex* pindexPrev = pindexBest;
@@ -2551,127 +2876,74 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
 
     int64_t nCredit = 0;
     CScript scriptPubKeyKernel;
-    CTxDB txdb("r");
+    static int nMaxStakeSearchInterval = 60;
+
+    // Kernel data comes from the stake candidate table, so no disk access or cs_main is needed here
+    vector<CStakeKernelInput> vKernelInputs;
+    vector<pair<const CWalletTx*, unsigned int> > vKernelCoins;
 
     BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
     {
-        CTxIndex txindex;
-        {
-            LOCK2(cs_main, cs_wallet);
-            if (!txdb.ReadTxIndex(pcoin.first->GetHash(), txindex))
-                continue;
-        }
-
-        // Read block header
-        CBlock block;
-        {
-            LOCK2(cs_main, cs_wallet);
-            if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
-                continue;
-        }
+        CStakeCandidate candidate;
 
-        static int nMaxStakeSearchInterval = 60;
+        if (!GetStakeCandidate(*pcoin.first, pcoin.second, candidate))
+            continue;
 
-        if (block.GetBlockTime() + nStakeMinAge > txNew.nTime - nMaxStakeSearchInterval)
+        if (candidate.nBlockTime + nStakeMinAge > txNew.nTime - nMaxStakeSearchInterval)
             continue; // only count coins meeting min age requirement
 
-        bool fKernelFound = false;
-
-        for (unsigned int n = 0; n < min(nSearchInterval,(int64_t) nMaxStakeSearchInterval) &&
-             !fKernelFound && !fShutdown && pindexPrev == pindexBest; n++)
-        {
-            // Search backward in time from the given txNew timestamp
-            // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
-            uint256 hashProofOfStake = 0, targetProofOfStake = 0;
-            COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-
-            if (CheckStakeKernelHash(pindexPrev, nBits, block, txindex.pos.nTxPos - txindex.pos.nBlockPos, *pcoin.first,
-                                     prevoutStake, txNew.nTime - n, hashProofOfStake, targetProofOfStake))
-            {
-                // Found a kernel
-                if (fDebug && GetBoolArg("-printcoinstake"))
-                    LogPrintf("%s : kernel found\n", __func__);
-
-                vector<valtype> vSolutions;
-                txnouttype whichType;
-                CScript scriptPubKeyOut;
-                scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
-
-                if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
-                {
-                    if (fDebug && GetBoolArg("-printcoinstake"))
-                        LogPrintf("%s : failed to parse kernel\n", __func__);
-
-                    break;
-                }
+        if (candidate.nScriptType != TX_PUBKEY && candidate.nScriptType != TX_PUBKEYHASH)
+            continue; // only support pay to public key and pay to address
 
-                if (fDebug && GetBoolArg("-printcoinstake"))
-                    LogPrintf("%s : parsed kernel type=%d\n", __func__, whichType);
+        CStakeKernelInput input;
+        input.prevout = COutPoint(pcoin.first->GetHash(), pcoin.second);
+        input.hashBlockFrom = candidate.hashBlock;
+        input.nTimeBlockFrom = candidate.nBlockTime;
+        input.nTxPrevOffset = candidate.nTxOffset;
+        input.nTimeTxPrev = candidate.nTxTime;
+        input.nValueIn = candidate.nValue;
 
-                if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
-                {
-                    if (fDebug && GetBoolArg("-printcoinstake"))
-                        LogPrintf("CreateCoinStake : no support for kernel type=%d\n", whichType);
-
-                    break;  // only support pay to public key and pay to address
-                }
-
-                if (whichType == TX_PUBKEYHASH) // pay to address type
-                {
-                    // convert to pay to public key type
-                    if (!keystore.GetKey(uint160(vSolutions[0]), key))
-                    {
-                        if (fDebug && GetBoolArg("-printcoinstake"))
-                            LogPrintf("%s : failed to get key for kernel type=%d\n", __func__, whichType);
-
-                        break;  // unable to find corresponding public key
-                    }
-
-                    scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
-                }
-
-                if (whichType == TX_PUBKEY)
-                {
-                    valtype& vchPubKey = vSolutions[0];
-
-                    if (!keystore.GetKey(Hash160(vchPubKey), key))
-                    {
-                        if (fDebug && GetBoolArg("-printcoinstake"))
-                            LogPrintf("%s : failed to get key for kernel type=%d\n", __func__, whichType);
+        vKernelInputs.push_back(input);
+        vKernelCoins.push_back(pcoin);
+    }
 
-                        break;  // unable to find corresponding public key
-                    }
+    // Search nSearchInterval seconds back from the given txNew timestamp, up to nMaxStakeSearchInterval
+    unsigned int nSearch = std::max((int64_t)0, std::min(nSearchInterval, (int64_t)nMaxStakeSearchInterval));
+    unsigned int nKernelInput, nTimeKernel;
 
-                    if (key.GetPubKey() != vchPubKey)
-                    {
-                        if (fDebug && GetBoolArg("-printcoinstake"))
-                            LogPrintf("%s : invalid key for kernel type=%d\n", __func__, whichType);
+    while (!fShutdown && SearchStakeKernel(pindexPrev, nBits, vKernelInputs, txNew.nTime, nSearch,
+                                           nKernelInput, nTimeKernel))
+    {
+        // Found a kernel
+        if (fDebug && GetBoolArg("-printcoinstake"))
+            LogPrintf("%s : kernel found\n", __func__);
 
-                        break; // keys mismatch
-                    }
+        const CWalletTx* pcoin = vKernelCoins[nKernelInput].first;
+        unsigned int nOut = vKernelCoins[nKernelInput].second;
+        CScript scriptPubKeyOut;
+        scriptPubKeyKernel = pcoin->vout[nOut].scriptPubKey;
 
-                    scriptPubKeyOut = scriptPubKeyKernel;
-                }
-
-                txNew.nTime -= n;
-                txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
-                nCredit += pcoin.first->vout[pcoin.second].nValue;
-                vwtxPrev.push_back(pcoin.first);
-                txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+        if (!GetKernelKey(keystore, scriptPubKeyKernel, key, scriptPubKeyOut))
+        {
+            // Unable to stake this output, search the others again
+            vKernelInputs.erase(vKernelInputs.begin() + nKernelInput);
+            vKernelCoins.erase(vKernelCoins.begin() + nKernelInput);
+            continue;
+        }
 
-                if (GetWeight(block.GetBlockTime(), (int64_t)txNew.nTime) < nStakeSplitAge)
-                    txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
+        txNew.nTime = nTimeKernel;
+        txNew.vin.push_back(CTxIn(pcoin->GetHash(), nOut));
+        nCredit += pcoin->vout[nOut].nValue;
+        vwtxPrev.push_back(pcoin);
+        txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
 
-                if (fDebug && GetBoolArg("-printcoinstake"))
-                    LogPrintf("%s : added kernel type=%d\n", __func__, whichType);
+        if (GetWeight(vKernelInputs[nKernelInput].nTimeBlockFrom, (int64_t)txNew.nTime) < nStakeSplitAge)
+            txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
 
-                fKernelFound = true;
-                break;
-            }
-        }
+        if (fDebug && GetBoolArg("-printcoinstake"))
+            LogPrintf("%s : added kernel\n", __func__);
 
-        if (fKernelFound || fShutdown)
-            break; // if kernel is found stop searching
+        break;
     }
 
     if (nCredit == 0 || nCredit > nBalance - nReserveBalance)
@@ -2841,6 +3113,7 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
                 coin.BindWallet(this);
                 coin.MarkSpent(txin.prevout.n);
                 coin.WriteToDisk();
+                UpdateCoinIndex(coin);
                 NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
             }
 
@@ -2973,6 +3246,27 @@ DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
         return nLoadWalletRet;
 
     fFirstRunRet = !vchDefaultKey.IsValid();
+    RebuildCoinIndex();
+
+    // Drop stake candidates of outputs spent or forgotten while the table was not maintained
+    {
+        LOCK(cs_wallet);
+        CWalletDB walletdb(strWalletFile);
+
+        for (auto it = mapStakeCandidates.begin(); it != mapStakeCandidates.end();)
+        {
+            auto mi = mapWallet.find((*it).first.hash);
+
+            if (mi == mapWallet.end() || (*it).first.n >= (*mi).second.vout.size() || (*mi).second.IsSpent((*it).first.n))
+            {
+                walletdb.EraseStakeCandidate((*it).first);
+                mapStakeCandidates.erase(it++);
+            }
+            else
+                ++it;
+        }
+    }
+
     NewThread(ThreadFlushWalletDB, &strWalletFile);
     return DB_LOAD_OK;
 }
@@ -3452,6 +3746,7 @@ void CWallet::FixSpentCoins(int& nMismatchFound, int64_t& nBalanceInQuestion, bo
                 {
                     pcoin->MarkUnspent(n);
                     pcoin->WriteToDisk();
+                    UpdateCoinIndex(*pcoin);
                 }
             }
             else if (IsMine(pcoin->vout[n]) && !pcoin->IsSpent(n) && (txindex.vSpent.size() > n && !txindex.vSpent[n].IsNull()))
@@ -3465,6 +3760,7 @@ void CWallet::FixSpentCoins(int& nMismatchFound, int64_t& nBalanceInQuestion, bo
                 {
                     pcoin->MarkSpent(n);
                     pcoin->WriteToDisk();
+                    UpdateCoinIndex(*pcoin);
                 }
             }
         }
@@ -3490,11 +3786,151 @@ void CWallet::DisableTransaction(const CTransaction &tx)
             {
                 prev.MarkUnspent(txin.prevout.n);
                 prev.WriteToDisk();
+                UpdateCoinIndex(prev);
             }
         }
     }
 }
 
+// Record the kernel data of our unspent outputs in a transaction connected in the given block
+void CWallet::AddStakeCandidates(const CWalletTx& wtx, const CBlock& block)
+{
+    if (wtx.nIndex < 0 || wtx.nIndex >= (int)block.vtx.size())
+        return;
+
+    // Same position as recorded in the CDiskTxPos of the transaction index, see CBlock::CalculateBlockAmounts
+    unsigned int nTxOffset = ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) +
+                             GetSizeOfCompactSize(block.vtx.size());
+
+    for (int i = 0; i < wtx.nIndex; i++)
+        nTxOffset += ::GetSerializeSize(block.vtx[i], SER_DISK, CLIENT_VERSION);
+
+    uint256 hash = wtx.GetHash();
+    vector<COutPoint> vAdded;
+
+    LOCK(cs_wallet);
+    auto mi = mapWallet.find(hash);
+
+    if (mi == mapWallet.end())
+        return;
+
+    const CWalletTx& wtxStored = (*mi).second;
+
+    for (unsigned int n = 0; n < wtxStored.vout.size(); n++)
+    {
+        const CTxOut& txout = wtxStored.vout[n];
+
+        if (wtxStored.IsSpent(n) || !IsMine(txout) || txout.nValue <= 0)
+            continue;
+
+        vector<valtype> vSolutions;
+        txnouttype whichType;
+
+        if (!Solver(txout.scriptPubKey, whichType, vSolutions))
+            whichType = TX_NONSTANDARD;
+
+        CStakeCandidate& candidate = mapStakeCandidates[COutPoint(hash, n)];
+        candidate.hashBlock = block.GetHash();
+        candidate.nBlockTime = block.GetBlockTime();
+        candidate.nTxOffset = nTxOffset;
+        candidate.nTxTime = wtxStored.nTime;
+        candidate.nValue = txout.nValue;
+        candidate.nScriptType = whichType;
+        vAdded.push_back(COutPoint(hash, n));
+    }
+
+    if (fFileBacked && !vAdded.empty())
+    {
+        CWalletDB walletdb(strWalletFile);
+
+        BOOST_FOREACH(const COutPoint& outpoint, vAdded)
+            walletdb.WriteStakeCandidate(outpoint, mapStakeCandidates[outpoint]);
+    }
+}
+
+// Forget the kernel data of the outputs of a transaction whose block was disconnected
+void CWallet::EraseStakeCandidates(const CTransaction& tx)
+{
+    uint256 hash = tx.GetHash();
+
+    LOCK(cs_wallet);
+
+    if (!mapWallet.count(hash))
+        return;
+
+    vector<COutPoint> vErased;
+
+    for (unsigned int n = 0; n < tx.vout.size(); n++)
+    {
+        if (mapStakeCandidates.erase(COutPoint(hash, n)))
+            vErased.push_back(COutPoint(hash, n));
+    }
+
+    if (fFileBacked && !vErased.empty())
+    {
+        CWalletDB walletdb(strWalletFile);
+
+        BOOST_FOREACH(const COutPoint& outpoint, vErased)
+            walletdb.EraseStakeCandidate(outpoint);
+    }
+}
+
+// Get the kernel data of a wallet output. Outputs not in the table (wallets created before it existed, or
+// coins returned by a disconnected coinstake) are read from disk once and then remembered.
+bool CWallet::GetStakeCandidate(const CWalletTx& wtx, unsigned int n, CStakeCandidate& candidate)
+{
+    COutPoint outpoint(wtx.GetHash(), n);
+
+    {
+        LOCK(cs_wallet);
+        auto mi = mapStakeCandidates.find(outpoint);
+
+        if (mi != mapStakeCandidates.end() && (wtx.hashBlock == 0 || (*mi).second.hashBlock == wtx.hashBlock))
+        {
+            candidate = (*mi).second;
+            return true;
+        }
+    }
+
+    if (n >= wtx.vout.size())
+        return false;
+
+    CTxIndex txindex;
+    CBlock block;
+    {
+        LOCK2(cs_main, cs_wallet);
+        CTxDB txdb("r");
+
+        if (!txdb.ReadTxIndex(outpoint.hash, txindex))
+            return false;
+
+        if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+            return false;
+    }
+
+    vector<valtype> vSolutions;
+    txnouttype whichType;
+
+    if (!Solver(wtx.vout[n].scriptPubKey, whichType, vSolutions))
+        whichType = TX_NONSTANDARD;
+
+    candidate.SetNull();
+    candidate.hashBlock = block.GetHash();
+    candidate.nBlockTime = block.GetBlockTime();
+    candidate.nTxOffset = txindex.pos.nTxPos - txindex.pos.nBlockPos;
+    candidate.nTxTime = wtx.nTime;
+    candidate.nValue = wtx.vout[n].nValue;
+    candidate.nScriptType = whichType;
+
+    LOCK(cs_wallet);
+    mapStakeCandidates[outpoint] = candidate;
+
+    if (fFileBacked)
+        CWalletDB(strWalletFile).WriteStakeCandidate(outpoint, candidate);
+
+    return true;
+}
+
 bool CReserveKey::GetReservedKey(CPubKey& pubkey)
 {
     if (nIndex == -1)
@@ -3622,7 +4058,7 @@ void CWallet::GetKeyBirthTimes(std::map<CKeyID, int64_t> &mapKeyBirth) const
             mapKeyBirth[it->first] = it->second.nCreateTime;
 
     // map in which we'll infer heights of other keys
-    CBlockIndex *pindexMax = FindBlockByHeight(std::max(0, nBestHeight - 144)); // the tip can be reorganised; use a 144-block safety margin
+    CBlockIndex *pindexMax = chainActive[std::max(0, nBestHeight - 144)]; // the tip can be reorganised; use a 144-block safety margin
     std::map<CKeyID, CBlockIndex*> mapKeyFirstBlock;
     std::set<CKeyID> setKeys;
     GetKeys(setKeys);
@@ -9,6 +9,7 @@
 #ifndef BITCOIN_WALLET_H
 #define BITCOIN_WALLET_H
 
+#include <atomic>
 #include <string>
 #include <vector>
 #include <stdlib.h>
@@ -400,6 +401,18 @@ public:
     void RelayWalletTransaction();
 };
 
+// Running balance totals of a wallet, see CWallet::GetBalances
+struct CWalletBalances
+{
+    int64_t nTrusted;
+    int64_t nUnconfirmed;
+    int64_t nImmature;
+    int64_t nStake;
+    int64_t nNewMint;
+
+    CWalletBalances() : nTrusted(0), nUnconfirmed(0), nImmature(0), nStake(0), nNewMint(0) {}
+};
+
 // A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
 // and provides the ability to create new transactions
 
@@ -419,6 +432,18 @@ private:
                      const CCoinControl *coinControl = NULL, AvailableCoinsType coin_type=ALL_COINS,
                      bool useIX = false) const;
 
+    // Balance totals, valid while the tip and nCoinIndexUpdated are what they were computed at
+    mutable CWalletBalances balancesCached;
+    mutable bool fBalancesCached;
+    mutable const CBlockIndex* pindexBalancesCached;
+    mutable unsigned int nBalancesCachedUpdate;
+    unsigned int nCoinIndexUpdated;
+
+    const CWalletBalances& GetBalances() const;
+
+    std::atomic<bool> fAbortRescan;
+    std::atomic<bool> fScanningWallet;
+
     CWalletDB *pwalletdbEncryption;
     int nWalletVersion; // clients below this version are not able to load the wallet
     int nWalletMaxVersion; // memory-only variable that specifies to what version this wallet may be upgraded
@@ -479,6 +504,12 @@ public:
         nOrderPosNext = 0;
         nTimeFirstKey = 0;
         fWalletUnlockAnonymizeOnly = false;
+        fBalancesCached = false;
+        pindexBalancesCached = NULL;
+        nBalancesCachedUpdate = 0;
+        nCoinIndexUpdated = 0;
+        fAbortRescan = false;
+        fScanningWallet = false;
     }
 
     robin_hood::unordered_node_map<uint256, CWalletTx> mapWallet;
@@ -490,6 +521,16 @@ public:
     int64_t nTimeFirstKey;
     std::set<COutPoint> setLockedCoins;
 
+    // Kernel data of the unspent confirmed outputs, maintained as blocks are connected and disconnected
+    std::map<COutPoint, CStakeCandidate> mapStakeCandidates;
+
+    // Transactions with an unspent output of ours, maintained wherever spent flags change, so that
+    // balances and coin selection only visit these instead of all of mapWallet
+    std::set<uint256> setUnspentTxs;
+
+    void UpdateCoinIndex(const CWalletTx& wtx);
+    void RebuildCoinIndex();
+
     // check whether we are allowed to upgrade (or already support) to the named feature
     bool CanSupportFeature(enum WalletFeature wf) { return nWalletMaxVersion >= wf; }
 
@@ -550,6 +591,8 @@ public:
     bool EraseFromWallet(uint256 hash);
     void WalletUpdateSpent(const CTransaction& prevout, bool fBlock = false);
     int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
+    void AbortRescan() { fAbortRescan = true; }
+    bool IsScanning() const { return fScanningWallet; }
     void ReacceptWalletTransactions();
     void ResendWalletTransactions(bool fForce = false);
     int64_t GetBalance() const;
@@ -655,6 +698,10 @@ public:
     void FixSpentCoins(int& nMismatchSpent, int64_t& nBalanceInQuestion, bool fCheckOnly = false);
     void DisableTransaction(const CTransaction &tx);
 
+    void AddStakeCandidates(const CWalletTx& wtx, const CBlock& block);
+    void EraseStakeCandidates(const CTransaction& tx);
+    bool GetStakeCandidate(const CWalletTx& wtx, unsigned int n, CStakeCandidate& candidate);
+
     // Address book entry changed
     // NOTE: called with lock cs_wallet held
     boost::signals2::signal<void (CWallet *wallet, const CTxDestination &address, const std::string &label,
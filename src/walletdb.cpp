@@ -463,6 +463,12 @@ bool ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
         {
             ssValue >> pwallet->nOrderPosNext;
         }
+        else if (strType == "stakecand")
+        {
+            COutPoint outpoint;
+            ssKey >> outpoint;
+            ssValue >> pwallet->mapStakeCandidates[outpoint];
+        }
         else if (strType == "adrenaline")
         {
             std::string sAlias;
@@ -78,6 +78,50 @@ public:
     )
 };
 
+/** The parts of a wallet output and of the block containing it that enter the
+ *  stake kernel hash. Kept per outpoint so that staking does not need to read
+ *  the transaction index and the block header from disk for every coin.
+ */
+class CStakeCandidate
+{
+public:
+    static const int CURRENT_VERSION=1;
+    int nVersion;
+    uint256 hashBlock;
+    unsigned int nBlockTime;
+    unsigned int nTxOffset; // offset of the transaction inside its block
+    unsigned int nTxTime;
+    int64_t nValue;
+    int nScriptType; // txnouttype of the output script
+
+    CStakeCandidate()
+    {
+        SetNull();
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(this->nVersion);
+        nVersion = this->nVersion;
+        READWRITE(hashBlock);
+        READWRITE(nBlockTime);
+        READWRITE(nTxOffset);
+        READWRITE(nTxTime);
+        READWRITE(nValue);
+        READWRITE(nScriptType);
+    )
+
+    void SetNull()
+    {
+        nVersion = CStakeCandidate::CURRENT_VERSION;
+        hashBlock = 0;
+        nBlockTime = 0;
+        nTxOffset = 0;
+        nTxTime = 0;
+        nValue = 0;
+        nScriptType = 0;
+    }
+};
 
 /** Access to the wallet database (wallet.dat) */
 class CWalletDB : public CDB
@@ -106,6 +150,18 @@ public:
         return Erase(std::make_pair(std::string("tx"), hash));
     }
 
+    bool WriteStakeCandidate(const COutPoint& outpoint, const CStakeCandidate& candidate)
+    {
+        nWalletDBUpdated++;
+        return Write(std::make_pair(std::string("stakecand"), outpoint), candidate);
+    }
+
+    bool EraseStakeCandidate(const COutPoint& outpoint)
+    {
+        nWalletDBUpdated++;
+        return Erase(std::make_pair(std::string("stakecand"), outpoint));
+    }
+
     bool WriteAdrenalineNodeConfig(std::string sAlias, const CAdrenalineNodeConfig& nodeConfig);
     bool ReadAdrenalineNodeConfig(std::string sAlias, CAdrenalineNodeConfig& nodeConfig);
     bool EraseAdrenalineNodeConfig(std::string sAlias);